@@ -0,0 +1,486 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <random>
+#include <vector>
+#include <unistd.h>
+
+#include "../lib/book.h"
+#include "../lib/thread.h"
+#include "perf_counters.h"
+
+using namespace redheads;
+
+typedef std::chrono::steady_clock Clock;
+
+enum FlowOpType : uint8_t
+{
+    OP_INSERT,
+    OP_CANCEL,
+    OP_AMEND,
+    OP_QUOTE,
+    OP_BULK_DELETE,
+    OP_TYPES
+};
+
+static const char* FLOW_OP_NAMES[OP_TYPES] = {"insert", "cancel", "amend", "quote", "bulkdelete"};
+
+struct FlowConfig
+{
+    size_t mOps = 1000000;
+    size_t mDepth = 100;            // levels seeded each side
+    size_t mOrdersPerLevel = 2;
+    uint16_t mClients = 16;
+    double mTouchMean = 3.0;        // mean ticks behind the touch of passive prices
+    double mAggressive = 0.1;       // fraction of inserts crossing the spread
+    unsigned mWeights[OP_TYPES] = {500, 300, 150, 49, 1};
+    BookBehaviours mBehaviours = BookBehaviours(0);
+    uint64_t mSeed = 1;
+    size_t mRuns = 15;              // timed throughput runs of each book
+    int mCore = NO_CORE;            // pinned to, the core started on when unset
+};
+
+// Generated up front so the run only pays for the book. Cancels and amends
+// resolve mPick against the orders live at the time they run.
+struct FlowOp
+{
+    FlowOpType mType;
+    bool       mIsBid;
+    bool       mAggressive;
+    uint16_t   mClientId;
+    int64_t    mTicks;
+    int64_t    mVolume;
+    uint32_t   mPick;
+};
+
+constexpr int64_t MID_PRICE = 100000;
+
+std::vector<FlowOp> GenerateFlow(const FlowConfig& config)
+{
+    std::mt19937_64 rng(config.mSeed);
+    std::discrete_distribution<int> type(config.mWeights, config.mWeights + OP_TYPES);
+    std::geometric_distribution<int64_t> ticks(1.0 / (1.0 + config.mTouchMean));
+    std::uniform_int_distribution<uint16_t> client(1, config.mClients);
+    std::uniform_int_distribution<int64_t> volume(1, 10);
+    std::bernoulli_distribution aggressive(config.mAggressive);
+
+    std::vector<FlowOp> flow(config.mOps);
+    for(auto& op : flow)
+    {
+        op.mType = FlowOpType(type(rng));
+        op.mIsBid = rng() & 1;
+        op.mAggressive = op.mType == OP_INSERT && aggressive(rng);
+        op.mClientId = client(rng);
+        op.mTicks = ticks(rng);
+        op.mVolume = volume(rng);
+        op.mPick = (uint32_t)rng();
+    }
+    return flow;
+}
+
+// Passive prices sit behind the touch either side of MID_PRICE, aggressive
+// ones reach through it
+inline int64_t FlowPrice(bool isBid, bool aggressive, int64_t ticks)
+{
+    int64_t away = 1 + ticks;
+    if(aggressive) away = -away;
+    return isBid ? MID_PRICE - away : MID_PRICE + away;
+}
+
+struct LiveOrder
+{
+    uint64_t mOrderId;
+    uint16_t mClientId;
+    bool     mIsBid;
+};
+
+// Does no more than track the live orders for later cancels and amends,
+// and grow the pools when the book runs out. An order leaves on its delete
+// indication, which traded out, cancelled and bulk deleted orders all get,
+// or on its fill when swept. Final so BasicBook<BenchBookClient> calls it
+// directly, through Book the same calls stay virtual.
+struct BenchBookClient final : IBookClient
+{
+    BenchBookClient(SharedBookMem& mem) : mMem(mem)
+    {
+        mLiveIdx.set_empty_key(NULL_ID);
+        mLiveIdx.set_deleted_key(std::numeric_limits<uint64_t>::max());
+    }
+
+    void Handle(const BookClearInd&& ind) {}
+    void Handle(const BookInsertInd&& ind)
+    {
+        if(!(ind.mFlags & OrderFlags::IS_FAK))
+        {
+            mLiveIdx[ind.mOrderId] = mLive.size();
+            mLive.push_back(LiveOrder{ind.mOrderId, ind.mClientId, (ind.mFlags & OrderFlags::IS_BID) != 0});
+        }
+    }
+    void Handle(const BookDeleteInd&& ind) { Remove(ind.mOrderId); }
+    void Handle(const BookAmendInd&& ind)
+    {
+        if(ind.mNewOrderId == ind.mOrigOrderId) return;
+        auto itr = mLiveIdx.find(ind.mOrigOrderId);
+        if(itr == mLiveIdx.end()) return;
+        size_t idx = itr->second;
+        mLiveIdx.erase(itr);
+        mLive[idx].mOrderId = ind.mNewOrderId;
+        mLiveIdx[ind.mNewOrderId] = idx;
+    }
+    void Handle(const BookTradeInd&& ind) { ++mTrades; }
+    void Handle(const BookSweepInd&& ind) {}
+    void Handle(const BookFillInd&& ind)
+    {
+        ++mTrades;
+        Remove(ind.mPassiveOrderId);
+    }
+    void Handle(const BookDepthInd&& ind) {}
+    void Handle(const BookErrorInd&& ind) { ++mErrors; }
+
+    void ImmediateCleanup()
+    {
+        mMem.FreeDroppedLevels();
+        if(mMem.mOrderFreeList.empty()) mMem.Grow(2*mMem.mOrderPool.size());
+    }
+
+    // Ids of orders already gone, such as the aggressor of a fill and kill,
+    // are not tracked
+    inline void Remove(uint64_t orderId)
+    {
+        auto itr = mLiveIdx.find(orderId);
+        if(itr == mLiveIdx.end()) return;
+        size_t idx = itr->second;
+        mLiveIdx.erase(itr);
+        if(idx != mLive.size() - 1)
+        {
+            mLive[idx] = mLive.back();
+            mLiveIdx[mLive[idx].mOrderId] = idx;
+        }
+        mLive.pop_back();
+    }
+
+    // A book emptied by the flow leaves nothing to pick, the op then fails
+    inline LiveOrder Pick(uint32_t pick)
+    {
+        if(UNLIKELY(mLive.empty()))
+        {
+            ++mEmptyPicks;
+            return LiveOrder{NULL_ID, 0, false};
+        }
+        return mLive[pick % mLive.size()];
+    }
+
+    SharedBookMem& mMem;
+    std::vector<LiveOrder> mLive;
+    google::dense_hash_map<uint64_t, size_t> mLiveIdx; // position in mLive by order id
+    uint64_t mTrades = 0;
+    uint64_t mErrors = 0;
+    uint64_t mEmptyPicks = 0;
+};
+
+template<typename B>
+struct BenchBook
+{
+    BenchBook(const FlowConfig& config)
+    : mClient(mMem)
+    , mBook(config.mBehaviours, 1, 0, mMem, mClient)
+    , mQuoteBuf(sizeof(BookQuoteReq) + 2*sizeof(QuoteLevel))
+    {
+        size_t orders = 2*config.mDepth*config.mOrdersPerLevel + config.mOps + 1;
+        mMem.mClientOrders.set_empty_key(std::numeric_limits<uint32_t>::max());
+        mMem.Grow(orders);
+        mClient.mLive.reserve(orders);
+        mClient.mLiveIdx.resize(orders);
+
+        uint16_t client = 1;
+        for(size_t level = 0; level < config.mDepth; ++level)
+        {
+            for(size_t i = 0; i < config.mOrdersPerLevel; ++i)
+            {
+                Insert(client, true, FlowPrice(true, false, level), 1);
+                Insert(client, false, FlowPrice(false, false, level), 1);
+                client = client % config.mClients + 1;
+            }
+        }
+    }
+
+    inline void Insert(uint16_t clientId, bool isBid, int64_t price, int64_t volume, bool fak=false)
+    {
+        BookInsertReq req;
+        memset(&req, 0, sizeof(req));
+        req.mClientId = clientId;
+        req.mFlags = OrderFlags((isBid ? OrderFlags::IS_BID : OrderFlags::IS_ASK) | (fak ? OrderFlags::IS_FAK : 0));
+        req.mPrice = price;
+        req.mVolume = volume;
+        mBook.InsertReq(req);
+    }
+
+    inline void Run(const FlowOp& op)
+    {
+        switch(op.mType)
+        {
+            case OP_INSERT:
+            {
+                // Aggressors are fill and kill so the touch stays around MID_PRICE
+                Insert(op.mClientId, op.mIsBid, FlowPrice(op.mIsBid, op.mAggressive, op.mTicks), op.mVolume,
+                    op.mAggressive);
+                break;
+            }
+            case OP_CANCEL:
+            {
+                auto picked = mClient.Pick(op.mPick);
+                mBook.DeleteReq(BookDeleteReq{picked.mClientId, picked.mOrderId});
+                break;
+            }
+            case OP_AMEND:
+            {
+                auto picked = mClient.Pick(op.mPick);
+                BookAmendReq req;
+                memset(&req, 0, sizeof(req));
+                req.mClientId = picked.mClientId;
+                req.mOrderId = picked.mOrderId;
+                req.mVolume = op.mVolume;
+                // Every other amend is a volume only change keeping its price
+                if(op.mPick & 1) req.mPrice = FlowPrice(picked.mIsBid, false, op.mTicks);
+                mBook.AmendReq(req);
+                break;
+            }
+            case OP_QUOTE:
+            {
+                auto& req = *reinterpret_cast<BookQuoteReq*>(mQuoteBuf.data());
+                memset(&req, 0, mQuoteBuf.size());
+                req.mClientId = op.mClientId;
+                req.mBids = 1;
+                req.mAsks = 1;
+                req.mQuotes[0] = QuoteLevel{FlowPrice(true, false, op.mTicks), op.mVolume};
+                req.mQuotes[1] = QuoteLevel{FlowPrice(false, false, op.mTicks), op.mVolume};
+                mBook.QuoteReq(req);
+                break;
+            }
+            case OP_BULK_DELETE:
+            {
+                BookBulkDeleteReq req;
+                memset(&req, 0, sizeof(req));
+                req.mClientId = op.mClientId;
+                req.mFlags = OrderFlags(OrderFlags::IS_BID | OrderFlags::IS_ASK);
+                mBook.BulkDeleteReq(req);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    SharedBookMem mMem;
+    BenchBookClient mClient;
+    B mBook;
+    std::vector<char> mQuoteBuf;
+};
+
+inline uint32_t Percentile(const std::vector<uint32_t>& sorted, double p)
+{
+    return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+}
+
+// Cancels and amends only pick live orders, so errors mean the flow has
+// drifted from the book and is no longer measuring what it claims to
+constexpr double MAX_ERROR_RATE = 0.001;
+
+// Errors as a fraction of the cancels and amends, which are all that can fail
+double ErrorRate(uint64_t errors, const std::vector<FlowOp>& flow)
+{
+    size_t picks = std::count_if(flow.begin(), flow.end(), [](const FlowOp& op)
+    {
+        return op.mType == OP_CANCEL || op.mType == OP_AMEND;
+    });
+    return picks ? (double)errors / picks : 0.0;
+}
+
+// One timed pass of the flow over a freshly seeded book
+struct ThroughputRun
+{
+    double mOpsPerSec;
+    uint64_t mTrades;
+    uint64_t mErrors;
+    uint64_t mEmptyPicks;
+    bool mCounted[PerfCounters::COUNTERS];
+    uint64_t mCounters[PerfCounters::COUNTERS];
+};
+
+template<typename T>
+ThroughputRun RunThroughput(const FlowConfig& config, const std::vector<FlowOp>& flow)
+{
+    PerfCounters counters;
+    T bench(config);
+    counters.Start();
+    auto start = Clock::now();
+    for(const auto& op : flow) bench.Run(op);
+    auto end = Clock::now();
+    counters.Stop();
+
+    ThroughputRun run;
+    run.mOpsPerSec = flow.size() / std::chrono::duration<double>(end - start).count();
+    run.mTrades = bench.mClient.mTrades;
+    run.mErrors = bench.mClient.mErrors;
+    run.mEmptyPicks = bench.mClient.mEmptyPicks;
+    for(size_t i = 0; i < PerfCounters::COUNTERS; ++i)
+    {
+        auto counter = PerfCounters::Counter(i);
+        run.mCounted[i] = counters.Available(counter);
+        run.mCounters[i] = counters.Value(counter);
+    }
+    return run;
+}
+
+double Median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    size_t mid = values.size() / 2;
+    return values.size() & 1 ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+}
+
+// Median and spread of a book's runs, counters averaged over all of them.
+// Every run replays the same flow, so trades and errors are those of any.
+bool ReportThroughput(const char* name, const std::vector<ThroughputRun>& runs, const std::vector<FlowOp>& flow)
+{
+    std::vector<double> rates;
+    for(const auto& run : runs) rates.push_back(run.mOpsPerSec);
+    double median = Median(rates);
+    double low = *std::min_element(rates.begin(), rates.end());
+    double high = *std::max_element(rates.begin(), rates.end());
+    const auto& first = runs.front();
+    double errorRate = ErrorRate(first.mErrors, flow);
+    printf("%-8s %zu runs of %zu ops, median %.0f ops/sec, min %.0f max %.0f (spread %.1f%%)\n", name,
+        runs.size(), flow.size(), median, low, high, 100.0 * (high - low) / median);
+    printf("  %lu trades, %lu errors (%.3f%% of cancels and amends, %lu with the book empty)\n",
+        first.mTrades, first.mErrors, 100.0 * errorRate, first.mEmptyPicks);
+
+    static const char* names[PerfCounters::COUNTERS] = {"cycles", "instructions", "cache-misses", "branch-misses"};
+    for(size_t i = 0; i < PerfCounters::COUNTERS; ++i)
+    {
+        if(first.mCounted[i])
+        {
+            uint64_t total = 0;
+            for(const auto& run : runs) total += run.mCounters[i];
+            printf("  %-14s %12.2f/op\n", names[i], (double)total / (runs.size() * flow.size()));
+        }
+        else
+        {
+            printf("  %-14s %12s\n", names[i], "n/a");
+        }
+    }
+    return errorRate <= MAX_ERROR_RATE;
+}
+
+void usage()
+{
+    printf("rh_bench_book [-n OPS] [-d DEPTH] [-o ORDERS_PER_LEVEL] [-c CLIENTS] [-m TOUCH_MEAN_TICKS] "
+        "[-a AGGRESSIVE_FRACTION] [-w INSERT,CANCEL,AMEND,QUOTE,BULKDELETE] [-t] [-S] [-s SEED] [-r RUNS] "
+        "[-p CORE]\n"
+        "  -t uses the tick ladder book layout\n"
+        "  -S reports whole levels taken as sweeps with fills\n"
+        "  -r timed throughput runs of each book, interleaved\n"
+        "  -p core to pin to, by default the one started on\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    FlowConfig config;
+    int c;
+    while ((c = getopt (argc, argv, "n:d:o:c:m:a:w:tSs:r:p:")) != -1)
+    {
+        switch (c)
+        {
+            case 'n': config.mOps = atol(optarg); break;
+            case 'd': config.mDepth = atol(optarg); break;
+            case 'o': config.mOrdersPerLevel = atol(optarg); break;
+            case 'c': config.mClients = atoi(optarg); break;
+            case 'm': config.mTouchMean = atof(optarg); break;
+            case 'a': config.mAggressive = atof(optarg); break;
+            case 'w':
+                if(sscanf(optarg, "%u,%u,%u,%u,%u", &config.mWeights[OP_INSERT], &config.mWeights[OP_CANCEL],
+                    &config.mWeights[OP_AMEND], &config.mWeights[OP_QUOTE], &config.mWeights[OP_BULK_DELETE]) != 5)
+                {
+                    usage();
+                }
+                break;
+            case 't': config.mBehaviours = BookBehaviours(config.mBehaviours | TICK_LADDER); break;
+            case 'S': config.mBehaviours = BookBehaviours(config.mBehaviours | SWEEP_FILLS); break;
+            case 's': config.mSeed = atoll(optarg); break;
+            case 'r': config.mRuns = atol(optarg); break;
+            case 'p': config.mCore = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    if(!config.mOps || !config.mClients || !config.mRuns) usage();
+
+    auto flow = GenerateFlow(config);
+
+    if(config.mCore == NO_CORE) config.mCore = sched_getcpu();
+    if(!PinThread(pthread_self(), config.mCore)) fprintf(stderr, "Failed to pin to core %d\n", config.mCore);
+
+    // Throughput, nothing timed per op, with the client called virtually
+    // through Book and statically through BasicBook<BenchBookClient>. Runs
+    // are interleaved, alternating which book goes first, so drift falls on
+    // both alike. Each pair gives a speedup, compared by their median and
+    // range rather than by any one run.
+    typedef BenchBook<Book> VirtualBench;
+    typedef BenchBook<BasicBook<BenchBookClient>> StaticBench;
+    RunThroughput<VirtualBench>(config, flow);
+    RunThroughput<StaticBench>(config, flow);
+    std::vector<ThroughputRun> virtualRuns, staticRuns;
+    std::vector<double> speedups;
+    for(size_t run = 0; run < config.mRuns; ++run)
+    {
+        if(run & 1)
+        {
+            staticRuns.push_back(RunThroughput<StaticBench>(config, flow));
+            virtualRuns.push_back(RunThroughput<VirtualBench>(config, flow));
+        }
+        else
+        {
+            virtualRuns.push_back(RunThroughput<VirtualBench>(config, flow));
+            staticRuns.push_back(RunThroughput<StaticBench>(config, flow));
+        }
+        speedups.push_back(staticRuns.back().mOpsPerSec / virtualRuns.back().mOpsPerSec - 1.0);
+    }
+    bool ok = ReportThroughput("virtual", virtualRuns, flow);
+    ok &= ReportThroughput("static", staticRuns, flow);
+    printf("static over virtual on core %d: median %+.1f%%, min %+.1f%% max %+.1f%% over %zu pairs\n",
+        config.mCore, 100.0 * Median(speedups), 100.0 * *std::min_element(speedups.begin(), speedups.end()),
+        100.0 * *std::max_element(speedups.begin(), speedups.end()), speedups.size());
+
+    // Latency of each op on a fresh book given the same flow
+    std::vector<uint32_t> latencies[OP_TYPES];
+    for(auto& lat : latencies) lat.reserve(flow.size());
+    {
+        StaticBench bench(config);
+        for(const auto& op : flow)
+        {
+            auto start = Clock::now();
+            bench.Run(op);
+            auto end = Clock::now();
+            latencies[op.mType].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        }
+        ok &= ErrorRate(bench.mClient.mErrors, flow) <= MAX_ERROR_RATE;
+    }
+
+    printf("%-12s %10s %8s %8s %8s %8s %10s\n", "op", "count", "p50 ns", "p90", "p99", "p99.9", "max");
+    for(size_t i = 0; i < OP_TYPES; ++i)
+    {
+        auto& lat = latencies[i];
+        if(lat.empty()) continue;
+        std::sort(lat.begin(), lat.end());
+        printf("%-12s %10zu %8u %8u %8u %8u %10u\n", FLOW_OP_NAMES[i], lat.size(), Percentile(lat, 0.5),
+            Percentile(lat, 0.9), Percentile(lat, 0.99), Percentile(lat, 0.999), lat.back());
+    }
+    if(!ok)
+    {
+        fprintf(stderr, "error rate above %.1f%% of cancels and amends\n", 100.0 * MAX_ERROR_RATE);
+        return 1;
+    }
+    return 0;
+}
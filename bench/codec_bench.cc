@@ -0,0 +1,362 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+#include <unistd.h>
+
+#include "../lib/engine.h"
+
+using namespace redheads;
+
+typedef std::chrono::steady_clock Clock;
+
+struct CodecConfig
+{
+    size_t mMessages = 100000;  // in the decode corpus
+    size_t mRepeats = 100;      // passes over the corpus per timed run
+    size_t mFuzz = 1000000;     // mutated requests through an Engine
+    uint64_t mSeed = 1;
+};
+
+constexpr int64_t MID_PRICE = 100000;
+
+// A request as the engine receives it, header and body
+typedef std::vector<char> Msg;
+
+EngSeriesId BenchSeries()
+{
+    EngSeriesId series{};
+    series.mCountry = 1;
+    series.mCommodity = 7;
+    series.mExpirationDate = 1;
+    series.mStrikePrice = 100;
+    return series;
+}
+
+template<typename T>
+void Append(Msg& msg, const T& part)
+{
+    msg.insert(msg.end(), reinterpret_cast<const char*>(&part), reinterpret_cast<const char*>(&part) + sizeof(part));
+}
+
+Msg Header(EngMsgId id)
+{
+    Msg msg;
+    Append(msg, EngOperationReq{id, BenchSeries(), OperationId{1, 0}});
+    return msg;
+}
+
+// A well formed book request of a random type
+Msg GenerateMsg(std::mt19937_64& rng)
+{
+    static const EngMsgId ids[] = {EngMsgId::PART_BOOK_OP_CLEAR_REQ, EngMsgId::PART_BOOK_OP_INSERT_REQ,
+        EngMsgId::PART_BOOK_OP_QUOTE_REQ, EngMsgId::PART_BOOK_OP_DEL_REQ, EngMsgId::PART_BOOK_OP_BULK_DEL_REQ,
+        EngMsgId::PART_BOOK_OP_AMEND_REQ};
+    // Mostly inserts, clears are rare enough to leave a book to work on
+    static const unsigned weights[] = {1, 500, 100, 250, 10, 139};
+    std::discrete_distribution<int> type(std::begin(weights), std::end(weights));
+    std::uniform_int_distribution<uint16_t> client(1, 16);
+    std::uniform_int_distribution<int64_t> ticks(1, 50);
+    std::uniform_int_distribution<int64_t> volume(1, 10);
+    std::uniform_int_distribution<uint64_t> orderId(1, 100000);
+    std::uniform_int_distribution<int> levels(0, 5);
+
+    EngMsgId id = ids[type(rng)];
+    Msg msg = Header(id);
+    bool isBid = rng() & 1;
+    switch(id)
+    {
+        case EngMsgId::PART_BOOK_OP_INSERT_REQ:
+            Append(msg, BookInsertReq{client(rng), isBid ? IS_BID : IS_ASK,
+                isBid ? MID_PRICE - ticks(rng) : MID_PRICE + ticks(rng), volume(rng), {}});
+            break;
+        case EngMsgId::PART_BOOK_OP_QUOTE_REQ:
+        {
+            BookQuoteReq quote{client(rng), {}, (uint8_t)levels(rng), (uint8_t)levels(rng)};
+            Append(msg, quote);
+            for(int i = 0; i < quote.mBids; ++i) Append(msg, QuoteLevel{MID_PRICE - 1 - i, volume(rng)});
+            for(int i = 0; i < quote.mAsks; ++i) Append(msg, QuoteLevel{MID_PRICE + 1 + i, volume(rng)});
+            break;
+        }
+        case EngMsgId::PART_BOOK_OP_DEL_REQ:
+            Append(msg, BookDeleteReq{client(rng), orderId(rng)});
+            break;
+        case EngMsgId::PART_BOOK_OP_BULK_DEL_REQ:
+            Append(msg, BookBulkDeleteReq{client(rng), isBid ? IS_BID : IS_ASK, {}});
+            break;
+        case EngMsgId::PART_BOOK_OP_AMEND_REQ:
+            Append(msg, BookAmendReq{client(rng), orderId(rng), MID_PRICE + ticks(rng) - 25, volume(rng), false, {}});
+            break;
+        default:
+            break;
+    }
+    return msg;
+}
+
+// The protocol written out again by hand, independent of the schema in
+// engine.h. Bytes a book request needs, more than any message holds for
+// anything that is not a request.
+size_t RequiredSize(const Msg& msg)
+{
+    const char* body = msg.data() + sizeof(EngOperationReq);
+    switch((EngMsgId)msg[0])
+    {
+        case EngMsgId::PART_BOOK_OP_CLEAR_REQ:    return 17;
+        case EngMsgId::PART_BOOK_OP_INSERT_REQ:   return 17 + 29;
+        case EngMsgId::PART_BOOK_OP_DEL_REQ:      return 17 + 10;
+        case EngMsgId::PART_BOOK_OP_BULK_DEL_REQ: return 17 + 13;
+        case EngMsgId::PART_BOOK_OP_AMEND_REQ:    return 17 + 37;
+        case EngMsgId::PART_BOOK_OP_QUOTE_REQ:
+            if(msg.size() < 17 + 14) return 17 + 14;
+            return 17 + 14 + 16*((size_t)(uint8_t)body[12] + (uint8_t)body[13]);
+        default:
+            // Only ever generated holding another batch
+            return std::numeric_limits<size_t>::max();
+    }
+}
+
+// Truncates, pads, retypes, miscounts or nests a well formed request.
+// Values stay sane so the books only ever see what the framing lets through.
+void Mutate(Msg& msg, std::mt19937_64& rng)
+{
+    const size_t maxSize = MAX_MSG_SIZE;
+    switch(rng() % 7)
+    {
+        case 0:
+            break;
+        case 1:
+            msg.resize(sizeof(EngOperationReq) + rng() % (msg.size() - sizeof(EngOperationReq) + 1));
+            break;
+        case 2:
+            msg.resize(std::min(maxSize, msg.size() + 1 + rng() % 32), 0);
+            break;
+        case 3:
+            // Retyped as another book request or an indication, never a
+            // create or batch which carry framing of their own
+            msg[0] = (char)(rng() & 1 ? (uint8_t)EngMsgId::PART_BOOK_OP_CLEAR_REQ + rng() % 6 :
+                (uint8_t)EngMsgId::PART_BOOK_AVAIL_IND + rng() % 9);
+            break;
+        case 4:
+        {
+            if((EngMsgId)msg[0] != EngMsgId::PART_BOOK_OP_QUOTE_REQ || msg.size() < sizeof(EngOperationReq) + 14) break;
+            uint8_t bids = rng() % 64, asks = rng() % 64;
+            msg[sizeof(EngOperationReq) + 12] = (char)bids;
+            msg[sizeof(EngOperationReq) + 13] = (char)asks;
+            // Half the time the levels are actually there
+            if(rng() & 1) break;
+            msg.resize(sizeof(EngOperationReq) + 14);
+            for(int i = 0; i < bids; ++i) Append(msg, QuoteLevel{MID_PRICE - 1 - i, 1});
+            for(int i = 0; i < asks; ++i) Append(msg, QuoteLevel{MID_PRICE + 1 + i, 1});
+            msg.resize(std::min(msg.size(), maxSize));
+            break;
+        }
+        case 5:
+            // An id past the end of EngMsgId
+            msg[0] = (char)((uint8_t)EngMsgId::PART_OP_REJ + 1 + rng() % 200);
+            break;
+        case 6:
+        {
+            // A batch of one holding a batch
+            Msg op = msg;
+            op[0] = (char)EngMsgId::PART_OP_BATCH_REQ;
+            msg = Header(EngMsgId::PART_OP_BATCH_REQ);
+            Append(msg, EngBatchReq{1});
+            Append(msg, (uint16_t)op.size());
+            msg.insert(msg.end(), op.begin(), op.end());
+            break;
+        }
+    }
+}
+
+// The request's sequence and, for a batch, that of its one operation
+void SetSequence(Msg& msg, uint16_t sequence)
+{
+    reinterpret_cast<EngOperationReq*>(msg.data())->mOperationId.mSequence = sequence;
+    if((EngMsgId)msg[0] != EngMsgId::PART_OP_BATCH_REQ) return;
+    size_t op = sizeof(EngOperationReq) + ENG_BATCH_BODY_SIZE + sizeof(uint16_t);
+    reinterpret_cast<EngOperationReq*>(msg.data() + op)->mOperationId.mSequence = sequence;
+}
+
+struct FuzzClient : NullEngineClient
+{
+    using NullEngineClient::Handle;
+    void Handle(const EngOperationCnf&& cnf) { ++mConfirmed; }
+    void Handle(const EngOperationRej&& rej) { ++mRejected; }
+    uint64_t mConfirmed = 0;
+    uint64_t mRejected = 0;
+};
+
+// Every mutated request goes through HandleMsg in sequence. Exactly those
+// the hand written protocol says are short or not requests must be rejected and counted as
+// malformed, every other one confirmed. A rejected request leaves its
+// sequence to the next. Returns the number of mismatches.
+size_t RunFuzz(const CodecConfig& config)
+{
+    std::mt19937_64 rng(config.mSeed);
+    FuzzClient client;
+    Engine engine(client);
+    engine.Init(1000, 100000, 100);
+
+    Msg create;
+    Append(create, EngCreateBookReq{EngMsgId::PART_BOOK_CREATE_REQ, BenchSeries(), OperationId{1, 1}, 1,
+        BookBehaviours(0)});
+    engine.HandleMsg(create.data(), create.size());
+
+    size_t expectedMalformed = 0, mismatches = 0, rejected = 0;
+    uint16_t seq = 1;
+    for(size_t i = 0; i < config.mFuzz; ++i)
+    {
+        Msg msg = GenerateMsg(rng);
+        Mutate(msg, rng);
+        // Sequences are 16 bits, start the gateway over before they wrap
+        if(seq == std::numeric_limits<uint16_t>::max())
+        {
+            seq = 0;
+            engine.mLastOpId = 0;
+        }
+        SetSequence(msg, seq + 1);
+
+        size_t required = RequiredSize(msg);
+        bool malformed = msg.size() < required;
+        uint64_t before = engine.mMalformed;
+        uint64_t confirmed = client.mConfirmed;
+        uint64_t rejectedBefore = client.mRejected;
+        engine.HandleMsg(msg.data(), msg.size());
+        bool wasRejected = client.mRejected != rejectedBefore;
+        if(wasRejected != malformed || (engine.mMalformed != before) != malformed ||
+            (client.mConfirmed != confirmed) == malformed)
+        {
+            if(++mismatches <= 10)
+            {
+                fprintf(stderr, "mismatch: id %u size %zu required %zu\n", (uint8_t)msg[0], msg.size(), required);
+            }
+        }
+        expectedMalformed += malformed;
+        rejected += wasRejected;
+        if(!wasRejected) ++seq;
+    }
+    if(client.mConfirmed + client.mRejected != config.mFuzz + 1 || engine.mMalformed != expectedMalformed)
+    {
+        ++mismatches;
+    }
+
+    printf("fuzz     %zu requests, %zu malformed expected, %zu rejected, %lu confirmed, %zu mismatches\n",
+        config.mFuzz, expectedMalformed, rejected, client.mConfirmed, mismatches);
+    return mismatches;
+}
+
+// Well formed bodies laid end to end as they would sit in receive buffers
+struct Corpus
+{
+    std::vector<char> mData;
+    std::vector<uint32_t> mOffsets;
+    std::vector<uint16_t> mSizes;
+    std::vector<EngMsgId> mIds;
+};
+
+Corpus GenerateCorpus(const CodecConfig& config)
+{
+    std::mt19937_64 rng(config.mSeed + 1);
+    Corpus corpus;
+    for(size_t i = 0; i < config.mMessages; ++i)
+    {
+        Msg msg = GenerateMsg(rng);
+        corpus.mIds.push_back((EngMsgId)msg[0]);
+        corpus.mOffsets.push_back(corpus.mData.size());
+        corpus.mSizes.push_back(msg.size() - sizeof(EngOperationReq));
+        corpus.mData.insert(corpus.mData.end(), msg.begin() + sizeof(EngOperationReq), msg.end());
+    }
+    return corpus;
+}
+
+// A field of each type, so both variants dispatch on the type as the engine does
+inline uint64_t Touch(const BookClearReq&)      { return 1; }
+inline uint64_t Touch(const BookInsertReq& req) { return req.mPrice; }
+inline uint64_t Touch(const BookQuoteReq& req)  { return req.mBids + req.mAsks; }
+inline uint64_t Touch(const BookDeleteReq& req) { return req.mOrderId; }
+inline uint64_t Touch(const BookBulkDeleteReq& req) { return req.mFlags; }
+inline uint64_t Touch(const BookAmendReq& req)  { return req.mVolume; }
+
+// Decodes every body of the corpus the way the engine checks it before
+// dispatch, with the schema's checks or with the bare casts it used to make
+template<bool CHECKED>
+uint64_t DecodeCorpus(const Corpus& corpus)
+{
+    uint64_t sum = 0;
+    for(size_t i = 0; i < corpus.mIds.size(); ++i)
+    {
+        const char* msg = corpus.mData.data() + corpus.mOffsets[i];
+        size_t size = corpus.mSizes[i];
+        switch(corpus.mIds[i])
+        {
+#define DecodeBookReq(__ID, __TYPE_REQ, __SIZE) \
+            case EngMsgId::__ID: \
+            { \
+                const auto* req = CHECKED ? DecodeBody<Book##__TYPE_REQ, __SIZE>(msg, size) : \
+                    reinterpret_cast<const Book##__TYPE_REQ*>(msg); \
+                sum += req ? Touch(*req) : 0; \
+            } \
+            break;
+
+            RH_BOOK_REQUESTS(DecodeBookReq)
+#undef DecodeBookReq
+            default: break;
+        }
+    }
+    return sum;
+}
+
+template<bool CHECKED>
+double RunDecode(const char* name, const Corpus& corpus, const CodecConfig& config)
+{
+    uint64_t sum = 0;
+    auto start = Clock::now();
+    for(size_t r = 0; r < config.mRepeats; ++r)
+    {
+        // As if the buffers had been received again, so passes are not folded
+        asm volatile("" ::: "memory");
+        sum += DecodeCorpus<CHECKED>(corpus);
+    }
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+    size_t decoded = corpus.mIds.size() * config.mRepeats;
+    double ns = secs * 1e9 / decoded;
+    printf("%-8s %zu bodies in %.3fs, %6.2f ns/msg, checksum %lu\n", name, decoded, secs, ns, sum);
+    return ns;
+}
+
+void usage()
+{
+    printf("rh_bench_codec [-n MESSAGES] [-r REPEATS] [-f FUZZ_REQUESTS] [-s SEED]\n"
+        "  fuzzes request framing through an Engine then times decoding with and without validation\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    CodecConfig config;
+    int c;
+    while ((c = getopt (argc, argv, "n:r:f:s:")) != -1)
+    {
+        switch (c)
+        {
+            case 'n': config.mMessages = atol(optarg); break;
+            case 'r': config.mRepeats = atol(optarg); break;
+            case 'f': config.mFuzz = atol(optarg); break;
+            case 's': config.mSeed = atoll(optarg); break;
+            default: usage();
+        }
+    }
+    if(!config.mMessages || !config.mRepeats) usage();
+
+    size_t mismatches = RunFuzz(config);
+
+    auto corpus = GenerateCorpus(config);
+    double unchecked = RunDecode<false>("cast", corpus, config);
+    double checked = RunDecode<true>("checked", corpus, config);
+    printf("validation %.2f ns/msg\n", checked - unchecked);
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,106 @@
+#include <chrono>
+#include <cstdio>
+#include <limits>
+
+#include "../lib/book.h"
+
+using namespace redheads;
+
+struct NullBookClient : IBookClient
+{
+    NullBookClient(SharedBookMem& mem) : mMem(mem) {}
+
+    void Handle(const BookClearInd&& ind) {}
+    void Handle(const BookInsertInd&& ind) {}
+    void Handle(const BookDeleteInd&& ind) {}
+    void Handle(const BookAmendInd&& ind) {}
+    void Handle(const BookTradeInd&& ind) {}
+    void Handle(const BookSweepInd&& ind) {}
+    void Handle(const BookFillInd&& ind) {}
+    void Handle(const BookDepthInd&& ind) {}
+    void Handle(const BookErrorInd&& ind) {}
+
+    void ImmediateCleanup()
+    {
+        mMem.FreeDroppedLevels();
+        if(mMem.mOrderFreeList.empty()) mMem.Grow(2*mMem.mOrderPool.size());
+    }
+
+    SharedBookMem& mMem;
+};
+
+void InitMem(SharedBookMem& mem, size_t orders)
+{
+    mem.mClientOrders.set_empty_key(std::numeric_limits<uint32_t>::max());
+    mem.Grow(orders);
+}
+
+BookInsertReq MakeInsert(OrderFlags flags, int64_t price, int64_t volume)
+{
+    BookInsertReq req;
+    memset(&req, 0, sizeof(req));
+    req.mClientId = 1;
+    req.mFlags = flags;
+    req.mPrice = price;
+    req.mVolume = volume;
+    return req;
+}
+
+// Passive inserts joining the back of the deepest ask level
+double BenchDeepInsert(BookBehaviours behaviours, size_t depth, size_t iterations)
+{
+    SharedBookMem mem;
+    InitMem(mem, depth + iterations + 1);
+    NullBookClient client(mem);
+    Book book(behaviours, 1, 0, mem, client);
+
+    const int64_t top = 10000;
+    for(size_t i = 0; i < depth; ++i) book.InsertReq(MakeInsert(OrderFlags::IS_ASK, top + i, 1));
+
+    auto req = MakeInsert(OrderFlags::IS_ASK, top + depth - 1, 1);
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < iterations; ++i) book.InsertReq(req);
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+// Aggressor taking out the best ask level followed by a passive refill of it
+double BenchTouchChurn(BookBehaviours behaviours, size_t depth, size_t iterations)
+{
+    SharedBookMem mem;
+    InitMem(mem, 2*depth + 2*iterations + 1);
+    NullBookClient client(mem);
+    Book book(behaviours, 1, 0, mem, client);
+
+    const int64_t top = 10000;
+    for(size_t i = 0; i < depth; ++i) book.InsertReq(MakeInsert(OrderFlags::IS_ASK, top + i, 1));
+
+    auto take = MakeInsert(OrderFlags::IS_BID, top, 1);
+    auto refill = MakeInsert(OrderFlags::IS_ASK, top, 1);
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < iterations; ++i)
+    {
+        book.InsertReq(take);
+        book.InsertReq(refill);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / (2*iterations);
+}
+
+int main(int argc, char* argv[])
+{
+    const size_t iterations = 200000;
+    const size_t depths[] = {10, 100, 1000};
+
+    printf("%-8s %-12s %14s %14s\n", "depth", "layout", "deep ns/op", "touch ns/op");
+    for(size_t depth : depths)
+    {
+        printf("%-8zu %-12s %14.1f %14.1f\n", depth, "vector",
+            BenchDeepInsert(BookBehaviours(0), depth, iterations),
+            BenchTouchChurn(BookBehaviours(0), depth, iterations));
+        printf("%-8zu %-12s %14.1f %14.1f\n", depth, "tickladder",
+            BenchDeepInsert(TICK_LADDER, depth, iterations),
+            BenchTouchChurn(TICK_LADDER, depth, iterations));
+    }
+    return 0;
+}
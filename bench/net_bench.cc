@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../lib/publisher.h"
+#include "../lib/udp_ingest.h"
+#include "../lib/uring.h"
+
+using namespace redheads;
+
+typedef std::chrono::steady_clock Clock;
+
+struct NetConfig
+{
+    size_t mDatagrams = 1000000;
+    size_t mSize = 64;          // bytes per datagram or packet
+    size_t mRecvBatch = 32;
+    size_t mRecvRing = 1024;
+    size_t mPubRing = 4096;
+};
+
+// Non blocking UDP socket bound to an ephemeral loopback port
+int LoopbackSocket(sockaddr_in& addr)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(fd < 0) return -1;
+    int bufSize = 64 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufSize, sizeof(bufSize));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if(bind(fd, (sockaddr*)&addr, len) < 0 || getsockname(fd, (sockaddr*)&addr, &len) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends the datagrams to addr from another thread, sendmmsg in batches of
+// 32, while ingest polls them in. Datagrams the receiver was too slow for
+// are dropped by the kernel and reported, not retried.
+template<typename I>
+void RunIngest(const char* name, I& ingest, int sendFd, const NetConfig& config)
+{
+    std::atomic<bool> sent{false};
+    std::thread sender([&]
+    {
+        std::vector<char> payload(config.mSize, 'x');
+        iovec iov{payload.data(), payload.size()};
+        std::vector<mmsghdr> msgs(32);
+        for(auto& msg : msgs)
+        {
+            msg = mmsghdr();
+            msg.msg_hdr.msg_iov = &iov;
+            msg.msg_hdr.msg_iovlen = 1;
+        }
+        size_t remaining = config.mDatagrams;
+        while(remaining)
+        {
+            int count = sendmmsg(sendFd, msgs.data(), std::min(remaining, msgs.size()), 0);
+            if(count > 0) remaining -= count;
+            else std::this_thread::yield();
+        }
+        sent.store(true, std::memory_order_release);
+    });
+
+    size_t received = 0;
+    auto start = Clock::now();
+    auto last = start;
+    while(received < config.mDatagrams)
+    {
+        int count = ingest.Poll([](const char*, size_t){});
+        if(count < 0)
+        {
+            fprintf(stderr, "%s receive failed\n", name);
+            break;
+        }
+        if(count > 0)
+        {
+            received += count;
+            last = Clock::now();
+            continue;
+        }
+        // Whatever is not in by now was dropped
+        if(sent.load(std::memory_order_acquire) && Clock::now() - last > std::chrono::milliseconds(200)) break;
+        std::this_thread::yield();
+    }
+    sender.join();
+
+    double secs = std::chrono::duration<double>(last - start).count();
+    printf("%-16s %9zu datagrams in %.3fs, %10.0f/sec, %9zu dropped, %7.3f syscalls/datagram\n", name,
+        received, secs, received / secs, config.mDatagrams - received,
+        received ? (double)ingest.mStats.mSyscalls / received : 0.0);
+}
+
+// Encodes packets into the publisher's ring from this thread while the
+// publisher sends each to both loopback feeds
+template<typename P>
+void RunPublish(const char* name, P& publisher, const NetConfig& config, uint64_t (*syscalls)(const P&))
+{
+    size_t size = std::min(std::max(config.mSize, sizeof(MdPacketHeader)), MAX_MD_PACKET_SIZE);
+    publisher.Start();
+    auto start = Clock::now();
+    for(size_t i = 0; i < config.mDatagrams; ++i)
+    {
+        MdPacket* packet;
+        while(!(packet = publisher.mRing.Back())) std::this_thread::yield();
+        packet->mSize = size;
+        MdPacketHeader header{i, 0};
+        memcpy(packet->mData, &header, sizeof(header));
+        publisher.mRing.Push();
+    }
+    publisher.Stop();
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+    printf("%-16s %9lu packets   in %.3fs, %10.0f/sec, %9lu errors,  %7.3f syscalls/packet\n", name,
+        publisher.mPackets, secs, publisher.mPackets / secs, publisher.mSendErrors,
+        publisher.mPackets ? (double)syscalls(publisher) / publisher.mPackets : 0.0);
+}
+
+void usage()
+{
+    printf("rh_bench_net [-n DATAGRAMS] [-s SIZE] [-b RECV_BATCH] [-r RECV_RING]\n"
+        "  compares recvmmsg/sendmmsg with io_uring over loopback\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    NetConfig config;
+    int c;
+    while ((c = getopt (argc, argv, "n:s:b:r:")) != -1)
+    {
+        switch (c)
+        {
+            case 'n': config.mDatagrams = atol(optarg); break;
+            case 's': config.mSize = atol(optarg); break;
+            case 'b': config.mRecvBatch = atol(optarg); break;
+            case 'r': config.mRecvRing = atol(optarg); break;
+            default: usage();
+        }
+    }
+    if(!config.mDatagrams || !config.mSize || config.mSize > MAX_MD_PACKET_SIZE || !config.mRecvBatch) usage();
+
+    sockaddr_in recvAddr, sendAddr, feedAddrA, feedAddrB;
+    int sendFd = LoopbackSocket(sendAddr);
+    int feedA = LoopbackSocket(feedAddrA);
+    int feedB = LoopbackSocket(feedAddrB);
+    if(sendFd < 0 || feedA < 0 || feedB < 0)
+    {
+        fprintf(stderr, "Creating loopback sockets failed\n");
+        return 1;
+    }
+
+    // Ingest, a fresh receive socket per backend
+    {
+        int recvFd = LoopbackSocket(recvAddr);
+        connect(sendFd, (sockaddr*)&recvAddr, sizeof(recvAddr));
+        UdpIngest ingest(recvFd, config.mRecvBatch, config.mRecvRing, config.mSize + 1);
+        RunIngest("recvmmsg", ingest, sendFd, config);
+        close(recvFd);
+    }
+    {
+        int recvFd = LoopbackSocket(recvAddr);
+        connect(sendFd, (sockaddr*)&recvAddr, sizeof(recvAddr));
+        UringIngest ingest(recvFd, config.mRecvBatch, config.mRecvRing, config.mSize + 1);
+        if(ingest.Init()) RunIngest("io_uring recv", ingest, sendFd, config);
+        else printf("%-16s unavailable: %s\n", "io_uring recv", strerror(errno));
+        close(recvFd);
+    }
+
+    // Publish, both feeds sent to sockets nobody reads
+    int pubA = LoopbackSocket(recvAddr);
+    int pubB = LoopbackSocket(recvAddr);
+    connect(pubA, (sockaddr*)&feedAddrA, sizeof(feedAddrA));
+    connect(pubB, (sockaddr*)&feedAddrB, sizeof(feedAddrB));
+    {
+        MdPublisher publisher(pubA, pubB, config.mPubRing);
+        RunPublish<MdPublisher>("sendmmsg", publisher, config,
+            [](const MdPublisher& pub){ return 2*pub.mBatches; });
+    }
+    {
+        UringPublisher publisher(pubA, pubB, config.mPubRing);
+        if(publisher.Init())
+        {
+            RunPublish<UringPublisher>(publisher.mFixed ? "io_uring fixed" : "io_uring send", publisher, config,
+                [](const UringPublisher& pub){ return pub.mUring.mEnters; });
+        }
+        else
+        {
+            printf("%-16s unavailable: %s\n", "io_uring send", strerror(errno));
+        }
+    }
+    return 0;
+}
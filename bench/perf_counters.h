@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace redheads
+{
+
+// User space hardware counters for the calling thread. Counters the kernel
+// or the machine won't give us (containers, VMs) read as unavailable.
+struct PerfCounters
+{
+    enum Counter
+    {
+        CYCLES,
+        INSTRUCTIONS,
+        CACHE_MISSES,
+        BRANCH_MISSES,
+        COUNTERS
+    };
+
+    PerfCounters()
+    {
+        static const uint64_t configs[COUNTERS] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES,
+        };
+        for(size_t i = 0; i < COUNTERS; ++i)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            mFds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+            mValues[i] = 0;
+        }
+    }
+
+    ~PerfCounters()
+    {
+        for(int fd : mFds) if(fd >= 0) close(fd);
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    inline bool Available(Counter counter) const
+    {
+        return mFds[counter] >= 0;
+    }
+
+    void Start()
+    {
+        for(int fd : mFds)
+        {
+            if(fd < 0) continue;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    void Stop()
+    {
+        for(size_t i = 0; i < COUNTERS; ++i)
+        {
+            if(mFds[i] < 0) continue;
+            ioctl(mFds[i], PERF_EVENT_IOC_DISABLE, 0);
+            if(read(mFds[i], &mValues[i], sizeof(uint64_t)) != sizeof(uint64_t)) mValues[i] = 0;
+        }
+    }
+
+    inline uint64_t Value(Counter counter) const
+    {
+        return mValues[counter];
+    }
+
+    int mFds[COUNTERS];
+    uint64_t mValues[COUNTERS];
+};
+
+}
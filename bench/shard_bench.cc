@@ -0,0 +1,479 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+
+#include "../lib/sharded_engine.h"
+
+using namespace redheads;
+
+typedef std::chrono::steady_clock Clock;
+
+struct ShardConfig
+{
+    size_t mBooks = 64;
+    size_t mShards = 4;
+    size_t mRounds = 50;
+    size_t mOpsPerRound = 1000;
+    size_t mRingSize = 4096;
+    uint64_t mSeed = 1;
+};
+
+constexpr int64_t MID_PRICE = 1000;
+constexpr size_t BOOKS_PER_COMMODITY = 4;
+constexpr size_t MAX_BATCH_OPS = 8;
+constexpr uint16_t GATEWAY_ID = 1;
+constexpr uint64_t NO_HANDLE = ~0ull;
+
+// A request as the engine receives it, header and body
+typedef std::vector<char> Msg;
+
+template<typename T>
+void Append(Msg& msg, const T& part)
+{
+    msg.insert(msg.end(), reinterpret_cast<const char*>(&part), reinterpret_cast<const char*>(&part) + sizeof(part));
+}
+
+// Books of a commodity share their underlying and, two at a time, their
+// instrument class, so masked series reach books on several shards
+EngSeriesId BookSeries(size_t book)
+{
+    EngSeriesId series{};
+    series.mCountry = 1;
+    series.mMarket = 1;
+    series.mInstrumentGroup = 1 + book % 2;
+    series.mCommodity = 1 + book / BOOKS_PER_COMMODITY;
+    series.mExpirationDate = 1;
+    series.mStrikePrice = 1 + book % BOOKS_PER_COMMODITY;
+    return series;
+}
+
+// A book's indications folded with order ids replaced by the order in which
+// the book first reported them. Engines handing out different ids for the
+// same flow still compare equal.
+struct BookPrint
+{
+    uint64_t mHash = 0;
+    std::unordered_map<uint64_t, uint64_t> mHandles;
+    std::vector<uint64_t> mIds; // by handle
+};
+
+struct CheckClient : IEngineClient
+{
+    CheckClient(size_t books)
+    : mPrints(books)
+    {
+    }
+
+    void Handle(const BookClearInd&& ind)
+    {
+        Fold(ind.mBookId, EngMsgId::PART_BOOK_CLEAR_IND, {});
+    }
+
+    void Handle(const BookInsertInd&& ind)
+    {
+        Fold(ind.mBookId, EngMsgId::PART_BOOK_INSERT_IND, {ind.mClientId, Handle(ind.mBookId, ind.mOrderId),
+            ind.mFlags, (uint64_t)ind.mPrice, (uint64_t)ind.mVolume});
+    }
+
+    void Handle(const BookDeleteInd&& ind)
+    {
+        Fold(ind.mBookId, EngMsgId::PART_BOOK_DELETE_IND, {ind.mClientId, Handle(ind.mBookId, ind.mOrderId)});
+    }
+
+    void Handle(const BookAmendInd&& ind)
+    {
+        Fold(ind.mBookId, EngMsgId::PART_BOOK_AMEND_IND, {ind.mClientId, Handle(ind.mBookId, ind.mOrigOrderId),
+            Handle(ind.mBookId, ind.mNewOrderId), (uint64_t)ind.mPrice, (uint64_t)ind.mVolume, ind.mVolumeDelta});
+    }
+
+    void Handle(const BookTradeInd&& ind)
+    {
+        Fold(ind.mBookId, EngMsgId::PART_BOOK_TRADE_IND, {ind.mTradeId, ind.mAggressorClientId,
+            ind.mPassiveClientId, Handle(ind.mBookId, ind.mAggressorOrderId),
+            Handle(ind.mBookId, ind.mPassiveOrderId), (uint64_t)ind.mPrice, (uint64_t)ind.mVolume,
+            ind.mAggressorIsBid});
+    }
+
+    void Handle(const BookSweepInd&& ind)
+    {
+        Fold(ind.mBookId, EngMsgId::PART_BOOK_SWEEP_IND, {ind.mAggressorClientId,
+            Handle(ind.mBookId, ind.mAggressorOrderId), ind.mFirstTradeId, (uint64_t)ind.mPrice,
+            (uint64_t)ind.mVolume, ind.mFills, ind.mAggressorIsBid});
+    }
+
+    void Handle(const BookFillInd&& ind)
+    {
+        Fold(ind.mBookId, EngMsgId::PART_BOOK_FILL_IND, {ind.mPassiveClientId,
+            Handle(ind.mBookId, ind.mPassiveOrderId), (uint64_t)ind.mVolume});
+    }
+
+    // Conflated at the end of each processing batch, which differ between
+    // the engines
+    void Handle(const BookDepthInd&&) {}
+
+    void Handle(const BookErrorInd&& ind)
+    {
+        Fold(ind.mBookId, ERROR_TAG, {ind.mClientId, Handle(ind.mBookId, ind.mOrderId),
+            (uint64_t)ind.mCode});
+    }
+
+    void Handle(const EngAvailableBooksInd&& ind)
+    {
+        Fold(ind.mBookId, EngMsgId::PART_BOOK_AVAIL_IND, {ind.mBookBehaviours});
+    }
+
+    void Handle(const EngOperationCnf&&)
+    {
+        mConfirmed.fetch_add(1, std::memory_order_release);
+    }
+
+    void Handle(const EngOperationRangeCnf&& cnf)
+    {
+        mConfirmed.fetch_add(cnf.mCount, std::memory_order_release);
+    }
+
+    // The flow is well formed, a reject shows up as a missing confirmation
+    void Handle(const EngOperationRej&&) {}
+
+    // Errors have no message id of their own
+    static constexpr uint64_t ERROR_TAG = 0xFF;
+
+    uint64_t Handle(uint16_t bookId, uint64_t orderId)
+    {
+        if(orderId == NULL_ID) return NO_HANDLE;
+        auto& print = mPrints[bookId];
+        auto itr = print.mHandles.find(orderId);
+        if(itr != print.mHandles.end()) return itr->second;
+        print.mHandles[orderId] = print.mIds.size();
+        print.mIds.push_back(orderId);
+        return print.mIds.size() - 1;
+    }
+
+    template<typename T>
+    void Fold(uint16_t bookId, T tag, std::initializer_list<uint64_t> fields)
+    {
+        uint64_t hash = (mPrints[bookId].mHash ^ (uint64_t)tag) * 0x100000001B3ull;
+        for(uint64_t field : fields) hash = (hash ^ field) * 0x100000001B3ull;
+        mPrints[bookId].mHash = hash;
+    }
+
+    std::vector<BookPrint> mPrints; // by book id
+    std::atomic<uint64_t> mConfirmed{0};
+};
+
+// An operation before it is given a sequence and the ids of one engine
+struct FlowOp
+{
+    EngMsgId mMsgId;
+    size_t mBook;
+    int mMask;          // 0 for the book's own series
+    uint16_t mClientId;
+    bool mIsBid;
+    int64_t mPrice;
+    int64_t mVolume;
+    uint64_t mHandle;   // into the book's BookPrint ids
+    uint8_t mBids;
+    uint8_t mAsks;
+};
+
+EngSeriesId OpSeries(const FlowOp& op)
+{
+    EngSeriesId series = BookSeries(op.mBook);
+    switch(op.mMask)
+    {
+        case 1: return MaskEngSeriesIdByInstrType(series);
+        case 2: return MaskEngSeriesIdByInstrClass(series);
+        case 3: return MaskEngSeriesIdByUnderlying(series);
+        default: return series;
+    }
+}
+
+FlowOp GenerateOp(std::mt19937_64& rng, const ShardConfig& config, const CheckClient& reference)
+{
+    static const EngMsgId types[] = {EngMsgId::PART_BOOK_OP_CLEAR_REQ, EngMsgId::PART_BOOK_OP_INSERT_REQ,
+        EngMsgId::PART_BOOK_OP_QUOTE_REQ, EngMsgId::PART_BOOK_OP_DEL_REQ, EngMsgId::PART_BOOK_OP_BULK_DEL_REQ,
+        EngMsgId::PART_BOOK_OP_AMEND_REQ};
+    static const unsigned weights[] = {1, 500, 50, 200, 30, 150};
+    std::discrete_distribution<int> type(std::begin(weights), std::end(weights));
+
+    FlowOp op{};
+    op.mMsgId = types[type(rng)];
+    op.mBook = rng() % config.mBooks;
+    // Mostly a book's own series, sometimes one reaching several books
+    op.mMask = rng() % 8 == 0 ? 1 + rng() % 3 : 0;
+    op.mClientId = 1 + rng() % 8;
+    op.mIsBid = rng() & 1;
+    // Some cross the spread so there is matching to compare
+    int64_t ticks = (int64_t)(rng() % 14) - 3;
+    op.mPrice = op.mIsBid ? MID_PRICE - ticks : MID_PRICE + ticks;
+    op.mVolume = 1 + rng() % 10;
+    const auto& ids = reference.mPrints[op.mBook].mIds;
+    op.mHandle = ids.empty() ? NO_HANDLE : ids.size() - 1 - rng() % std::min<size_t>(ids.size(), 200);
+    op.mBids = rng() % 4;
+    op.mAsks = rng() % 4;
+    return op;
+}
+
+// The op as one engine receives it, with the order id that engine handed out
+Msg EncodeOp(const FlowOp& op, uint16_t sequence, uint64_t orderId)
+{
+    Msg msg;
+    Append(msg, EngOperationReq{op.mMsgId, OpSeries(op), OperationId{GATEWAY_ID, sequence}});
+    switch(op.mMsgId)
+    {
+        case EngMsgId::PART_BOOK_OP_INSERT_REQ:
+            Append(msg, BookInsertReq{op.mClientId, op.mIsBid ? IS_BID : IS_ASK, op.mPrice, op.mVolume, {}});
+            break;
+        case EngMsgId::PART_BOOK_OP_QUOTE_REQ:
+            Append(msg, BookQuoteReq{op.mClientId, {}, op.mBids, op.mAsks});
+            for(int i = 0; i < op.mBids; ++i) Append(msg, QuoteLevel{MID_PRICE - 1 - i, op.mVolume});
+            for(int i = 0; i < op.mAsks; ++i) Append(msg, QuoteLevel{MID_PRICE + 1 + i, op.mVolume});
+            break;
+        case EngMsgId::PART_BOOK_OP_DEL_REQ:
+            Append(msg, BookDeleteReq{op.mClientId, orderId});
+            break;
+        case EngMsgId::PART_BOOK_OP_BULK_DEL_REQ:
+            Append(msg, BookBulkDeleteReq{op.mClientId, op.mIsBid ? IS_BID : IS_ASK, {}});
+            break;
+        case EngMsgId::PART_BOOK_OP_AMEND_REQ:
+            Append(msg, BookAmendReq{op.mClientId, orderId, op.mPrice, op.mVolume, false, {}});
+            break;
+        default:
+            break;
+    }
+    return msg;
+}
+
+Msg EncodeBatch(const std::vector<Msg>& ops, uint16_t sequence)
+{
+    Msg msg;
+    Append(msg, EngOperationReq{EngMsgId::PART_OP_BATCH_REQ, EngSeriesId{}, OperationId{GATEWAY_ID, sequence}});
+    Append(msg, (uint8_t)ops.size());
+    for(const auto& op : ops) Append(msg, (uint16_t)op.size());
+    for(const auto& op : ops) msg.insert(msg.end(), op.begin(), op.end());
+    return msg;
+}
+
+// One round of flow as messages for one engine. Ops are grouped into
+// batches the same way for every engine.
+template<typename L>
+std::vector<Msg> EncodeRound(const std::vector<FlowOp>& ops, const std::vector<uint8_t>& groups,
+    uint16_t sequence, L&& orderId)
+{
+    std::vector<Msg> msgs;
+    size_t next = 0;
+    for(uint8_t group : groups)
+    {
+        std::vector<Msg> encoded;
+        for(size_t i = 0; i < group; ++i, ++next)
+        {
+            const auto& op = ops[next];
+            encoded.push_back(EncodeOp(op, sequence + next, op.mHandle == NO_HANDLE ? NULL_ID : orderId(op)));
+        }
+        msgs.push_back(group == 1 ? encoded[0] : EncodeBatch(encoded, sequence + next - group));
+    }
+    return msgs;
+}
+
+struct LevelRow
+{
+    int64_t mPrice;
+    int64_t mVolume;
+    uint32_t mOrders;
+
+    bool operator==(const LevelRow& other) const
+    {
+        return mPrice == other.mPrice && mVolume == other.mVolume && mOrders == other.mOrders;
+    }
+};
+
+std::vector<LevelRow> Levels(const EngineBook& book, bool isBid)
+{
+    std::vector<LevelRow> rows;
+    book.ForEachLevel(isBid, [&](int64_t price, const Level& level)
+    {
+        rows.push_back(LevelRow{price, level.mVolume, level.mOrders});
+    });
+    return rows;
+}
+
+const EngineBook* FindBook(const Engine& engine, uint16_t bookId)
+{
+    for(const auto& book : engine.mBooks)
+    {
+        if(book.mBookId == bookId) return &book;
+    }
+    return nullptr;
+}
+
+void usage()
+{
+    printf("rh_bench_shard [-b BOOKS] [-S SHARDS] [-r ROUNDS] [-o OPS_PER_ROUND] [-q RING_SIZE] [-s SEED]\n"
+        "  feeds the same flow to an Engine and a ShardedEngine, times both and fails unless every\n"
+        "  book reports the same indications and ends with the same levels\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    ShardConfig config;
+    int c;
+    while ((c = getopt (argc, argv, "b:S:r:o:q:s:")) != -1)
+    {
+        switch (c)
+        {
+            case 'b': config.mBooks = atol(optarg); break;
+            case 'S': config.mShards = atol(optarg); break;
+            case 'r': config.mRounds = atol(optarg); break;
+            case 'o': config.mOpsPerRound = atol(optarg); break;
+            case 'q': config.mRingSize = atol(optarg); break;
+            case 's': config.mSeed = atoll(optarg); break;
+            default: usage();
+        }
+    }
+    if(!config.mBooks || config.mBooks > std::numeric_limits<uint16_t>::max() || !config.mShards ||
+        config.mShards > MAX_SHARDS || !config.mOpsPerRound || config.mOpsPerRound > 60000 ||
+        !config.mRingSize || (config.mRingSize & (config.mRingSize - 1))) usage();
+
+    CheckClient singleClient(config.mBooks);
+    Engine single(singleClient);
+    single.Init(1000, 100000, 100);
+
+    std::vector<std::unique_ptr<CheckClient>> shardClients;
+    std::vector<IEngineClient*> clients;
+    for(size_t i = 0; i < config.mShards; ++i)
+    {
+        shardClients.emplace_back(new CheckClient(config.mBooks));
+        clients.push_back(shardClients.back().get());
+    }
+    ShardedEngine sharded(clients, {}, config.mRingSize);
+    sharded.Init(1000, 100000, 100);
+
+    auto confirmed = [&]
+    {
+        uint64_t total = 0;
+        for(const auto& client : shardClients) total += client->mConfirmed.load(std::memory_order_acquire);
+        return total;
+    };
+
+    uint16_t sequence = 1;
+    uint64_t sent = 0;
+    for(size_t b = 0; b < config.mBooks; ++b)
+    {
+        Msg create;
+        Append(create, EngCreateBookReq{EngMsgId::PART_BOOK_CREATE_REQ, BookSeries(b),
+            OperationId{GATEWAY_ID, sequence++}, (uint16_t)b, BookBehaviours(b % 3 == 1 ? TICK_LADDER : 0)});
+        single.HandleMsg(create.data(), create.size());
+        sharded.HandleMsg(create.data(), create.size());
+        ++sent;
+    }
+
+    // A new series under a book id already taken is confirmed but creates
+    // nothing, on both
+    Msg duplicate;
+    Append(duplicate, EngCreateBookReq{EngMsgId::PART_BOOK_CREATE_REQ, BookSeries(config.mBooks),
+        OperationId{GATEWAY_ID, sequence++}, 0, BookBehaviours(0)});
+    single.HandleMsg(duplicate.data(), duplicate.size());
+    sharded.HandleMsg(duplicate.data(), duplicate.size());
+    ++sent;
+    while(confirmed() < sent) std::this_thread::yield();
+    size_t shardedBooks = 0;
+    for(const auto& shard : sharded.mShards) shardedBooks += shard->mEngine.mBooks.size();
+    size_t duplicateMismatches = (single.mBooks.size() != config.mBooks) + (shardedBooks != config.mBooks);
+    if(duplicateMismatches)
+    {
+        fprintf(stderr, "duplicate book id created a book: %zu/%zu books\n", single.mBooks.size(), shardedBooks);
+    }
+
+    std::mt19937_64 rng(config.mSeed);
+    double singleSecs = 0, shardedSecs = 0;
+    size_t handleMismatches = 0;
+    for(size_t r = 0; r < config.mRounds; ++r)
+    {
+        // Both ends have confirmed everything, start the gateway over before
+        // its 16 bit sequences wrap
+        if(sequence + config.mOpsPerRound >= std::numeric_limits<uint16_t>::max())
+        {
+            sequence = 1;
+            single.mLastOpId = 0;
+            sharded.mLastOpId = 0;
+        }
+
+        std::vector<FlowOp> ops;
+        std::vector<uint8_t> groups;
+        for(size_t left = config.mOpsPerRound; left;)
+        {
+            uint8_t group = rng() % 4 ? 1 : std::min<size_t>(left, 2 + rng() % (MAX_BATCH_OPS - 1));
+            groups.push_back(group);
+            left -= group;
+        }
+        for(size_t i = 0; i < config.mOpsPerRound; ++i)
+        {
+            FlowOp op = GenerateOp(rng, config, singleClient);
+            const auto& shardPrint = shardClients[sharded.ShardOf(BookSeries(op.mBook))]->mPrints[op.mBook];
+            if(shardPrint.mIds.size() != singleClient.mPrints[op.mBook].mIds.size()) ++handleMismatches;
+            if(op.mHandle >= shardPrint.mIds.size()) op.mHandle = NO_HANDLE;
+            ops.push_back(op);
+        }
+
+        auto singleMsgs = EncodeRound(ops, groups, sequence, [&](const FlowOp& op)
+        {
+            return singleClient.mPrints[op.mBook].mIds[op.mHandle];
+        });
+        auto shardedMsgs = EncodeRound(ops, groups, sequence, [&](const FlowOp& op)
+        {
+            return shardClients[sharded.ShardOf(BookSeries(op.mBook))]->mPrints[op.mBook].mIds[op.mHandle];
+        });
+        sequence += config.mOpsPerRound;
+        sent += config.mOpsPerRound;
+
+        auto start = Clock::now();
+        for(const auto& msg : singleMsgs) single.HandleMsg(msg.data(), msg.size());
+        single.EndBatch();
+        singleSecs += std::chrono::duration<double>(Clock::now() - start).count();
+
+        // The next round picks orders from what the shards reported, so
+        // wait until they have confirmed this one
+        start = Clock::now();
+        for(const auto& msg : shardedMsgs) sharded.HandleMsg(msg.data(), msg.size());
+        while(confirmed() < sent) std::this_thread::yield();
+        shardedSecs += std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    sharded.Stop();
+
+    size_t mismatches = handleMismatches + duplicateMismatches;
+    if(singleClient.mConfirmed != sent || confirmed() != sent) ++mismatches;
+    for(size_t b = 0; b < config.mBooks; ++b)
+    {
+        size_t shard = sharded.ShardOf(BookSeries(b));
+        const auto& singlePrint = singleClient.mPrints[b];
+        const auto& shardPrint = shardClients[shard]->mPrints[b];
+        const EngineBook* singleBook = FindBook(single, b);
+        const EngineBook* shardBook = FindBook(sharded.mShards[shard]->mEngine, b);
+        bool same = singlePrint.mHash == shardPrint.mHash && singlePrint.mIds.size() == shardPrint.mIds.size() &&
+            singleBook && shardBook;
+        for(bool isBid : {true, false})
+        {
+            same = same && Levels(*singleBook, isBid) == Levels(*shardBook, isBid);
+        }
+        if(!same && ++mismatches <= 10)
+        {
+            fprintf(stderr, "book %zu on shard %zu differs: hash %016lx/%016lx orders %zu/%zu\n", b, shard,
+                singlePrint.mHash, shardPrint.mHash, singlePrint.mIds.size(), shardPrint.mIds.size());
+        }
+    }
+
+    printf("single   %lu ops in %.3fs, %.0f ops/sec\n", sent, singleSecs, sent / singleSecs);
+    printf("sharded  %lu ops in %.3fs, %.0f ops/sec over %zu shards\n", sent, shardedSecs, sent / shardedSecs,
+        config.mShards);
+    printf("%zu books compared, %zu mismatches\n", config.mBooks, mismatches);
+    return mismatches ? 1 : 0;
+}
@@ -1,6 +1,17 @@
+#pragma once
 
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <type_traits>
 #include <vector>
 #include <sparsehash/dense_hash_map>
+#include "segmented_pool.h"
 
 namespace redheads
 {
@@ -9,14 +20,24 @@ namespace redheads
 #define UNLIKELY(condition) __builtin_expect(static_cast<bool>(condition), 0)
 
 constexpr size_t   VAR_TEXT_SIZE = 10;
-constexpr size_t   NULL_ORDER    = 0;
+constexpr uint32_t NULL_ORDER    = 0;
 constexpr uint64_t NULL_ID       = 0;
+constexpr unsigned ORDER_SLOT_BITS = 26;        // order id bits under the book id, see MakeOrderId
+constexpr unsigned ORDER_GENERATION_BITS = 22;
+constexpr size_t   MAX_ORDER_SLOTS = size_t(1) << ORDER_SLOT_BITS;
+constexpr size_t   LADDER_TICKS  = 4096;
+constexpr size_t   MAX_LADDER_TICKS = 1 << 16;  // levels a ladder grows to at most
+constexpr int64_t  MAX_LADDER_PRICE = std::numeric_limits<int64_t>::max() / 4;
+constexpr size_t   DEPTH_LEVELS  = 10;   // market by price rows kept each side
+constexpr size_t   MAX_DEPTH_LEVELS = 64;
 
 #pragma pack(push, 1)
 
 enum BookBehaviours : uint32_t
 {
-    AMEND_SAMEQP_SAMEID = 1 << 0
+    AMEND_SAMEQP_SAMEID = 1 << 0,
+    TICK_LADDER         = 1 << 1, // Levels in a TickLadder instead of sorted vectors
+    SWEEP_FILLS         = 1 << 2, // Whole levels taken report a BookSweepInd and fills
 };
 
 enum OrderFlags : uint8_t
@@ -32,6 +53,7 @@ enum class ErrorCode : uint8_t
     UNKNOWN_ORDER        = 1 << 0,
     NOT_CLIENT_ORDER     = 1 << 1,
     CLIENT_HAS_NO_ORDERS = 1 << 2,
+    INVALID_PRICE        = 1 << 3,
 };
 
 struct BookClearReq
@@ -90,6 +112,7 @@ struct BookClearInd
     uint16_t mBookId;
 };
 
+// Order ids are unique over all books, see MakeOrderId
 struct BookInsertInd
 {
     uint16_t   mBookId;
@@ -131,6 +154,43 @@ struct BookTradeInd
     bool     mAggressorIsBid;
 };
 
+// An aggressor taking a whole price level. Followed by mFills BookFillInds
+// in queue order, fill i trades the passive order's whole volume at mPrice
+// under trade id mFirstTradeId + i and the passive order is gone, there is
+// no trade or delete indication per passive order.
+struct BookSweepInd
+{
+    uint16_t mBookId;
+    uint16_t mAggressorClientId;
+    uint64_t mAggressorOrderId;
+    uint64_t mFirstTradeId;
+    int64_t  mPrice;
+    int64_t  mVolume;
+    uint32_t mFills;
+    bool     mAggressorIsBid;
+};
+
+struct BookFillInd
+{
+    uint16_t mBookId;
+    uint16_t mPassiveClientId;
+    uint64_t mPassiveOrderId;
+    int64_t  mVolume;
+};
+
+// A market by price row as it stood at the end of a processing batch. Only
+// rows that changed since the last batch are sent, row 0 is the best price
+// and a row with no orders is past the last level of the side.
+struct BookDepthInd
+{
+    uint16_t mBookId;
+    bool     mIsBid;
+    uint8_t  mRow;
+    int64_t  mPrice;
+    int64_t  mVolume;
+    uint32_t mOrders;
+};
+
 struct BookErrorInd
 {
     uint16_t  mBookId;
@@ -141,15 +201,66 @@ struct BookErrorInd
 
 #pragma pack(pop)
 
+// Slot in the parallel order pools
+typedef uint32_t OrderLoc;
+
+// Only what the matching loop walks, four to a cache line
 struct Order
 {
-    uint16_t mClientId=NULL_ID;
-    uint64_t mOrderId=NULL_ID;
-    int64_t  mPrice=0;
     int64_t  mVolume=0;
-    size_t   mNext=0;
+    OrderLoc mNext=NULL_ORDER;
+    OrderLoc mPrev=NULL_ORDER;
+};
+
+// Cold fields of the same slot, read once an order trades or is looked up
+struct OrderInfo
+{
+    uint64_t mOrderId=NULL_ID; // NULL_ID once deleted or filled
+    int64_t  mPrice=0;
+    uint32_t mGeneration=0;    // bumped for every id handed out on the slot
+    uint16_t mClientId=NULL_ID;
+    uint16_t mBookId=0;
+    OrderLoc mClientPrev=NULL_ORDER; // the client's live orders on this side
+    OrderLoc mClientNext=NULL_ORDER;
+};
+
+// Order ids are the book id in the top 16 bits, as trade ids, then the
+// slot's generation when the id was handed out and the pool slot, so a
+// lookup is an index and a compare. Ids of filled, deleted or amended
+// orders never match again until the generation wraps, and books never
+// share an id, whichever pool or shard they are in.
+static_assert(16 + ORDER_GENERATION_BITS + ORDER_SLOT_BITS == 64, "Order id fields do not fill 64 bits");
+
+inline uint64_t MakeOrderId(uint16_t bookId, uint32_t generation, OrderLoc loc)
+{
+    constexpr uint64_t generationMask = (uint64_t(1) << ORDER_GENERATION_BITS) - 1;
+    return ((uint64_t)bookId << 48) | ((generation & generationMask) << ORDER_SLOT_BITS) | loc;
+}
+
+inline OrderLoc OrderSlot(uint64_t orderId)
+{
+    return (OrderLoc)(orderId & (MAX_ORDER_SLOTS - 1));
+}
+
+// A client's live orders in one book, oldest first, linked through
+// OrderInfo. Orders leave on fill and delete so walks only see live orders.
+struct ClientOrderList
+{
+    OrderLoc mLead=NULL_ORDER;
+    OrderLoc mEnd=NULL_ORDER;
+};
+
+struct ClientOrders
+{
+    ClientOrderList mBids;
+    ClientOrderList mAsks;
 };
 
+inline uint32_t ClientKey(uint16_t bookId, uint16_t clientId)
+{
+    return ((uint32_t)bookId << 16) | clientId;
+}
+
 struct OrderExtraInfo
 {
     char mVarText[VAR_TEXT_SIZE];
@@ -157,19 +268,524 @@ struct OrderExtraInfo
 
 struct Level
 {
-    size_t mLead; // First order
-    size_t mEnd;   // Last order
+    int64_t  mPrice;
+    OrderLoc mLead;    // First order
+    OrderLoc mEnd;     // Last order
+    int64_t  mVolume;  // Sum of the orders' volume
+    uint32_t mOrders;
+};
+
+// Price levels kept in a sorted vector with the most aggressive level at the
+// back
+template<typename T>
+struct VectorLevels
+{
+    static constexpr bool IS_BID = std::is_same<T, std::less<int64_t>>::value;
+
+    VectorLevels(std::vector<Level>& levels)
+    : mLevels(levels)
+    {
+    }
+
+    inline bool Empty() const
+    {
+        return mLevels.empty();
+    }
+
+    inline Level& Best()
+    {
+        return mLevels.back();
+    }
+
+    inline int64_t BestPrice() const
+    {
+        return mLevels.back().mPrice;
+    }
+
+    inline void PopBest()
+    {
+        mLevels.pop_back();
+    }
+
+    inline Level* Find(int64_t price)
+    {
+        auto itr = Position(price);
+        if(itr != mLevels.rend() && itr->mPrice == price) return &*itr;
+        return nullptr;
+    }
+
+    inline Level& Insert(int64_t price, Level level)
+    {
+        return *mLevels.emplace(Position(price).base(), level);
+    }
+
+    inline void Erase(int64_t price)
+    {
+        auto itr = Position(price);
+        assert(itr != mLevels.rend() && itr->mPrice == price);
+        mLevels.erase(std::next(itr).base());
+    }
+
+    // Closest level less aggressive than price or null
+    inline Level* NextBehind(int64_t price)
+    {
+        auto itr = Position(price);
+        if(itr != mLevels.rend() && itr->mPrice == price) ++itr;
+        return itr == mLevels.rend() ? nullptr : &*itr;
+    }
+
+    // First level, walking from the top, that is not more aggressive than price
+    inline typename std::vector<Level>::reverse_iterator Position(int64_t price)
+    {
+        // TODO instead of a linear search here I think we could linear search < 10 tops levels then fall
+        // back to binary search
+        auto itr = mLevels.rbegin();
+        while((itr != mLevels.rend()) && mLessAggressive(price, itr->mPrice)) ++itr;
+        return itr;
+    }
+
+    std::vector<Level>& mLevels;
+    T mLessAggressive;
+};
+
+// Price levels held in an array indexed by ticks from a moving anchor. A two
+// level bitmap of occupied slots gives the best level and the next level
+// behind it without walking the ladder. Prices must be on a tick and Fit,
+// the book checks both before anything rests.
+template<typename T>
+struct TickLadder
+{
+    // Bids (std::less) are best at the highest index, asks at the lowest
+    static constexpr bool HIGH_IS_BEST = T()(0, 1);
+    static constexpr bool IS_BID = HIGH_IS_BEST;
+    static constexpr size_t NO_LEVEL = SIZE_MAX;
+
+    TickLadder(int64_t tickSize, size_t ticks)
+    : mTickSize(tickSize)
+    {
+        assert(tickSize > 0 && tickSize <= MAX_LADDER_PRICE / (int64_t)MAX_LADDER_TICKS && "Unsupported tick size");
+        assert(ticks <= MAX_LADDER_TICKS && "Ladder beyond its maximum size");
+        Allocate(ticks);
+    }
+
+    inline bool Empty() const
+    {
+        return mBest == NO_LEVEL;
+    }
+
+    inline Level& Best()
+    {
+        return mLevels[mBest];
+    }
+
+    inline int64_t BestPrice() const
+    {
+        return PriceAt(mBest);
+    }
+
+    inline void PopBest()
+    {
+        Clear(mBest);
+        mBest = Scan(mBest);
+    }
+
+    inline Level* Find(int64_t price)
+    {
+        if(UNLIKELY(!InRange(price))) return nullptr;
+        size_t idx = IndexOf(price);
+        return IsSet(idx) ? &mLevels[idx] : nullptr;
+    }
+
+    inline Level& Insert(int64_t price, Level level)
+    {
+        assert(price % mTickSize == 0 && "Price is not on a tick");
+        if(UNLIKELY(!InRange(price))) Reanchor(price);
+
+        size_t idx = IndexOf(price);
+        mLevels[idx] = level;
+        Set(idx);
+        if(mBest == NO_LEVEL || (HIGH_IS_BEST ? idx > mBest : idx < mBest)) mBest = idx;
+        return mLevels[idx];
+    }
+
+    inline void Erase(int64_t price)
+    {
+        size_t idx = IndexOf(price);
+        assert(InRange(price) && IsSet(idx));
+        Clear(idx);
+        if(idx == mBest) mBest = Scan(idx);
+    }
+
+    // Next occupied level behind idx or NO_LEVEL
+    inline size_t Next(size_t idx) const
+    {
+        return Scan(idx);
+    }
+
+    // Closest level less aggressive than price, which is in range, or null
+    inline Level* NextBehind(int64_t price)
+    {
+        size_t idx = Scan(IndexOf(price));
+        return idx == NO_LEVEL ? nullptr : &mLevels[idx];
+    }
+
+    inline int64_t PriceAt(size_t idx) const
+    {
+        return mAnchor + (int64_t)idx * mTickSize;
+    }
+
+    inline size_t IndexOf(int64_t price) const
+    {
+        return (size_t)((price - mAnchor) / mTickSize);
+    }
+
+    inline bool InRange(int64_t price) const
+    {
+        return (price >= mAnchor) && (price < PriceAt(mLevels.size()));
+    }
+
+    inline bool OnTick(int64_t price) const
+    {
+        return price % mTickSize == 0;
+    }
+
+    // Whether prices from low to high can rest alongside the levels already
+    // here without the ladder growing past MAX_LADDER_TICKS
+    inline bool Fits(int64_t low, int64_t high) const
+    {
+        if(low < -MAX_LADDER_PRICE || high > MAX_LADDER_PRICE) return false;
+        if(InRange(low) && InRange(high)) return true;
+        if(!Empty())
+        {
+            size_t worst = Worst();
+            low = std::min(low, PriceAt(HIGH_IS_BEST ? worst : mBest));
+            high = std::max(high, PriceAt(HIGH_IS_BEST ? mBest : worst));
+        }
+        return (size_t)((high - low) / mTickSize) < MAX_LADDER_TICKS / 2;
+    }
+
+    void Allocate(size_t ticks)
+    {
+        size_t words = (ticks + 63) / 64;
+        mLevels.assign(words * 64, Level{0, NULL_ORDER, NULL_ORDER, 0, 0});
+        mOccupied.assign(words, 0);
+        mSummary.assign((words + 63) / 64, 0);
+        mBest = NO_LEVEL;
+    }
+
+    // Move the anchor so both the resting levels and price fit, doubling the
+    // ladder if the spread of prices no longer fits in it
+    void Reanchor(int64_t price)
+    {
+        std::vector<std::pair<int64_t, Level>> resting;
+        for(size_t idx = mBest; idx != NO_LEVEL; idx = Scan(idx))
+        {
+            resting.emplace_back(PriceAt(idx), mLevels[idx]);
+        }
+
+        int64_t low = price;
+        int64_t high = price;
+        for(const auto& r : resting)
+        {
+            low = std::min(low, r.first);
+            high = std::max(high, r.first);
+        }
+
+        size_t ticks = std::max<size_t>(mLevels.size(), 64);
+        while((size_t)((high - low) / mTickSize) >= ticks / 2) ticks *= 2;
+        Allocate(std::min(ticks, MAX_LADDER_TICKS));
+
+        // Centre the used range so the book can drift either way
+        int64_t mid = low + (((high - low) / mTickSize) / 2) * mTickSize;
+        mAnchor = mid - (int64_t)(mLevels.size() / 2) * mTickSize;
+
+        for(const auto& r : resting) Insert(r.first, r.second);
+    }
+
+    inline bool IsSet(size_t idx) const
+    {
+        return mOccupied[idx / 64] & (1ull << (idx % 64));
+    }
+
+    inline void Set(size_t idx)
+    {
+        mOccupied[idx / 64] |= (1ull << (idx % 64));
+        mSummary[idx / 4096] |= (1ull << ((idx / 64) % 64));
+    }
+
+    inline void Clear(size_t idx)
+    {
+        size_t word = idx / 64;
+        mOccupied[word] &= ~(1ull << (idx % 64));
+        if(mOccupied[word] == 0) mSummary[word / 64] &= ~(1ull << (word % 64));
+    }
+
+    // Occupied slot furthest behind the best, the ladder is not empty
+    size_t Worst() const
+    {
+        if(HIGH_IS_BEST)
+        {
+            size_t sword = 0;
+            while(!mSummary[sword]) ++sword;
+            size_t word = sword * 64 + __builtin_ctzll(mSummary[sword]);
+            return word * 64 + __builtin_ctzll(mOccupied[word]);
+        }
+        size_t sword = mSummary.size() - 1;
+        while(!mSummary[sword]) --sword;
+        size_t word = sword * 64 + 63 - __builtin_clzll(mSummary[sword]);
+        return word * 64 + 63 - __builtin_clzll(mOccupied[word]);
+    }
+
+    // Closest occupied slot behind idx, from the best towards the worst price
+    size_t Scan(size_t idx) const
+    {
+        if(HIGH_IS_BEST)
+        {
+            if(idx == 0) return NO_LEVEL;
+            size_t pos = idx - 1;
+            uint64_t bits = mOccupied[pos / 64] & (~0ull >> (63 - (pos % 64)));
+            if(bits) return (pos & ~size_t(63)) + 63 - __builtin_clzll(bits);
+
+            size_t word = pos / 64;
+            if(word == 0) return NO_LEVEL;
+            --word;
+            size_t sword = word / 64;
+            uint64_t sbits = mSummary[sword] & (~0ull >> (63 - (word % 64)));
+            while(!sbits)
+            {
+                if(sword == 0) return NO_LEVEL;
+                sbits = mSummary[--sword];
+            }
+            word = sword * 64 + 63 - __builtin_clzll(sbits);
+            return word * 64 + 63 - __builtin_clzll(mOccupied[word]);
+        }
+        else
+        {
+            size_t pos = idx + 1;
+            if(pos >= mLevels.size()) return NO_LEVEL;
+            uint64_t bits = mOccupied[pos / 64] & (~0ull << (pos % 64));
+            if(bits) return (pos & ~size_t(63)) + __builtin_ctzll(bits);
+
+            size_t word = pos / 64 + 1;
+            if(word >= mOccupied.size()) return NO_LEVEL;
+            size_t sword = word / 64;
+            uint64_t sbits = mSummary[sword] & (~0ull << (word % 64));
+            while(!sbits)
+            {
+                if(++sword >= mSummary.size()) return NO_LEVEL;
+                sbits = mSummary[sword];
+            }
+            word = sword * 64 + __builtin_ctzll(sbits);
+            return word * 64 + __builtin_ctzll(mOccupied[word]);
+        }
+    }
+
+    int64_t mTickSize;
+    int64_t mAnchor = 0;
+    size_t mBest = NO_LEVEL;
+    std::vector<Level> mLevels;
+    std::vector<uint64_t> mOccupied; // bit per level
+    std::vector<uint64_t> mSummary;  // bit per non empty mOccupied word
+};
+
+// The best levels of one side in price order, kept in step with the book
+// as levels change rather than rebuilt, and published conflated. Rows past
+// mCount are zero. A side with no rows keeps no depth.
+struct DepthCache
+{
+    static constexpr size_t NO_ROW = SIZE_MAX;
+
+    DepthCache(size_t rows)
+    : mRows(rows, Level{0, NULL_ORDER, NULL_ORDER, 0, 0})
+    , mPublished(mRows)
+    {
+        assert(rows <= MAX_DEPTH_LEVELS && "Depth wider than the dirty row mask");
+    }
+
+    static inline bool Behind(bool isBid, int64_t price, int64_t than)
+    {
+        return isBid ? price < than : price > than;
+    }
+
+    inline bool Full() const
+    {
+        return mCount == mRows.size();
+    }
+
+    inline size_t Find(bool isBid, int64_t price) const
+    {
+        for(size_t row = 0; row < mCount; ++row)
+        {
+            if(mRows[row].mPrice == price) return row;
+            if(Behind(isBid, mRows[row].mPrice, price)) break;
+        }
+        return NO_ROW;
+    }
+
+    inline void MarkFrom(size_t row, size_t end)
+    {
+        for(; row < end; ++row) mDirty |= 1ull << row;
+    }
+
+    // A level already in the book changed volume or orders
+    inline void Changed(bool isBid, const Level& level)
+    {
+        size_t row = Find(isBid, level.mPrice);
+        if(row == NO_ROW) return;
+        mRows[row] = level;
+        mDirty |= 1ull << row;
+    }
+
+    // A new level, those behind it move down a row
+    inline void Added(bool isBid, const Level& level)
+    {
+        size_t row = 0;
+        while(row < mCount && Behind(isBid, level.mPrice, mRows[row].mPrice)) ++row;
+        if(row == mRows.size()) return;
+        mCount = std::min(mCount + 1, mRows.size());
+        for(size_t i = mCount - 1; i > row; --i) mRows[i] = mRows[i-1];
+        mRows[row] = level;
+        MarkFrom(row, mCount);
+    }
+
+    // The level at price is gone, those behind it move up a row. Returns
+    // true if the last row is left for the caller to fill from the book.
+    inline bool Removed(bool isBid, int64_t price)
+    {
+        size_t row = Find(isBid, price);
+        if(row == NO_ROW) return false;
+        bool wasFull = Full();
+        MarkFrom(row, mCount);
+        for(size_t i = row + 1; i < mCount; ++i) mRows[i-1] = mRows[i];
+        mRows[--mCount] = Level{0, NULL_ORDER, NULL_ORDER, 0, 0};
+        return wasFull;
+    }
 
+    inline void Append(const Level& level)
+    {
+        mRows[mCount] = level;
+        mDirty |= 1ull << mCount++;
+    }
+
+    std::vector<Level> mRows;       // only price, volume and orders are kept up
+    std::vector<Level> mPublished;  // as last sent, row by row
+    size_t mCount = 0;
+    uint64_t mDirty = 0;            // bit per row changed since it was published
 };
 
 struct SharedBookMem
 {
-    google::dense_hash_map<uint64_t, size_t> mOrderLookup;
-    google::dense_hash_map<uint16_t, std::vector<uint64_t>> mClientOrderLookup;
-    std::vector<Order> mOrderPool;
-    std::vector<OrderExtraInfo> mOrderExtraInfoPool;
-    std::vector<size_t> mOrderFreeList;
-    std::vector<size_t> mDroppedLevels;
+    // Slots of the pool with the smallest segments, growing by this maps at
+    // most one segment of each pool
+    static constexpr size_t GROW_STEP = std::min({SegmentedPool<Order>::SEGMENT_SIZE,
+        SegmentedPool<OrderInfo>::SEGMENT_SIZE, SegmentedPool<OrderExtraInfo>::SEGMENT_SIZE});
+
+    // Grows the parallel pools to orders slots and frees the new ones, lowest
+    // first. Slot 0 is NULL_ORDER and never handed out. Existing slots never
+    // move, references into the pools survive growth.
+    void Grow(size_t orders)
+    {
+        assert(orders <= MAX_ORDER_SLOTS && "Order pool beyond the slots an order id holds");
+        size_t origSize = mOrderPool.size();
+        mOrderPool.resize(orders);
+        mOrderInfoPool.resize(orders);
+        mOrderExtraInfoPool.resize(orders);
+        mOrderFreeList.reserve(orders);
+        for(size_t i = orders; i-- > std::max<size_t>(origSize, 1);) mOrderFreeList.push_back((OrderLoc)i);
+    }
+
+    // A single step of growth, what the matching thread can afford at once
+    void GrowStep()
+    {
+        Grow(mOrderPool.size() + GROW_STEP);
+    }
+
+    // Frees every slot, the pools keep their size and stay mapped
+    void Reset()
+    {
+        size_t orders = mOrderPool.size();
+        mClientOrders.clear_no_resize();
+        mDroppedLevels.clear();
+        mOrderPool.assign(orders, Order());
+        mOrderInfoPool.assign(orders, OrderInfo());
+        mOrderExtraInfoPool.assign(orders, OrderExtraInfo());
+        mOrderFreeList.clear();
+        for(size_t i = orders; i-- > 1;) mOrderFreeList.push_back((OrderLoc)i);
+    }
+
+    void LinkClientOrder(OrderLoc loc, bool isBid)
+    {
+        auto& info = mOrderInfoPool[loc];
+        auto& orders = mClientOrders[ClientKey(info.mBookId, info.mClientId)];
+        auto& list = isBid ? orders.mBids : orders.mAsks;
+        info.mClientPrev = list.mEnd;
+        info.mClientNext = NULL_ORDER;
+        if(list.mEnd != NULL_ORDER) mOrderInfoPool[list.mEnd].mClientNext = loc;
+        else list.mLead = loc;
+        list.mEnd = loc;
+    }
+
+    void UnlinkClientOrder(OrderLoc loc)
+    {
+        auto& info = mOrderInfoPool[loc];
+        if(info.mClientPrev == NULL_ORDER || info.mClientNext == NULL_ORDER)
+        {
+            // Only the lead or end of a list is referenced by it, which of
+            // the client's lists is told by which one references the order
+            auto& orders = mClientOrders.find(ClientKey(info.mBookId, info.mClientId))->second;
+            auto& list = (orders.mBids.mLead == loc || orders.mBids.mEnd == loc) ? orders.mBids : orders.mAsks;
+            if(info.mClientPrev == NULL_ORDER) list.mLead = info.mClientNext;
+            if(info.mClientNext == NULL_ORDER) list.mEnd = info.mClientPrev;
+        }
+        if(info.mClientPrev != NULL_ORDER) mOrderInfoPool[info.mClientPrev].mClientNext = info.mClientNext;
+        if(info.mClientNext != NULL_ORDER) mOrderInfoPool[info.mClientNext].mClientPrev = info.mClientPrev;
+        info.mClientPrev = NULL_ORDER;
+        info.mClientNext = NULL_ORDER;
+    }
+
+    inline size_t HugePages() const
+    {
+        return mOrderPool.mHugePages + mOrderInfoPool.mHugePages + mOrderExtraInfoPool.mHugePages;
+    }
+
+    // Keeps the pools resident, now and as they grow
+    bool Lock()
+    {
+        bool locked = mOrderPool.Lock();
+        locked &= mOrderInfoPool.Lock();
+        locked &= mOrderExtraInfoPool.Lock();
+        return locked;
+    }
+
+    // Returns up to budget slots of swept level chains to the free list, a
+    // chain cut short keeps its remainder queued. Returns the slots freed.
+    size_t FreeDroppedLevels(size_t budget = std::numeric_limits<size_t>::max())
+    {
+        size_t freed = 0;
+        while(!mDroppedLevels.empty() && freed < budget)
+        {
+            OrderLoc nextLoc = mDroppedLevels.back();
+            while(nextLoc != NULL_ORDER && freed < budget)
+            {
+                mOrderFreeList.push_back(nextLoc);
+                OrderLoc nextNextLoc = mOrderPool[nextLoc].mNext;
+                mOrderPool[nextLoc] = Order();
+                mOrderInfoPool[nextLoc].mOrderId = NULL_ID; // generation carries on
+                nextLoc = nextNextLoc;
+                ++freed;
+            }
+            if(nextLoc == NULL_ORDER) mDroppedLevels.pop_back();
+            else mDroppedLevels.back() = nextLoc;
+        }
+        return freed;
+    }
+
+    google::dense_hash_map<uint32_t, ClientOrders> mClientOrders; // by ClientKey
+    SegmentedPool<Order> mOrderPool;          // hot, matching
+    SegmentedPool<OrderInfo> mOrderInfoPool;  // cold, same slots
+    SegmentedPool<OrderExtraInfo> mOrderExtraInfoPool;
+    std::vector<OrderLoc> mOrderFreeList;
+    std::vector<OrderLoc> mDroppedLevels;   // leads of order chains still to free
 };
 
 struct IBookClient
@@ -180,55 +796,138 @@ struct IBookClient
     virtual void Handle(const BookDeleteInd&& ind) = 0;
     virtual void Handle(const BookAmendInd&& ind) = 0;
     virtual void Handle(const BookTradeInd&& ind) = 0;
+    virtual void Handle(const BookSweepInd&& ind) = 0;
+    virtual void Handle(const BookFillInd&& ind) = 0;
+    virtual void Handle(const BookDepthInd&& ind) = 0;
     virtual void Handle(const BookErrorInd&& ind) = 0;
     virtual void ImmediateCleanup() = 0;
 };
 
-struct Book
+struct AskSide;
+
+// Compile time side of the book, picks the side's levels out of a book and
+// orders prices from the most aggressive
+struct BidSide
+{
+    static constexpr bool IS_BID = true;
+    static constexpr OrderFlags FLAGS = OrderFlags::IS_BID;
+    typedef std::less<int64_t> LessAggressive;
+    typedef AskSide Opposite;
+
+    template<typename B>
+    static inline TickLadder<LessAggressive>& Ladder(B& book)
+    {
+        return book.mBidLadder;
+    }
+
+    template<typename B>
+    static inline VectorLevels<LessAggressive> Levels(B& book)
+    {
+        return VectorLevels<LessAggressive>(book.mBids);
+    }
+
+    static inline ClientOrderList& ClientList(ClientOrders& orders)
+    {
+        return orders.mBids;
+    }
+};
+
+struct AskSide
+{
+    static constexpr bool IS_BID = false;
+    static constexpr OrderFlags FLAGS = OrderFlags::IS_ASK;
+    typedef std::greater<int64_t> LessAggressive;
+    typedef BidSide Opposite;
+
+    template<typename B>
+    static inline TickLadder<LessAggressive>& Ladder(B& book)
+    {
+        return book.mAskLadder;
+    }
+
+    template<typename B>
+    static inline VectorLevels<LessAggressive> Levels(B& book)
+    {
+        return VectorLevels<LessAggressive>(book.mAsks);
+    }
+
+    static inline ClientOrderList& ClientList(ClientOrders& orders)
+    {
+        return orders.mAsks;
+    }
+};
+
+// The client is a template parameter so indications and cleanup calls are
+// resolved at compile time when it is a concrete final type. Book keeps
+// virtual dispatch through IBookClient.
+template<typename C>
+struct BasicBook
 {
-    Book(BookBehaviours behaviours, uint16_t bookId, uint64_t initOrderId, uint64_t initTradeId, 
-            SharedBookMem& bookMem, IBookClient& client) 
+    BasicBook(BookBehaviours behaviours, uint16_t bookId, uint64_t initTradeId, 
+            SharedBookMem& bookMem, C& client, int64_t tickSize=1, size_t ladderTicks=LADDER_TICKS,
+            size_t depthLevels=DEPTH_LEVELS) 
     : mBehaviours(behaviours)
     , mBookId(bookId)
     , mMem(bookMem)
     , mClient(client)
-    , mOrderId(initOrderId)
     , mTradeId(initTradeId)
+    , mBidLadder(tickSize, (behaviours & TICK_LADDER) ? ladderTicks : 0)
+    , mAskLadder(tickSize, (behaviours & TICK_LADDER) ? ladderTicks : 0)
+    , mBidDepth(depthLevels)
+    , mAskDepth(depthLevels)
     {
         mBids.reserve(100);
         mAsks.reserve(100);
+        mClientQuotes.set_empty_key(std::numeric_limits<uint16_t>::max());
+    }
+
+    // Calls f with the side's levels, the tick ladder or the sorted vector
+    template<typename S, typename F>
+    inline auto WithLevels(F&& f)
+    {
+        if(mBehaviours & TICK_LADDER) return f(S::Ladder(*this));
+        return f(S::Levels(*this));
     }
     
-    inline void SetOrder(size_t newLoc, uint16_t clientId, uint64_t orderId, 
+    template<typename S>
+    inline void SetOrder(OrderLoc newLoc, uint16_t clientId, uint64_t orderId, 
         int64_t price, int64_t volume, const char varText[VAR_TEXT_SIZE])
     {
-        mMem.mOrderLookup[orderId] = newLoc;
-        //mMem.mOrderExtraInfoPool.emplace(mMem.mOrderExtraInfoPool.begin() + newLoc, OrderExtraInfo{varText});
-        mMem.mClientOrderLookup[clientId].push_back(orderId);
-        mMem.mOrderPool.emplace(mMem.mOrderPool.begin() + newLoc, Order{clientId, orderId, price, volume, NULL_ORDER});
+        mMem.mOrderPool[newLoc] = Order{volume, NULL_ORDER, NULL_ORDER};
+        auto& info = mMem.mOrderInfoPool[newLoc];
+        info.mOrderId = orderId;
+        info.mPrice = price;
+        info.mClientId = clientId;
+        info.mBookId = mBookId;
+        memcpy(mMem.mOrderExtraInfoPool[newLoc].mVarText, varText, VAR_TEXT_SIZE);
+        mMem.LinkClientOrder(newLoc, S::IS_BID);
     }
 
-    inline size_t PopSetOrder(uint64_t orderId, uint16_t clientId, 
-        int64_t price, int64_t volume, const char varText[VAR_TEXT_SIZE])
+    // Taken before the order id is handed out, every id names its slot
+    inline OrderLoc AllocOrder()
     {
         if(UNLIKELY(mMem.mOrderFreeList.empty()))
         {
             mClient.ImmediateCleanup();
         }
-        size_t newLoc = mMem.mOrderFreeList.back();
+        OrderLoc newLoc = mMem.mOrderFreeList.back();
         mMem.mOrderFreeList.pop_back();
-        mMem.mOrderLookup[orderId] = newLoc;
-        //mMem.mOrderExtraInfoPool.emplace(mMem.mOrderExtraInfoPool.begin() + newLoc, OrderExtraInfo{varText});
-        mMem.mClientOrderLookup[clientId].push_back(orderId);
-        mMem.mOrderPool.emplace(mMem.mOrderPool.begin() + newLoc, Order{clientId, orderId, price, volume, NULL_ORDER});
         return newLoc;
     }
 
-    inline uint64_t NextOrderId()
+    inline uint64_t NextOrderId(OrderLoc loc)
     {
-        ++mOrderId;
-        mOrderId = (mOrderId & 0x0000FFFFFFFFFFFF);
-        return (((uint64_t)mBookId) << 48) | (mOrderId & 0x0000FFFFFFFFFFFF);
+        return MakeOrderId(mBookId, ++mMem.mOrderInfoPool[loc].mGeneration, loc);
+    }
+
+    // Slot of a live order of this book or NULL_ORDER
+    inline OrderLoc FindOrder(uint64_t orderId) const
+    {
+        OrderLoc loc = OrderSlot(orderId);
+        if(UNLIKELY(loc == NULL_ORDER || loc >= mMem.mOrderInfoPool.size())) return NULL_ORDER;
+        const auto& info = mMem.mOrderInfoPool[loc];
+        if(info.mOrderId != orderId || info.mBookId != mBookId) return NULL_ORDER;
+        return loc;
     }
 
     inline uint64_t NextTradeId()
@@ -238,186 +937,464 @@ struct Book
         return (((uint64_t)mBookId) << 48) | (mTradeId & 0x0000FFFFFFFFFFFF);
     }
 
-    void ProcessDelete(Order& order)
+    // Consecutive trade ids, returns the first. A block never wraps.
+    inline uint64_t ReserveTradeIds(uint32_t count)
+    {
+        if(UNLIKELY(mTradeId + count > 0x0000FFFFFFFFFFFF)) mTradeId = 0;
+        uint64_t firstTradeId = NextTradeId();
+        mTradeId += count - 1;
+        return firstTradeId;
+    }
+
+    // Reports the whole level traded by the aggressor. The orders are
+    // retired but the chain is freed later, when the engine is idle or
+    // from ImmediateCleanup.
+    template<typename S>
+    void SweepLevel(const Level& level, uint16_t clientId, uint64_t orderId)
+    {
+        BookSweepInd sweepInd;
+        sweepInd.mBookId             =  mBookId;
+        sweepInd.mAggressorClientId  =  clientId;
+        sweepInd.mAggressorOrderId   =  orderId;
+        sweepInd.mFirstTradeId       =  ReserveTradeIds(level.mOrders);
+        sweepInd.mPrice              =  level.mPrice;
+        sweepInd.mVolume             =  level.mVolume;
+        sweepInd.mFills              =  level.mOrders;
+        sweepInd.mAggressorIsBid     =  S::IS_BID;
+        mClient.Handle(std::move(sweepInd));
+
+        for(OrderLoc loc = level.mLead; loc != NULL_ORDER; loc = mMem.mOrderPool[loc].mNext)
+        {
+            auto& info = mMem.mOrderInfoPool[loc];
+            mClient.Handle(BookFillInd{mBookId, info.mClientId, info.mOrderId, mMem.mOrderPool[loc].mVolume});
+            mMem.UnlinkClientOrder(loc);
+            info.mOrderId = NULL_ID;
+        }
+        mMem.mDroppedLevels.push_back(level.mLead);
+    }
+
+    // Reports the order gone and frees its slot, the caller has taken it
+    // out of its level
+    inline void RetireOrder(OrderLoc loc)
+    {
+        auto& info = mMem.mOrderInfoPool[loc];
+        mClient.Handle(BookDeleteInd{mBookId, info.mClientId, info.mOrderId});
+        mMem.UnlinkClientOrder(loc);
+        info.mOrderId = NULL_ID;
+        mMem.mOrderFreeList.push_back(loc);
+    }
+
+    // Takes the order out of its level queue, dropping the level once empty
+    template<typename L>
+    inline void UnlinkOrder(OrderLoc loc, int64_t price, L&& supporting)
+    {
+        auto& order = mMem.mOrderPool[loc];
+        Level* level = supporting.Find(price);
+        assert(level);
+        if(--level->mOrders == 0)
+        {
+            supporting.Erase(price);
+            DepthRemoved(supporting, price);
+            return;
+        }
+        level->mVolume -= order.mVolume;
+        if(order.mPrev == NULL_ORDER) level->mLead = order.mNext;
+        else mMem.mOrderPool[order.mPrev].mNext = order.mNext;
+        if(order.mNext == NULL_ORDER) level->mEnd = order.mPrev;
+        else mMem.mOrderPool[order.mNext].mPrev = order.mPrev;
+        DepthOf(supporting).Changed(LevelsOf<L>::IS_BID, *level);
+    }
+
+    template<typename L>
+    using LevelsOf = typename std::decay<L>::type;
+
+    template<typename L>
+    inline DepthCache& DepthOf(const L&)
+    {
+        return LevelsOf<L>::IS_BID ? mBidDepth : mAskDepth;
+    }
+
+    // Called once the level at price has left levels
+    template<typename L>
+    inline void DepthRemoved(L&& levels, int64_t price)
+    {
+        auto& depth = DepthOf(levels);
+        if(!depth.Removed(LevelsOf<L>::IS_BID, price)) return;
+        const Level* next = depth.mCount ? levels.NextBehind(depth.mRows[depth.mCount-1].mPrice) :
+            (levels.Empty() ? nullptr : &levels.Best());
+        if(next) depth.Append(*next);
+    }
+
+    inline bool DepthPending() const
+    {
+        return (mBidDepth.mDirty | mAskDepth.mDirty) != 0;
+    }
+
+    // Sends a BookDepthInd for each row that ended the batch different from
+    // what was last sent for it, however many times it changed in between
+    void PublishDepth()
+    {
+        PublishDepth(mBidDepth, true);
+        PublishDepth(mAskDepth, false);
+    }
+
+    void PublishDepth(DepthCache& depth, bool isBid)
+    {
+        for(uint64_t dirty = depth.mDirty; dirty; dirty &= dirty - 1)
+        {
+            size_t row = __builtin_ctzll(dirty);
+            const Level& level = depth.mRows[row];
+            Level& published = depth.mPublished[row];
+            if(level.mPrice == published.mPrice && level.mVolume == published.mVolume &&
+                level.mOrders == published.mOrders) continue;
+            published = level;
+            mClient.Handle(BookDepthInd{mBookId, isBid, (uint8_t)row, level.mPrice, level.mVolume, level.mOrders});
+        }
+        depth.mDirty = 0;
+    }
+
+    template<typename S>
+    inline Level* FindLevel(int64_t price)
+    {
+        return WithLevels<S>([&](auto&& levels){ return levels.Find(price); });
+    }
+
+    template<typename S>
+    inline void ProcessDelete(OrderLoc loc)
     {
-        mClient.Handle(BookDeleteInd{mBookId, order.mClientId, order.mOrderId});
-        mMem.mOrderLookup.erase(order.mOrderId);
-        order.mVolume = 0;
-        order.mOrderId = NULL_ID;
-        // if it was top level we might need to remove it
+        int64_t price = mMem.mOrderInfoPool[loc].mPrice;
+        WithLevels<S>([&](auto&& levels){ UnlinkOrder(loc, price, levels); });
+        RetireOrder(loc);
     }
 
-    template<typename T>
-    size_t ProcessInsertSide(uint64_t orderId, uint16_t clientId, int64_t price, 
+    void ProcessDelete(OrderLoc loc)
+    {
+        if(IsBidLevel(mMem.mOrderInfoPool[loc].mPrice)) ProcessDelete<BidSide>(loc);
+        else ProcessDelete<AskSide>(loc);
+    }
+
+    template<typename S, typename L, typename O>
+    OrderLoc ProcessInsertSide(OrderLoc loc, uint64_t orderId, uint16_t clientId, int64_t price, 
         int64_t volume, OrderFlags flags, const char varText[VAR_TEXT_SIZE],
-        std::vector<Level>& supporting, std::vector<Level>& opposing, T lessAggressive)
+        L&& supporting, O&& opposing)
     {
-        size_t restingLoc = NULL_ORDER;
+        typename S::LessAggressive lessAggressive;
+        OrderLoc restingLoc = NULL_ORDER;
         BookTradeInd tradeInd;
         tradeInd.mBookId             =  mBookId;
         tradeInd.mAggressorClientId  =  clientId;
         tradeInd.mAggressorOrderId   =  orderId;
-        tradeInd.mAggressorIsBid     =  flags & OrderFlags::IS_BID;
+        tradeInd.mAggressorIsBid     =  S::IS_BID;
 
         int64_t remainingVolume = volume;
-        auto opitr = opposing.rbegin();
 
         // Try trading it
         while
         (
-            (opitr != opposing.rend()) && 
+            !opposing.Empty() && 
             (remainingVolume > 0) &&
             (
-                 lessAggressive(mMem.mOrderPool[opitr->mLead].mPrice, price) ||
-                (mMem.mOrderPool[opitr->mLead].mPrice == price)
+                 lessAggressive(opposing.BestPrice(), price) ||
+                (opposing.BestPrice() == price)
             )
         )
         {
+            Level& level = opposing.Best();
+            int64_t levelPrice = level.mPrice;
+            if(remainingVolume >= level.mVolume && (mBehaviours & SWEEP_FILLS))
+            {
+                remainingVolume -= level.mVolume;
+                SweepLevel<S>(level, clientId, orderId);
+                opposing.PopBest();
+                DepthRemoved(opposing, levelPrice);
+                continue;
+            }
+            if(remainingVolume >= level.mVolume)
+            {
+                // The whole level trades, every order fills completely
+                remainingVolume -= level.mVolume;
+                OrderLoc passiveLoc = level.mLead;
+                while(passiveLoc != NULL_ORDER)
+                {
+                    const auto& order = mMem.mOrderPool[passiveLoc];
+                    OrderLoc nextLoc = order.mNext;
+                    if(LIKELY(order.mVolume > 0))
+                    {
+                        const auto& info = mMem.mOrderInfoPool[passiveLoc];
+                        tradeInd.mTradeId          =  NextTradeId();
+                        tradeInd.mPassiveClientId  =  info.mClientId;
+                        tradeInd.mPassiveOrderId   =  info.mOrderId;
+                        tradeInd.mPrice            =  level.mPrice;
+                        tradeInd.mVolume           =  order.mVolume;
+                        mClient.Handle(std::move(tradeInd));
+                    }
+                    RetireOrder(passiveLoc);
+                    passiveLoc = nextLoc;
+                }
+                opposing.PopBest();
+                DepthRemoved(opposing, levelPrice);
+                continue;
+            }
+
+            // Partially through the level, stops within it
             do
             {
-                auto& order = mMem.mOrderPool[opitr->mLead];
+                OrderLoc passiveLoc = level.mLead;
+                auto& order = mMem.mOrderPool[passiveLoc];
                 int64_t match = std::min(order.mVolume, remainingVolume);
                 if(match > 0)
                 {
                     remainingVolume -= match;
                     order.mVolume -= match;
+                    level.mVolume -= match;
                     
+                    const auto& info = mMem.mOrderInfoPool[passiveLoc];
                     tradeInd.mTradeId          =  NextTradeId();
-                    tradeInd.mPassiveClientId  =  order.mClientId;
-                    tradeInd.mPassiveOrderId   =  order.mOrderId;
-                    tradeInd.mPrice            =  order.mPrice;
+                    tradeInd.mPassiveClientId  =  info.mClientId;
+                    tradeInd.mPassiveOrderId   =  info.mOrderId;
+                    tradeInd.mPrice            =  level.mPrice;
                     tradeInd.mVolume           =  match;
-                    //mClient.Handle(tradeInd);
+                    mClient.Handle(std::move(tradeInd));
                 }
 
                 if(order.mVolume <= 0)
                 {
-                    mMem.mOrderFreeList.push_back(opitr->mLead);
-                    opitr->mLead = order.mNext;
-                    if(order.mOrderId != NULL_ID) ProcessDelete(order);
+                    level.mLead = order.mNext;
+                    --level.mOrders;
+                    RetireOrder(passiveLoc);
                 }
             }
-            while(opitr->mLead && remainingVolume > 0);
+            while(remainingVolume > 0);
 
-            if(opitr->mLead == NULL_ORDER)
-            {
-                mMem.mDroppedLevels.push_back(opitr->mLead);
-                opposing.pop_back();
-            }
-            ++opitr;
+            mMem.mOrderPool[level.mLead].mPrev = NULL_ORDER;
+            DepthOf(opposing).Changed(LevelsOf<O>::IS_BID, level);
         }
 
         if(!(flags & OrderFlags::IS_FAK) && (remainingVolume > 0))
         {
-            auto britr = supporting.rbegin();
-            // TODO instead of a linear search here I think we could linear search < 10 tops levels then fall
-            // back to binary search
-            while((britr != supporting.rend()) && lessAggressive(price, mMem.mOrderPool[britr->mLead].mPrice)) ++britr;
-            if(mMem.mOrderPool[britr->mLead].mPrice == price)
-            {
-                if(mMem.mOrderPool[britr->mLead].mOrderId == NULL_ID) // empty level
-                {
-                    SetOrder(britr->mLead, orderId, clientId, price, volume, varText);
-                }
-                else
-                {
-                    restingLoc = PopSetOrder(orderId, clientId, price, volume, varText);
-                    mMem.mOrderPool[britr->mEnd].mNext = restingLoc;
-                    britr->mEnd = restingLoc;
-                }
-            }
-            else
-            {
-                restingLoc = PopSetOrder(orderId, clientId, price, volume, varText);
-                //supporting.emplace(britr, Level{restingLoc, restingLoc});
-            }
+            restingLoc = RestOrder<S>(loc, orderId, clientId, price, remainingVolume, varText, supporting);
         }
         else
         {
+            mMem.mOrderFreeList.push_back(loc);
             mClient.Handle(BookDeleteInd{mBookId, clientId, orderId});
         }
         return restingLoc;
     }
 
-    size_t ProcessAmend(Order& order, size_t orderOffset, int64_t newPrice, int64_t newVolume, bool volumeDelta,
+    // Queues the order in its slot at the back of its price level
+    template<typename S, typename L>
+    OrderLoc RestOrder(OrderLoc loc, uint64_t orderId, uint16_t clientId, int64_t price, 
+        int64_t volume, const char varText[VAR_TEXT_SIZE], L&& supporting)
+    {
+        SetOrder<S>(loc, clientId, orderId, price, volume, varText);
+        AppendOrder(loc, price, supporting);
+        return loc;
+    }
+
+    template<typename L>
+    inline void AppendOrder(OrderLoc loc, int64_t price, L&& supporting)
+    {
+        Level* level = supporting.Find(price);
+        if(level)
+        {
+            mMem.mOrderPool[level->mEnd].mNext = loc;
+            mMem.mOrderPool[loc].mPrev = level->mEnd;
+            level->mEnd = loc;
+            level->mVolume += mMem.mOrderPool[loc].mVolume;
+            ++level->mOrders;
+            DepthOf(supporting).Changed(LevelsOf<L>::IS_BID, *level);
+        }
+        else
+        {
+            const Level& added = supporting.Insert(price, Level{price, loc, loc, mMem.mOrderPool[loc].mVolume, 1});
+            DepthOf(supporting).Added(LevelsOf<L>::IS_BID, added);
+        }
+    }
+
+    // Puts an order back in the slot it was taken from at the back of its
+    // level. No matching, indications or client order lists, used when
+    // restoring.
+    void RestoreOrder(bool isBid, OrderLoc loc, uint64_t orderId, uint16_t clientId, int64_t price, 
+        int64_t volume, const char varText[VAR_TEXT_SIZE])
+    {
+        mMem.mOrderPool[loc] = Order{volume, NULL_ORDER, NULL_ORDER};
+        auto& info = mMem.mOrderInfoPool[loc];
+        info.mOrderId = orderId;
+        info.mPrice = price;
+        info.mClientId = clientId;
+        info.mBookId = mBookId;
+        memcpy(mMem.mOrderExtraInfoPool[loc].mVarText, varText, VAR_TEXT_SIZE);
+
+        auto append = [&](auto&& levels){ AppendOrder(loc, price, levels); };
+        if(isBid) WithLevels<BidSide>(append);
+        else WithLevels<AskSide>(append);
+    }
+
+    // Calls f(price, level) for each level of a side from the best price down
+    template<typename F>
+    void ForEachLevel(bool isBid, F&& f) const
+    {
+        if(mBehaviours & TICK_LADDER)
+        {
+            if(isBid) ForEachLadderLevel(mBidLadder, f);
+            else ForEachLadderLevel(mAskLadder, f);
+            return;
+        }
+        const auto& levels = isBid ? mBids : mAsks;
+        for(auto itr = levels.rbegin(); itr != levels.rend(); ++itr)
+        {
+            f(itr->mPrice, *itr);
+        }
+    }
+
+    template<typename L, typename F>
+    static void ForEachLadderLevel(const L& ladder, F& f)
+    {
+        for(size_t idx = ladder.mBest; idx != L::NO_LEVEL; idx = ladder.Next(idx))
+        {
+            f(ladder.PriceAt(idx), ladder.mLevels[idx]);
+        }
+    }
+
+    template<typename S>
+    OrderLoc ProcessInsert(OrderLoc loc, uint64_t orderId, uint16_t clientId, int64_t price, 
+        int64_t volume, OrderFlags flags, const char varText[VAR_TEXT_SIZE])
+    {
+        if(mBehaviours & TICK_LADDER)
+        {
+            return ProcessInsertSide<S>(loc, orderId, clientId, price, volume, flags, varText, 
+                S::Ladder(*this), S::Opposite::Ladder(*this));
+        }
+        return ProcessInsertSide<S>(loc, orderId, clientId, price, volume, flags, varText,
+            S::Levels(*this), S::Opposite::Levels(*this));
+    }
+
+    // Whether the count prices may rest on the side. Ladder books take
+    // prices on their tick that fit in the ladder with its levels, the
+    // sorted vectors take any.
+    template<typename S>
+    bool ValidPrices(const QuoteLevel* levels, size_t count)
+    {
+        if(!(mBehaviours & TICK_LADDER) || !count) return true;
+        const auto& ladder = S::Ladder(*this);
+        int64_t low = levels[0].mPrice;
+        int64_t high = low;
+        for(size_t i = 0; i < count; ++i)
+        {
+            if(!ladder.OnTick(levels[i].mPrice)) return false;
+            low = std::min(low, levels[i].mPrice);
+            high = std::max(high, levels[i].mPrice);
+        }
+        return ladder.Fits(low, high);
+    }
+
+    template<typename S>
+    inline bool ValidPrice(int64_t price)
+    {
+        QuoteLevel level{price, 0};
+        return ValidPrices<S>(&level, 1);
+    }
+
+    inline bool IsBidLevel(int64_t price)
+    {
+        if(mBehaviours & TICK_LADDER) return mBidLadder.Find(price) != nullptr;
+        return !mBids.empty() && (price <= mBids.back().mPrice);
+    }
+
+    template<typename S>
+    OrderLoc ProcessAmend(OrderLoc orderOffset, int64_t newPrice, int64_t newVolume, bool volumeDelta,
         const char varText[VAR_TEXT_SIZE])
     {
-        int64_t adjVolume = volumeDelta ? order.mVolume + newVolume : newVolume;
-        // TODO add check for negative volume
-        bool qpLoss = (adjVolume > order.mVolume);
+        int64_t adjVolume = volumeDelta ? mMem.mOrderPool[orderOffset].mVolume + newVolume : newVolume;
+        bool qpLoss = (adjVolume > mMem.mOrderPool[orderOffset].mVolume);
         bool changePrice = (newPrice != 0);
-        int64_t price = changePrice ? newPrice : order.mPrice;
+        // A requeued order takes a new slot and the old one is freed
+        OrderLoc newLoc = (qpLoss || changePrice) ? AllocOrder() : orderOffset;
+        auto& order = mMem.mOrderPool[orderOffset];
+        auto& info = mMem.mOrderInfoPool[orderOffset];
+        int64_t price = changePrice ? newPrice : info.mPrice;
         bool resetOrderId = qpLoss || changePrice || (!(mBehaviours & AMEND_SAMEQP_SAMEID));
-        uint64_t newOrderId = NextOrderId();
+        uint64_t newOrderId = resetOrderId ? NextOrderId(newLoc) : info.mOrderId;
 
         BookAmendInd amendInd;
         amendInd.mBookId       =  mBookId;
-        amendInd.mClientId     =  order.mClientId;
-        amendInd.mOrigOrderId  =  order.mOrderId;
-        amendInd.mNewOrderId   =  resetOrderId ? newOrderId : order.mOrderId;
+        amendInd.mClientId     =  info.mClientId;
+        amendInd.mOrigOrderId  =  info.mOrderId;
+        amendInd.mNewOrderId   =  resetOrderId ? newOrderId : info.mOrderId;
         amendInd.mPrice        =  price;
         amendInd.mVolume       =  newVolume;
         amendInd.mVolumeDelta  =  volumeDelta;
-        //mClient.Handle(amendInd);
+        mClient.Handle(std::move(amendInd));
 
         if(qpLoss || changePrice)
         {
-            bool isBid = !mBids.empty() && (order.mPrice <= mMem.mOrderPool[mBids.front().mLead].mPrice);
-
-            ProcessDelete(order);
+            ProcessDelete<S>(orderOffset);
             
-            if(isBid)
-            {
-                orderOffset = ProcessInsertSide(newOrderId, amendInd.mClientId, price, 
-                    adjVolume, OrderFlags::IS_BID, varText, mBids, mAsks, std::less<int64_t>());
-            }
-            else
-            {
-                orderOffset = ProcessInsertSide(newOrderId, amendInd.mClientId, price, 
-                    adjVolume, OrderFlags::IS_ASK, varText, mAsks, mBids, std::greater<int64_t>());
-            }
-        }
-        else if(!resetOrderId)
-        {
-            order.mVolume = adjVolume;
-            memcmp(mMem.mOrderExtraInfoPool[orderOffset].mVarText, varText, VAR_TEXT_SIZE);
+            orderOffset = ProcessInsert<S>(newLoc, newOrderId, amendInd.mClientId, price, adjVolume, 
+                S::FLAGS, varText);
         }
         else
         {
+            Level* level = FindLevel<S>(info.mPrice);
+            level->mVolume += adjVolume - order.mVolume;
+            (S::IS_BID ? mBidDepth : mAskDepth).Changed(S::IS_BID, *level);
             order.mVolume = adjVolume;
-            order.mOrderId = newOrderId;
-            memcmp(mMem.mOrderExtraInfoPool[orderOffset].mVarText, varText, VAR_TEXT_SIZE);
+            info.mOrderId = newOrderId;
+            memcpy(mMem.mOrderExtraInfoPool[orderOffset].mVarText, varText, VAR_TEXT_SIZE);
+
+            // Amended down to nothing, resting volume is always positive
+            if(UNLIKELY(adjVolume <= 0))
+            {
+                ProcessDelete<S>(orderOffset);
+                return NULL_ORDER;
+            }
         }
         return orderOffset;
     }
 
-    void ProcessQuotes(std::vector<uint64_t>& curQuotes, uint16_t clientId, bool isBid,
+    template<typename S>
+    void ProcessQuotes(std::vector<uint64_t>& curQuotes, uint16_t clientId,
             const char varText[VAR_TEXT_SIZE], const QuoteLevel* levels, uint8_t levelCount)
     {
         uint8_t cnt = 0;
         auto curIdItr = curQuotes.begin();
-        while(curIdItr == curQuotes.end())
+        while(curIdItr != curQuotes.end())
         {
             // TODO later consider adding insert here if order has been
             // delete or traded otherwise quote adjustments might result 
             // in loss of qp
-            auto litr = mMem.mOrderLookup.find(*curIdItr);
-            if(litr == mMem.mOrderLookup.end())
+            OrderLoc loc = FindOrder(*curIdItr);
+            if(loc == NULL_ORDER)
             {
                 curIdItr = curQuotes.erase(curIdItr);
                 continue;
             }
 
-            auto& order = mMem.mOrderPool[litr->second];
-            const auto& level = levels[cnt];
-            if(cnt < levelCount)
+            // Quotes on the other side are left to its own pass
+            if(IsBidLevel(mMem.mOrderInfoPool[loc].mPrice) != S::IS_BID)
             {
-                ProcessAmend(order, litr->second, level.mPrice, level.mVolume, false, varText);
                 ++curIdItr;
+                continue;
+            }
+
+            if(cnt < levelCount)
+            {
+                const auto& level = levels[cnt];
+                loc = ProcessAmend<S>(loc, level.mPrice, level.mVolume, false, varText);
+                if(loc == NULL_ORDER)
+                {
+                    curIdItr = curQuotes.erase(curIdItr);
+                }
+                else
+                {
+                    // Amends can move the quote to a new id
+                    *curIdItr++ = mMem.mOrderInfoPool[loc].mOrderId;
+                }
             }
             else
             {
-                ProcessDelete(order);
+                ProcessDelete<S>(loc);
                 curIdItr = curQuotes.erase(curIdItr);
             }
             ++cnt;
@@ -426,39 +1403,45 @@ struct Book
         while(cnt < levelCount)
         {
             const auto& level = levels[cnt++];
-            uint64_t orderId = NextOrderId();
+            OrderLoc loc = AllocOrder();
+            uint64_t orderId = NextOrderId(loc);
 
             BookInsertInd insertInd;
             insertInd.mBookId    =  mBookId;
             insertInd.mClientId  =  clientId;
             insertInd.mOrderId   =  orderId;
-            insertInd.mFlags     =  isBid ? OrderFlags::IS_BID : OrderFlags::IS_ASK;
+            insertInd.mFlags     =  S::FLAGS;
             insertInd.mPrice     =  level.mPrice;
             insertInd.mVolume    =  level.mVolume;
-            //mClient.Handle(insertInd);
+            mClient.Handle(std::move(insertInd));
             
-            if(isBid)
-            {
-                ProcessInsertSide(orderId, clientId, level.mPrice, level.mVolume, OrderFlags::IS_BID, 
-                    varText, mBids, mAsks, std::less<int64_t>());
-            }
-            else
-            {
-                ProcessInsertSide(orderId, clientId, level.mPrice, level.mVolume, OrderFlags::IS_ASK, 
-                    varText, mAsks, mBids, std::greater<int64_t>());
-            }
+            ProcessInsert<S>(loc, orderId, clientId, level.mPrice, level.mVolume, S::FLAGS, varText);
             curQuotes.push_back(orderId);
         }
     }
 
-    void ClearReq(const BookInsertReq& req)
+    void ClearReq(const BookClearReq& req)
     {
         // todo
     }
 
     void InsertReq(const BookInsertReq& req)
     {
-        uint64_t orderId = NextOrderId();
+        if(req.mFlags & OrderFlags::IS_BID) InsertSide<BidSide>(req);
+        else InsertSide<AskSide>(req);
+    }
+
+    template<typename S>
+    void InsertSide(const BookInsertReq& req)
+    {
+        if(UNLIKELY(!ValidPrice<S>(req.mPrice)))
+        {
+            mClient.Handle(BookErrorInd{mBookId, req.mClientId, NULL_ID, ErrorCode::INVALID_PRICE});
+            return;
+        }
+
+        OrderLoc loc = AllocOrder();
+        uint64_t orderId = NextOrderId(loc);
 
         BookInsertInd insertInd;
         insertInd.mBookId    =  mBookId;
@@ -467,46 +1450,43 @@ struct Book
         insertInd.mFlags     =  req.mFlags;
         insertInd.mPrice     =  req.mPrice;
         insertInd.mVolume    =  req.mVolume;
-        //mClient.Handle(insertInd);
+        mClient.Handle(std::move(insertInd));
 
-        if(req.mFlags & OrderFlags::IS_BID)
-        {
-            ProcessInsertSide(orderId, req.mClientId, req.mPrice, req.mVolume, req.mFlags, req.mVarText, mBids, mAsks, std::less<int64_t>());
-        }
-        else
-        {
-            ProcessInsertSide(orderId, req.mClientId, req.mPrice, req.mVolume, req.mFlags, req.mVarText, mAsks, mBids, std::greater<int64_t>());
-        }
+        ProcessInsert<S>(loc, orderId, req.mClientId, req.mPrice, req.mVolume, req.mFlags, req.mVarText);
     }
 
-    void QuoteReq(BookQuoteReq& req)
+    void QuoteReq(const BookQuoteReq& req)
     {
         // todo check
         // prices are descending and not in cross
         // do not modify other participants orders
+        if(UNLIKELY(!ValidPrices<BidSide>(req.mQuotes, req.mBids) ||
+            !ValidPrices<AskSide>(req.mQuotes+req.mBids, req.mAsks)))
+        {
+            mClient.Handle(BookErrorInd{mBookId, req.mClientId, NULL_ID, ErrorCode::INVALID_PRICE});
+            return;
+        }
         auto& curQuotes = mClientQuotes[req.mClientId];
-        ProcessQuotes(curQuotes, req.mClientId, true/*isbid*/, req.mVarText, req.mQuotes, req.mBids);
-        ProcessQuotes(curQuotes, req.mClientId, false/*isbid*/, req.mVarText, req.mQuotes+req.mBids, req.mAsks);
+        ProcessQuotes<BidSide>(curQuotes, req.mClientId, req.mVarText, req.mQuotes, req.mBids);
+        ProcessQuotes<AskSide>(curQuotes, req.mClientId, req.mVarText, req.mQuotes+req.mBids, req.mAsks);
     }
 
-    void DeleteReq(BookDeleteReq& req)
+    void DeleteReq(const BookDeleteReq& req)
     {
-        auto litr = mMem.mOrderLookup.find(req.mOrderId);
-        if(litr == mMem.mOrderLookup.end())
+        OrderLoc loc = FindOrder(req.mOrderId);
+        if(loc == NULL_ORDER)
         {
             mClient.Handle(BookErrorInd{mBookId, req.mClientId, req.mOrderId, ErrorCode::UNKNOWN_ORDER});
             return;
         }
-        assert(mMem.mOrderPool.size() < litr->second);
 
-        auto& order = mMem.mOrderPool[litr->second];
-        if(order.mClientId != req.mClientId)
+        if(mMem.mOrderInfoPool[loc].mClientId != req.mClientId)
         {
             mClient.Handle(BookErrorInd{mBookId, req.mClientId, req.mOrderId, ErrorCode::NOT_CLIENT_ORDER});
             return;
         }
 
-        ProcessDelete(order);
+        ProcessDelete(loc);
     }
     
     inline bool MatchVarText(const char* pattern, const char* target)
@@ -514,66 +1494,83 @@ struct Book
         return strncmp(pattern, target, VAR_TEXT_SIZE) == 0;
     }
 
-    void BulkDeleteReq(BookBulkDeleteReq& req)
+    template<typename S>
+    void BulkDeleteSide(ClientOrders& orders, const char varText[VAR_TEXT_SIZE])
     {
-        auto colitr = mMem.mClientOrderLookup.find(req.mClientId);
-        if(colitr == mMem.mClientOrderLookup.end())
+        OrderLoc loc = S::ClientList(orders).mLead;
+        while(loc != NULL_ORDER)
         {
-            mClient.Handle(BookErrorInd{mBookId, req.mClientId, NULL_ID, ErrorCode::CLIENT_HAS_NO_ORDERS});
-            return;
-        }
-        
-        auto orderIdItr = colitr->second.begin(); 
-        while(orderIdItr == colitr->second.end())
-        {
-            auto litr = mMem.mOrderLookup.find(*orderIdItr);
-            if(litr == mMem.mOrderLookup.end())
+            OrderLoc next = mMem.mOrderInfoPool[loc].mClientNext;
+            if(MatchVarText(varText, mMem.mOrderExtraInfoPool[loc].mVarText))
             {
-                orderIdItr = colitr->second.erase(orderIdItr);
-                continue;
+                ProcessDelete<S>(loc);
             }
+            loc = next;
+        }
+    }
 
-            if(MatchVarText(req.mVarText, mMem.mOrderExtraInfoPool[litr->second].mVarText))
-            {
-                auto& order = mMem.mOrderPool[litr->second];
-                //if(order.mFlags & req.mFlags)
-                // TODO delete only bids/asks
-                {
-                    ProcessDelete(order);
-                }
-            }
-            ++orderIdItr;
+    // Walks only the client's live orders in this book, bids then asks.
+    // Without a side flag both sides are deleted.
+    void BulkDeleteReq(const BookBulkDeleteReq& req)
+    {
+        auto coitr = mMem.mClientOrders.find(ClientKey(mBookId, req.mClientId));
+        if(coitr == mMem.mClientOrders.end())
+        {
+            mClient.Handle(BookErrorInd{mBookId, req.mClientId, NULL_ID, ErrorCode::CLIENT_HAS_NO_ORDERS});
+            return;
         }
+
+        bool anySide = !(req.mFlags & (OrderFlags::IS_BID | OrderFlags::IS_ASK));
+        if(anySide || (req.mFlags & OrderFlags::IS_BID)) BulkDeleteSide<BidSide>(coitr->second, req.mVarText);
+        if(anySide || (req.mFlags & OrderFlags::IS_ASK)) BulkDeleteSide<AskSide>(coitr->second, req.mVarText);
     }
 
-    void AmendReq(BookAmendReq& req)
+    void AmendReq(const BookAmendReq& req)
     {
-        auto litr = mMem.mOrderLookup.find(req.mOrderId);
-        if(litr == mMem.mOrderLookup.end())
+        OrderLoc loc = FindOrder(req.mOrderId);
+        if(loc == NULL_ORDER)
         {
             mClient.Handle(BookErrorInd{mBookId, req.mClientId, req.mOrderId, ErrorCode::UNKNOWN_ORDER});
             return;
         }
-        assert(mMem.mOrderPool.size() < litr->second);
 
-        auto& order = mMem.mOrderPool[litr->second];
-        if(order.mClientId != req.mClientId)
+        if(mMem.mOrderInfoPool[loc].mClientId != req.mClientId)
         {
             mClient.Handle(BookErrorInd{mBookId, req.mClientId, req.mOrderId, ErrorCode::NOT_CLIENT_ORDER});
+            return;
         }
 
-        ProcessAmend(order, litr->second, req.mPrice, req.mVolume, req.mVolumeDelta, req.mVarText);
+        bool isBid = IsBidLevel(mMem.mOrderInfoPool[loc].mPrice);
+        if(req.mPrice != 0 && UNLIKELY(!(isBid ? ValidPrice<BidSide>(req.mPrice) : ValidPrice<AskSide>(req.mPrice))))
+        {
+            mClient.Handle(BookErrorInd{mBookId, req.mClientId, req.mOrderId, ErrorCode::INVALID_PRICE});
+            return;
+        }
+
+        if(isBid)
+        {
+            ProcessAmend<BidSide>(loc, req.mPrice, req.mVolume, req.mVolumeDelta, req.mVarText);
+        }
+        else
+        {
+            ProcessAmend<AskSide>(loc, req.mPrice, req.mVolume, req.mVolumeDelta, req.mVarText);
+        }
     }
 
     const BookBehaviours mBehaviours;
     uint16_t mBookId;
     SharedBookMem& mMem;
-    IBookClient& mClient;
-    uint64_t mOrderId;
+    C& mClient;
     uint64_t mTradeId;
     std::vector<Level> mBids; // offset to start and end of level
     std::vector<Level> mAsks;
+    TickLadder<std::less<int64_t>> mBidLadder;
+    TickLadder<std::greater<int64_t>> mAskLadder;
+    DepthCache mBidDepth;
+    DepthCache mAskDepth;
     google::dense_hash_map<uint16_t, std::vector<uint64_t>> mClientQuotes;
 };
 
+typedef BasicBook<IBookClient> Book;
+
 }
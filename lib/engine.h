@@ -1,10 +1,22 @@
+#pragma once
 
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <type_traits>
 #include <sparsehash/dense_hash_map>
 #include "book.h"
+#include "journal.h"
+#include "latency.h"
 
 namespace redheads
 {
 
+constexpr size_t MAX_MSG_SIZE = 2048;
+constexpr size_t RECLAIM_BUDGET = 256;        // dropped slots freed per idle call
+constexpr size_t FREE_LOW_WATER_DIVISOR = 8;  // grow while under 1/8th of the pool is free
+
 #pragma pack(push, 1)
 
 enum class EngMsgId : uint8_t
@@ -20,6 +32,20 @@ enum class EngMsgId : uint8_t
 
     PART_BOOK_AVAIL_IND,
     PART_OP_CNF,
+
+    PART_BOOK_CLEAR_IND,
+    PART_BOOK_INSERT_IND,
+    PART_BOOK_DELETE_IND,
+    PART_BOOK_AMEND_IND,
+    PART_BOOK_TRADE_IND,
+    PART_BOOK_SWEEP_IND,
+    PART_BOOK_FILL_IND,
+
+    PART_OP_BATCH_REQ,
+    PART_OP_RANGE_CNF,
+
+    PART_BOOK_DEPTH_IND,
+    PART_OP_REJ,
 };
 
 // Instrument Type
@@ -90,8 +116,139 @@ struct EngOperationCnf
     OperationId mOperationId;
 };
 
+// Body of a PART_OP_BATCH_REQ. Its EngOperationReq header holds the gateway
+// and first sequence, the series is unused. The lengths are followed by
+// mCount complete operations, each an EngOperationReq and its body, with
+// sequences counting on from the first.
+struct EngBatchReq
+{
+    uint8_t  mCount;
+    uint16_t mLengths[]; // of each operation, header included
+};
+
+// Confirms the mCount operations counting on from mOperationId
+struct EngOperationRangeCnf
+{
+    EngMsgId    mMsgId;
+    OperationId mOperationId;
+    uint16_t    mCount;
+};
+
+// A malformed request, or batch, was dropped and its sequence not used up
+struct EngOperationRej
+{
+    EngMsgId    mMsgId;
+    OperationId mOperationId;
+};
+
 #pragma pack(pop)
 
+// Book request schema, a row per message id with the Book method taking it
+// and the fixed size of its body on the wire. Dispatch is generated from
+// it, and the layout asserts below hold the packed structs to the sizes
+// and field offsets gateways encode against.
+#define RH_BOOK_REQUESTS(REQ) \
+    REQ(PART_BOOK_OP_CLEAR_REQ,    ClearReq,      0)  \
+    REQ(PART_BOOK_OP_INSERT_REQ,   InsertReq,     29) \
+    REQ(PART_BOOK_OP_QUOTE_REQ,    QuoteReq,      14) \
+    REQ(PART_BOOK_OP_DEL_REQ,      DeleteReq,     10) \
+    REQ(PART_BOOK_OP_BULK_DEL_REQ, BulkDeleteReq, 13) \
+    REQ(PART_BOOK_OP_AMEND_REQ,    AmendReq,      37)
+
+constexpr size_t ENG_OPERATION_REQ_SIZE = 17;
+constexpr size_t ENG_CREATE_BODY_SIZE = 6;  // what follows the EngOperationReq
+constexpr size_t ENG_BATCH_BODY_SIZE = 1;   // before the lengths
+
+// Empty bodies are still a byte to sizeof
+template<typename T>
+constexpr size_t WireSize()
+{
+    return std::is_empty<T>::value ? 0 : sizeof(T);
+}
+
+#define RH_ASSERT_WIRE_SIZE(__ID, __TYPE_REQ, __SIZE) \
+    static_assert(WireSize<Book##__TYPE_REQ>() == __SIZE, "Book" #__TYPE_REQ " does not match its wire size");
+RH_BOOK_REQUESTS(RH_ASSERT_WIRE_SIZE)
+#undef RH_ASSERT_WIRE_SIZE
+
+#define RH_ASSERT_WIRE_OFFSET(__TYPE, __FIELD, __OFFSET) \
+    static_assert(offsetof(__TYPE, __FIELD) == __OFFSET, #__TYPE "::" #__FIELD " moved on the wire");
+RH_ASSERT_WIRE_OFFSET(EngOperationReq,   mMsgId,          0)
+RH_ASSERT_WIRE_OFFSET(EngOperationReq,   mSeries,         1)
+RH_ASSERT_WIRE_OFFSET(EngOperationReq,   mOperationId,    13)
+RH_ASSERT_WIRE_OFFSET(EngCreateBookReq,  mOperationId,    13)
+RH_ASSERT_WIRE_OFFSET(EngCreateBookReq,  mBookId,         17)
+RH_ASSERT_WIRE_OFFSET(EngCreateBookReq,  mBookBehaviours, 19)
+RH_ASSERT_WIRE_OFFSET(EngBatchReq,       mLengths,        1)
+RH_ASSERT_WIRE_OFFSET(BookInsertReq,     mFlags,          2)
+RH_ASSERT_WIRE_OFFSET(BookInsertReq,     mPrice,          3)
+RH_ASSERT_WIRE_OFFSET(BookInsertReq,     mVolume,         11)
+RH_ASSERT_WIRE_OFFSET(BookInsertReq,     mVarText,        19)
+RH_ASSERT_WIRE_OFFSET(BookQuoteReq,      mVarText,        2)
+RH_ASSERT_WIRE_OFFSET(BookQuoteReq,      mBids,           12)
+RH_ASSERT_WIRE_OFFSET(BookQuoteReq,      mAsks,           13)
+RH_ASSERT_WIRE_OFFSET(BookQuoteReq,      mQuotes,         14)
+RH_ASSERT_WIRE_OFFSET(BookDeleteReq,     mOrderId,        2)
+RH_ASSERT_WIRE_OFFSET(BookBulkDeleteReq, mFlags,          2)
+RH_ASSERT_WIRE_OFFSET(BookBulkDeleteReq, mVarText,        3)
+RH_ASSERT_WIRE_OFFSET(BookAmendReq,      mOrderId,        2)
+RH_ASSERT_WIRE_OFFSET(BookAmendReq,      mPrice,          10)
+RH_ASSERT_WIRE_OFFSET(BookAmendReq,      mVolume,         18)
+RH_ASSERT_WIRE_OFFSET(BookAmendReq,      mVolumeDelta,    26)
+RH_ASSERT_WIRE_OFFSET(BookAmendReq,      mVarText,        27)
+#undef RH_ASSERT_WIRE_OFFSET
+
+static_assert(sizeof(EngOperationReq) == ENG_OPERATION_REQ_SIZE, "EngOperationReq does not match its wire size");
+static_assert(sizeof(EngCreateBookReq) == ENG_OPERATION_REQ_SIZE + ENG_CREATE_BODY_SIZE,
+    "EngCreateBookReq does not match its wire size");
+static_assert(sizeof(EngBatchReq) == ENG_BATCH_BODY_SIZE, "EngBatchReq does not match its wire size");
+static_assert(sizeof(QuoteLevel) == 16, "QuoteLevel does not match its wire size");
+
+// Bytes of variable length tail following the fixed part of a body
+template<typename T>
+constexpr size_t TailSize(const T&)
+{
+    return 0;
+}
+
+inline size_t TailSize(const BookQuoteReq& req)
+{
+    return ((size_t)req.mBids + req.mAsks) * sizeof(QuoteLevel);
+}
+
+inline size_t TailSize(const EngBatchReq& req)
+{
+    return (size_t)req.mCount * sizeof(uint16_t);
+}
+
+// The body in place if size bytes hold its SIZE fixed bytes and its whole
+// tail, otherwise null. A single comparison for bodies without a tail.
+template<typename T, size_t SIZE>
+inline const T* DecodeBody(const char* msg, size_t size)
+{
+    if(UNLIKELY(size < SIZE)) return nullptr;
+    const auto* body = reinterpret_cast<const T*>(msg);
+    if(UNLIKELY(size - SIZE < TailSize(*body))) return nullptr;
+    return body;
+}
+
+// Whether an operation is a create or book request and its body holds
+// everything its type needs. Any other id, a batch included, is not an
+// operation.
+inline bool WellFormed(const EngOperationReq& req, const char* msg, size_t size)
+{
+#define CheckBookReq(__ID, __TYPE_REQ, __SIZE) \
+    case EngMsgId::__ID: return DecodeBody<Book##__TYPE_REQ, __SIZE>(msg, size) != nullptr;
+
+    switch(req.mMsgId)
+    {
+        case EngMsgId::PART_BOOK_CREATE_REQ: return size >= ENG_CREATE_BODY_SIZE;
+        RH_BOOK_REQUESTS(CheckBookReq)
+        default: return false;
+    }
+#undef CheckBookReq
+}
+
 inline EngSeriesId MaskEngSeriesIdByInstrType(EngSeriesId id)
 {
     id.mModifier = 0;
@@ -118,124 +275,391 @@ inline EngSeriesId MaskEngSeriesIdByUnderlying(EngSeriesId id)
     return id;
 }
 
+struct EngSeriesIdHash
+{
+    size_t operator()(const EngSeriesId& id) const
+    {
+        uint64_t lo;
+        uint32_t hi;
+        memcpy(&lo, &id, sizeof(lo));
+        memcpy(&hi, (const char*)&id + sizeof(lo), sizeof(hi));
+        // Finished so the low bits ShardOf and the tables use depend on
+        // every field, series often differ only in their high bytes
+        uint64_t h = lo * 0x9E3779B97F4A7C15ull ^ hi * 0xC2B2AE3D27D4EB4Full;
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        return (size_t)(h ^ (h >> 33));
+    }
+};
+
+inline bool operator==(const EngSeriesId& lhs, const EngSeriesId& rhs)
+{
+    return memcmp(&lhs, &rhs, sizeof(EngSeriesId)) == 0;
+}
+
+inline EngSeriesId EmptyEngSeriesId()
+{
+    EngSeriesId id;
+    memset(&id, 0xFF, sizeof(id));
+    return id;
+}
+
 struct IEngineClient
 {
     virtual ~IEngineClient(){}
     virtual void Handle(const BookClearInd&& ind) = 0;
+    virtual void Handle(const BookInsertInd&& ind) = 0;
+    virtual void Handle(const BookDeleteInd&& ind) = 0;
+    virtual void Handle(const BookAmendInd&& ind) = 0;
+    virtual void Handle(const BookTradeInd&& ind) = 0;
+    virtual void Handle(const BookSweepInd&& ind) = 0;
+    virtual void Handle(const BookFillInd&& ind) = 0;
+    virtual void Handle(const BookDepthInd&& ind) = 0;
+    virtual void Handle(const BookErrorInd&& ind) = 0;
+    virtual void Handle(const EngAvailableBooksInd&& ind) = 0;
+    virtual void Handle(const EngOperationCnf&& cnf) = 0;
+    virtual void Handle(const EngOperationRangeCnf&& cnf) = 0;
+    virtual void Handle(const EngOperationRej&& rej) = 0;
 };
 
-struct Engine : IBookClient
+struct NullEngineClient : IEngineClient
 {
-    Engine() {}
+    void Handle(const BookClearInd&& ind) {}
+    void Handle(const BookInsertInd&& ind) {}
+    void Handle(const BookDeleteInd&& ind) {}
+    void Handle(const BookAmendInd&& ind) {}
+    void Handle(const BookTradeInd&& ind) {}
+    void Handle(const BookSweepInd&& ind) {}
+    void Handle(const BookFillInd&& ind) {}
+    void Handle(const BookDepthInd&& ind) {}
+    void Handle(const BookErrorInd&& ind) {}
+    void Handle(const EngAvailableBooksInd&& ind) {}
+    void Handle(const EngOperationCnf&& cnf) {}
+    void Handle(const EngOperationRangeCnf&& cnf) {}
+    void Handle(const EngOperationRej&& rej) {}
+};
+
+// Calls f(op, body, bodySize) for each operation of a batch once all of it
+// has been checked: lengths adding up to the datagram and every operation
+// carrying the batch's gateway, the next sequence and being WellFormed, so
+// never a batch itself. Returns the number of operations or 0 when
+// malformed, in which case f was never called.
+template<typename F>
+inline size_t ForEachBatchOp(const EngOperationReq& batch, const char* msg, size_t size, F&& f)
+{
+    const auto* batchBody = DecodeBody<EngBatchReq, ENG_BATCH_BODY_SIZE>(msg, size);
+    if(UNLIKELY(!batchBody || !batchBody->mCount)) return 0;
+    const auto& body = *batchBody;
+    size_t count = body.mCount;
+    size_t offset = ENG_BATCH_BODY_SIZE + TailSize(body);
+
+    size_t end = offset;
+    for(size_t i = 0; i < count; ++i)
+    {
+        uint16_t length;
+        memcpy(&length, &body.mLengths[i], sizeof(length));
+        if(UNLIKELY(length < sizeof(EngOperationReq) || end + length > size)) return 0;
+        const auto& op = *reinterpret_cast<const EngOperationReq*>(msg + end);
+        if(UNLIKELY(op.mOperationId.mGatewayId != batch.mOperationId.mGatewayId ||
+            op.mOperationId.mSequence != (uint16_t)(batch.mOperationId.mSequence + i) ||
+            !WellFormed(op, msg + end + sizeof(op), length - sizeof(op)))) return 0;
+        end += length;
+    }
+    if(UNLIKELY(end != size)) return 0;
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        uint16_t length;
+        memcpy(&length, &body.mLengths[i], sizeof(length));
+        const auto& op = *reinterpret_cast<const EngOperationReq*>(msg + offset);
+        f(op, msg + offset + sizeof(op), length - sizeof(op));
+        offset += length;
+    }
+    return count;
+}
+
+// Number of operations a request carries, 0 when it is malformed
+inline size_t OperationCount(const EngOperationReq& req, const char* msg, size_t size)
+{
+    if(req.mMsgId != EngMsgId::PART_OP_BATCH_REQ) return WellFormed(req, msg, size) ? 1 : 0;
+    return ForEachBatchOp(req, msg, size, [](const EngOperationReq&, const char*, size_t){});
+}
+
+struct Engine;
+typedef BasicBook<Engine> EngineBook;
+
+// Final so the books' indications and cleanup calls bind statically
+struct Engine final : IBookClient
+{
+    Engine(IEngineClient& client)
+    : mClient(&client)
+    , mBookIdUsed(std::numeric_limits<uint16_t>::max() + 1, false)
+    {
+        mSeriesBookLookup.set_empty_key(EmptyEngSeriesId());
+    }
     
     void Init(size_t initLevelAlloc, size_t initOrderAlloc, size_t initClientAlloc)
     {
         assert(mBookMem.mOrderPool.empty() && "Can only init allocate once");
-        mBookMem.mOrderLookup.resize(initOrderAlloc);
-        mBookMem.mClientOrderLookup.resize(initClientAlloc);
-        mBookMem.mOrderExtraInfoPool.reserve(initOrderAlloc);
-        mBookMem.mOrderFreeList.reserve(initOrderAlloc);
+        mBookMem.mClientOrders.set_empty_key(std::numeric_limits<uint32_t>::max());
+        mBookMem.mClientOrders.resize(initClientAlloc);
         mBookMem.mDroppedLevels.reserve(initLevelAlloc);
+        mBookMem.Grow(initOrderAlloc);
+        if(!mBookMem.Lock()) fprintf(stderr, "Failed to lock order pools in memory\n");
+    }
 
-        for(size_t i = 0; i < initOrderAlloc; ++i) mOrderFreeList.push_back(i);
+    // Back to an initialised engine with no books
+    void Reset()
+    {
+        mBooks.clear();
+        mBookSeries.clear();
+        mBookIdUsed.assign(mBookIdUsed.size(), false);
+        mSeriesBookLookup.clear();
+        mDepthBooks.clear();
+        mDepthQueued.clear();
+        mBookVersions.clear();
+        mBookUpdates = 0;
+        mLastOpId = 0;
+        mBookMem.Reset();
     }
 
     void HandleMsg(const char* buf, size_t size)
     {
-        const auto* msgId  = static_cast<const EngMsgId*>(buf+0);
-        const auto* series = static_cast<const EngSeriesId*>((const char*)msgId+sizeof(*msgId));
-        const auto* opId   = static_cast<OperationId*>((const char*)series+sizeof(*series));
+        if(UNLIKELY(size < sizeof(EngOperationReq))) return;
+        const auto& req = *reinterpret_cast<const EngOperationReq*>(buf);
+
+        if(req.mOperationId.mSequence > mLastOpId+1) return;
+        if(req.mOperationId.mSequence <= mLastOpId) return;
 
-        if(size < (sizeof(*msgId) + sizeof(*series) + sizeof(*opId))) return;
-        HandleMsg(*msgId, *series, *opId, opId + sizeof(*opId));
+        Process(req, buf+sizeof(req), size-sizeof(req));
     }
 
-    void HandleMsg(const EngOperationReq& req, void* msg)
+    // Already sequenced operation or batch of them
+    void Process(const EngOperationReq& req, const char* msg, size_t size)
     {
-        if(req.mOperationId.mSequence > mLastOpId+1) return;
-        if(req.mOperationId.mSequence <= mLastOpId) return;
+        if(req.mMsgId == EngMsgId::PART_OP_BATCH_REQ)
+        {
+            ProcessBatch(req, msg, size);
+            return;
+        }
+        if(UNLIKELY(!WellFormed(req, msg, size)))
+        {
+            Reject(req.mOperationId);
+            return;
+        }
+        Apply(req, msg, size);
+        Confirm(req.mOperationId);
+    }
 
-        auto* books = LookupBook(series);
+    // Applied as a unit, a malformed batch is rejected whole. Each operation
+    // is journaled on its own so recovery replays them like any other, and
+    // the gateway gets one confirmation for the lot.
+    void ProcessBatch(const EngOperationReq& batch, const char* msg, size_t size)
+    {
+        size_t count = ForEachBatchOp(batch, msg, size, [this](const EngOperationReq& op, const char* body, size_t bodySize)
+        {
+            Apply(op, body, bodySize);
+        });
+        if(LIKELY(count)) Confirm(batch.mOperationId, count);
+        else Reject(batch.mOperationId);
+    }
 
-        // TODO check sizes here for types
-#define HandleBookReq(__ID, __TYPE_REQ)  \
-        case __ID: \
-        { \
-            const auto* req = static_cast<const Book # __TYPE_REQ*>(req.mMsg); \
-            for(auto* book : books) book-> __TYPE_REQ(*req); \
+    // Journaled before it is dispatched, unconfirmed. Only well formed
+    // operations get here.
+    inline void Apply(const EngOperationReq& req, const char* msg, size_t size)
+    {
+        if(mJournal) mJournal->Append((const char*)&req, sizeof(req), msg, size);
+        mLastOpId = req.mOperationId.mSequence;
+        RH_LATENCY(mLatency.Dispatch((uint8_t)req.mMsgId));
+        Dispatch(req, msg, size);
+        RH_LATENCY(mLatency.MatchEnd());
+    }
+
+    inline void Confirm(const OperationId& opId, size_t count=1)
+    {
+        if(LIKELY(count == 1)) mClient->Handle(EngOperationCnf{EngMsgId::PART_OP_CNF, opId});
+        else mClient->Handle(EngOperationRangeCnf{EngMsgId::PART_OP_RANGE_CNF, opId, (uint16_t)count});
+    }
+
+    // Neither journaled nor applied, the gateway resends under the same sequence
+    inline void Reject(const OperationId& opId)
+    {
+        ++mMalformed;
+        mClient->Handle(EngOperationRej{EngMsgId::PART_OP_REJ, opId});
+    }
+
+    // Called by the owner of the receive loop at the end of each batch
+    inline void EndBatch()
+    {
+        if(mJournal) mJournal->EndBatch();
+        PublishDepth();
+    }
+
+    // Remembers the book if its depth changed, once per batch
+    inline void QueueDepth(size_t idx)
+    {
+        if(mDepthQueued[idx] || !mBooks[idx].DepthPending()) return;
+        mDepthQueued[idx] = true;
+        mDepthBooks.push_back(idx);
+    }
+
+    // Conflated depth of the books changed during the batch
+    void PublishDepth()
+    {
+        for(size_t idx : mDepthBooks)
+        {
+            mBooks[idx].PublishDepth();
+            mDepthQueued[idx] = false;
         }
+        mDepthBooks.clear();
+    }
+
+    // Rebuilds the books from the journal, from the given position when
+    // they were restored from a snapshot, then journals everything after.
+    // Replayed operations produce no indications.
+    size_t Recover(Journal& journal, JournalPosition from=JournalPosition())
+    {
+        NullEngineClient nullClient;
+        IEngineClient* client = mClient;
+        mClient = &nullClient;
+        mJournal = nullptr;
+        size_t records = journal.Open([this](const char* buf, size_t size){ HandleMsg(buf, size); }, from);
+        mClient = client;
+        mJournal = &journal;
+        return records;
+    }
+
+    const std::vector<size_t>* LookupBook(const EngSeriesId& series) const
+    {
+        auto itr = mSeriesBookLookup.find(series);
+        return itr == mSeriesBookLookup.end() ? nullptr : &itr->second;
+    }
+
+    void Dispatch(const EngOperationReq& req, const char* msg, size_t size)
+    {
+        if(req.mMsgId == EngMsgId::PART_BOOK_CREATE_REQ)
+        {
+            CreateBook(*reinterpret_cast<const EngCreateBookReq*>(&req));
+            return;
+        }
+
+        const auto* books = LookupBook(req.mSeries);
+        if(!books) return;
 
         if
         (
-            books.size() > 1 && 
-            ((id != PART_BOOK_OP_BULK_DEL_REQ) ||
-            (id != PART_BOOK_OP_BULK_DEL_REQ))
+            books->size() > 1 && 
+            (req.mMsgId != EngMsgId::PART_BOOK_OP_BULK_DEL_REQ)
         )
         {
             return;
         }
 
+#define HandleBookReq(__ID, __TYPE_REQ, __SIZE)  \
+        case EngMsgId::__ID: \
+        { \
+            const auto& bookReq = *reinterpret_cast<const Book##__TYPE_REQ*>(msg); \
+            for(auto idx : *books) \
+            { \
+                RH_LATENCY(uint64_t start = Tsc()); \
+                mBooks[idx].__TYPE_REQ(bookReq); \
+                QueueDepth(idx); \
+                mBookVersions[idx] = ++mBookUpdates; \
+                RH_LATENCY(mLatency.BookReq((uint8_t)req.mMsgId, start)); \
+            } \
+        } \
+        break;
+
         switch(req.mMsgId)
         {
             default: return;
 
-            case PART_BOOK_CREATE_REQ:
-            {
-                size_t newBook = mBooks.size();
-                const auto* req = static_cast<const *EngCreateBookReq>((char*)opId+sizeof(*opId));
-                mBooks.emplace_back(
-                    Book{req->mBookBehaviours, req->mBookId, 0, mBookMem, *this});
-                if(mSeriesBookLookup.find(req->mSeries) != mSeriesBookLookup.end())
-                {
-                    //todo error
-                    return;
-                }
-                mSeriesBookLookup[req->mSeries] = newBook;
-                mSeriesBookLookup[MaskEngSeriesIdByInstrType(req->mSeries)].push_back(newBook);
-                mSeriesBookLookup[MaskEngSeriesIdByInstrClass(req->mSeries)].push_back(newBook);
-                mSeriesBookLookup[MaskEngSeriesIdByUnderlying(req->mSeries)].push_back(newBook);
-                Handle(EngAvailableBooksInd{PART_BOOK_AVAIL_IND, req->mSeries, req->mBookBehaviours, 0});
-            }
-            break;
-
-            HandleBookReq(PART_BOOK_OP_CLEAR_REQ,    ClearReq);
-            HandleBookReq(PART_BOOK_OP_INSERT_REQ,   InsertReq);
-            HandleBookReq(PART_BOOK_OP_QUOTE_REQ,    QuoteReq);
-            HandleBookReq(PART_BOOK_OP_DEL_REQ,      DeleteReq);
-            HandleBookReq(PART_BOOK_OP_BULK_DEL_REQ, BulkDeleteReq);
-            HandleBookReq(PART_BOOK_OP_AMEND_REQ,    AmendReq);
+            RH_BOOK_REQUESTS(HandleBookReq)
         }
-        mLastOpId = req.mOperationId.mSequence;
-        Handle(EngOperationCnf{PART_OP_CNF, req.mOperationId});
+#undef HandleBookReq
     }
 
-    void ImmediateCleanup()
+    // Book ids key the client order lists in the shared pools, two books
+    // under one id would walk and unlink each other's orders
+    EngineBook* CreateBook(const EngCreateBookReq& req)
     {
-        for(auto leadingLoc : mBookMem.mDroppedLevels)
+        if(mSeriesBookLookup.find(req.mSeries) != mSeriesBookLookup.end() || mBookIdUsed[req.mBookId])
         {
-            size_t nextLoc = leadingLoc->mLead;
-            do
-            {
-                mOrderFreeList.push_back(nextLoc);
-                size_t nextNextLoc = mMem.mOrderPool[nextLoc].mNext;
-                mMem.mOrderPool[nextLoc] = Order();
-                nextOrder = nextNextLoc;
-            }
-            while(nextLoc);
+            //todo error
+            return nullptr;
         }
 
-        if(mOrderFreeList.empty())
-        {
-            size_t origSize = mMem.mOrderPool.size();
-            mMem.mOrderPool.resize(2*mMem.mOrderPool.size());
-            for(size_t i = origSize; i < 2*origSize; ++i) mOrderFreeList.push_back(i);
-        }
+        // The create request carries no tick size, ladder books tick by 1
+        size_t newBook = mBooks.size();
+        mBooks.emplace_back(req.mBookBehaviours, req.mBookId, 0, mBookMem, *this);
+        mDepthQueued.push_back(false);
+        mBookVersions.push_back(0);
+        mBookSeries.push_back(req.mSeries);
+        mBookIdUsed[req.mBookId] = true;
+        mSeriesBookLookup[req.mSeries].push_back(newBook);
+        mSeriesBookLookup[MaskEngSeriesIdByInstrType(req.mSeries)].push_back(newBook);
+        mSeriesBookLookup[MaskEngSeriesIdByInstrClass(req.mSeries)].push_back(newBook);
+        mSeriesBookLookup[MaskEngSeriesIdByUnderlying(req.mSeries)].push_back(newBook);
+        mClient->Handle(EngAvailableBooksInd{EngMsgId::PART_BOOK_AVAIL_IND, req.mSeries, req.mBookId, 
+            req.mBookBehaviours, 0});
+        return &mBooks.back();
     }
 
-    SharedBookMem mBookMem;
-    std::vector<Book> mBooks;
-    google::dense_hash_map<EngSeriesId, size_t> mSeriesBookLookup;
+    void Handle(const BookClearInd&& ind)  { mClient->Handle(std::move(ind)); }
+    void Handle(const BookInsertInd&& ind) { mClient->Handle(std::move(ind)); }
+    void Handle(const BookDeleteInd&& ind) { mClient->Handle(std::move(ind)); }
+    void Handle(const BookAmendInd&& ind)  { mClient->Handle(std::move(ind)); }
+    void Handle(const BookTradeInd&& ind)  { mClient->Handle(std::move(ind)); }
+    void Handle(const BookSweepInd&& ind)  { mClient->Handle(std::move(ind)); }
+    void Handle(const BookFillInd&& ind)   { mClient->Handle(std::move(ind)); }
+    void Handle(const BookDepthInd&& ind)  { mClient->Handle(std::move(ind)); }
+    void Handle(const BookErrorInd&& ind)  { mClient->Handle(std::move(ind)); }
+
+    // Only reached when Idle has not kept up, frees everything dropped at
+    // once. Growing is left to Idle beyond the one step the insert needs.
+    void ImmediateCleanup()
+    {
+        ++mImmediateCleanups;
+        mBookMem.FreeDroppedLevels();
+        if(mBookMem.mOrderFreeList.empty()) mBookMem.GrowStep();
+    }
+
+    // Called whenever no requests are waiting. Frees up to budget slots of
+    // dropped levels and, once there are none left, grows the pools a step
+    // at a time while the free list is under its low water mark so inserts
+    // never have to clean up. Returns true while there is still work queued.
+    bool Idle(size_t budget=RECLAIM_BUDGET)
+    {
+        mReclaimed += mBookMem.FreeDroppedLevels(budget);
+        if(!mBookMem.mDroppedLevels.empty()) return true;
+        if(!BelowLowWater()) return false;
+        mBookMem.GrowStep();
+        return BelowLowWater();
+    }
 
+    inline bool BelowLowWater() const
+    {
+        return mBookMem.mOrderFreeList.size() * FREE_LOW_WATER_DIVISOR < mBookMem.mOrderPool.size();
+    }
+
+    IEngineClient* mClient;
+    Journal* mJournal = nullptr;
+    SharedBookMem mBookMem;
+    std::vector<EngineBook> mBooks;
+    std::vector<EngSeriesId> mBookSeries; // by book index
+    std::vector<bool> mBookIdUsed;        // by book id
+    google::dense_hash_map<EngSeriesId, std::vector<size_t>, EngSeriesIdHash> mSeriesBookLookup;
+    std::vector<size_t> mDepthBooks;  // with depth to publish at the end of the batch
+    std::vector<bool> mDepthQueued;   // by book index
+    std::vector<uint64_t> mBookVersions; // by book index, mBookUpdates when last changed
+    uint64_t mBookUpdates = 0;    // requests applied to books
+    uint16_t mLastOpId = 0;
+    uint64_t mReclaimed = 0;
+    uint64_t mImmediateCleanups = 0;
+    uint64_t mMalformed = 0;      // requests and batches rejected as malformed
+    RH_LATENCY(LatencyRecorder mLatency;)
 };
 
 }
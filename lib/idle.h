@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "latency.h"
+#include "thread.h"
+
+namespace redheads
+{
+
+enum class IdleMode : uint8_t
+{
+    SPIN,       // poll again straight away, lowest wakeup latency, burns the core
+    SPIN_YIELD, // spin for a while then yield the core between polls
+    BLOCK       // wait in epoll for the socket to become readable
+};
+
+struct IdleConfig
+{
+    IdleMode mMode = IdleMode::SPIN;
+    uint32_t mSpinPolls = 10000;  // empty polls before yielding
+    int mBlockTimeoutMs = 100;    // so timers and signals are still seen
+    int mBusyPollUs = 0;          // SO_BUSY_POLL on the receive socket, 0 leaves it off
+    int mCore = NO_CORE;          // of the thread running the loop
+    int mRtPriority = 0;          // SCHED_FIFO priority of that thread, 0 keeps the default
+};
+
+// Kernel busy polling of the device queue on blocking and polling reads
+inline bool SetBusyPoll(int fd, int usecs)
+{
+    if(usecs <= 0) return true;
+    return setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == 0;
+}
+
+// What the receive loop does between empty polls. Each time data turns up
+// after the loop went idle the time from the kernel receiving the first
+// datagram to the loop picking it up is recorded, so modes can be compared
+// on the same traffic.
+struct IdleStrategy
+{
+    IdleStrategy(const IdleConfig& config, int epollFd)
+    : mConfig(config)
+    , mEpollFd(epollFd)
+    {
+    }
+
+    // The last poll found nothing and there is no other work
+    inline void Idle()
+    {
+        mIdle = true;
+        switch(mConfig.mMode)
+        {
+            case IdleMode::SPIN:
+                CpuRelax();
+                break;
+            case IdleMode::SPIN_YIELD:
+                if(++mEmptyPolls < mConfig.mSpinPolls)
+                {
+                    CpuRelax();
+                    break;
+                }
+                ++mYields;
+                sched_yield();
+                break;
+            case IdleMode::BLOCK:
+            {
+                epoll_event event;
+                ++mBlocks;
+                if(epoll_wait(mEpollFd, &event, 1, mConfig.mBlockTimeoutMs) < 0 && errno != EINTR)
+                {
+                    ++mWaitErrors;
+                }
+                break;
+            }
+        }
+    }
+
+    // The last poll received datagrams, ingest is a UdpIngest or UringIngest
+    template<typename I>
+    inline void Work(const I& ingest)
+    {
+        if(!mIdle) return;
+        mIdle = false;
+        mEmptyPolls = 0;
+        ++mWakeups;
+        if(ingest.mFirstRxNs && ingest.mPollNs > ingest.mFirstRxNs)
+        {
+            mWakeupNs.Record(ingest.mPollNs - ingest.mFirstRxNs);
+        }
+    }
+
+    void Dump(FILE* out) const
+    {
+        static const char* modes[] = {"spin", "yield", "block"};
+        fprintf(out, "idle %s wakeups %lu yields %lu blocks %lu wait errors %lu\n", modes[(int)mConfig.mMode],
+            mWakeups, mYields, mBlocks, mWaitErrors);
+        fprintf(out, "wakeup ns count %lu p50 %lu p99 %lu p99.9 %lu max %lu\n", mWakeupNs.mCount,
+            mWakeupNs.Percentile(0.5), mWakeupNs.Percentile(0.99), mWakeupNs.Percentile(0.999), mWakeupNs.mMax);
+    }
+
+    const IdleConfig mConfig;
+    int mEpollFd;
+    bool mIdle = true;
+    uint32_t mEmptyPolls = 0;
+    uint64_t mWakeups = 0;
+    uint64_t mYields = 0;
+    uint64_t mBlocks = 0;
+    uint64_t mWaitErrors = 0;
+    LatencyHistogram mWakeupNs; // kernel receive to picked up, after idling
+};
+
+}
@@ -0,0 +1,421 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace redheads
+{
+
+enum class JournalFlush : uint8_t
+{
+    PER_MESSAGE, // msync each record before it is processed
+    PER_BATCH,   // msync once per processing batch
+    ASYNC,       // fdatasync from a background thread every mAsyncIntervalUs
+};
+
+struct JournalConfig
+{
+    std::string  mDir;
+    size_t       mSegmentSize = 256 << 20;
+    JournalFlush mFlush = JournalFlush::PER_BATCH;
+    uint32_t     mAsyncIntervalUs = 1000;
+    uint32_t     mPrepareIntervalUs = 1000; // how often the preparer looks for a segment to map or unmap
+    size_t       mMaxSegments = 4096;
+};
+
+#pragma pack(push, 1)
+
+struct JournalRecordHeader
+{
+    uint32_t mLength;   // 0 past the last record, END_OF_SEGMENT when rolled
+    uint32_t mChecksum; // of the record body, catches torn tails
+};
+
+#pragma pack(pop)
+
+constexpr uint32_t END_OF_SEGMENT = UINT32_MAX;
+
+// Where the next record will be appended
+struct JournalPosition
+{
+    uint64_t mSegment = 0;
+    uint64_t mOffset = 0;
+};
+
+inline uint32_t JournalChecksum(const char* buf, size_t size, uint64_t seed=0x9E3779B97F4A7C15ull)
+{
+    uint64_t h = seed ^ size;
+    size_t i = 0;
+    for(; i + 8 <= size; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, buf + i, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+    }
+    for(; i < size; ++i) h = (h ^ (uint8_t)buf[i]) * 0xC4CEB9FE1A85EC53ull;
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+// Append only write ahead log of accepted operations in fixed size,
+// preallocated and pre-faulted mmap'd segments named journal.N. Appending is
+// two memcpys into the mapping, syncing is done as set by JournalFlush. A
+// preparer thread creates and maps the next segment ahead of time and
+// unmaps rolled ones, so rolling over is taking the segment it handed over.
+struct Journal
+{
+    struct Segment
+    {
+        int mFd = -1;
+        char* mBase = nullptr;
+    };
+
+    Journal(const JournalConfig& config)
+    : mConfig(config)
+    , mPageSize(sysconf(_SC_PAGESIZE))
+    {
+        // Fixed capacity, the async thread reads descriptors as they are added
+        mSegments.reserve(mConfig.mMaxSegments);
+        mFds.reset(new std::atomic<int>[mConfig.mMaxSegments]);
+    }
+
+    ~Journal()
+    {
+        mSyncRunning.store(false, std::memory_order_release);
+        if(mSyncThread.joinable()) mSyncThread.join();
+        mPrepareRunning.store(false, std::memory_order_release);
+        if(mPrepareThread.joinable()) mPrepareThread.join();
+
+        SyncRolled();
+        if(mCurrent != SIZE_MAX) SyncRange(mSegments[mCurrent], mSynced, mOffset);
+        if(char* retired = mRetired.load(std::memory_order_acquire)) munmap(retired, mConfig.mSegmentSize);
+        if(mNextReady.load(std::memory_order_acquire))
+        {
+            munmap(mNext.mBase, mConfig.mSegmentSize);
+            close(mNext.mFd);
+        }
+        for(auto& segment : mSegments)
+        {
+            if(segment.mBase) munmap(segment.mBase, mConfig.mSegmentSize);
+            if(segment.mFd >= 0) close(segment.mFd);
+        }
+    }
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    std::string SegmentPath(size_t index) const
+    {
+        return mConfig.mDir + "/journal." + std::to_string(index);
+    }
+
+    inline JournalPosition Position() const
+    {
+        return JournalPosition{mCurrent, mOffset};
+    }
+
+    // Replays every intact record from the given position through 
+    // handler(buf, size) in the order written and positions the journal to
+    // append after the last one
+    template<typename H>
+    size_t Open(H&& handler, JournalPosition from=JournalPosition())
+    {
+        size_t segments = CountSegments();
+        size_t records = 0;
+        size_t last = 0;
+        size_t lastOffset = 0;
+        for(size_t index = 0; index < segments; ++index)
+        {
+            MapSegment(index);
+            const char* base = mSegments[index].mBase;
+
+            size_t offset = index == from.mSegment ? from.mOffset : 0;
+            bool replay = index >= from.mSegment;
+            while(replay && offset + sizeof(JournalRecordHeader) <= mConfig.mSegmentSize)
+            {
+                JournalRecordHeader header;
+                memcpy(&header, base + offset, sizeof(header));
+                if(header.mLength == 0 || header.mLength == END_OF_SEGMENT) break;
+
+                const char* body = base + offset + sizeof(header);
+                if(offset + sizeof(header) + header.mLength > mConfig.mSegmentSize ||
+                   JournalChecksum(body, header.mLength) != header.mChecksum)
+                {
+                    fprintf(stderr, "Journal %s truncated at %zu\n", SegmentPath(index).c_str(), offset);
+                    break;
+                }
+
+                handler(body, (size_t)header.mLength);
+                ++records;
+                offset += sizeof(header) + header.mLength;
+            }
+
+            if(offset)
+            {
+                last = index;
+                lastOffset = offset;
+            }
+        }
+
+        // Appends resume in the last segment written, any after it are
+        // empty segments mapped ahead by an earlier run
+        if(segments == 0) MapSegment(0);
+        for(size_t index = 0; index < last; ++index) Unmap(mSegments[index]);
+        mCurrent = last;
+        mOffset = lastOffset;
+        mSynced = lastOffset;
+
+        mPrepareIndex = mSegments.size();
+        mPrepareRunning.store(true, std::memory_order_release);
+        mPrepareThread = std::thread([this]{ RunPrepare(); });
+
+        if(mConfig.mFlush == JournalFlush::ASYNC)
+        {
+            mSyncRunning.store(true, std::memory_order_release);
+            mSyncThread = std::thread([this]{ RunAsyncSync(); });
+        }
+        return records;
+    }
+
+    // Header and payload of one operation, made durable per the flush policy
+    inline void Append(const char* header, size_t headerSize, const char* payload, size_t payloadSize)
+    {
+        size_t length = headerSize + payloadSize;
+        size_t recordSize = sizeof(JournalRecordHeader) + length;
+        if(mOffset + recordSize + sizeof(JournalRecordHeader) > mConfig.mSegmentSize) Roll();
+
+        char* out = mSegments[mCurrent].mBase + mOffset;
+        char* body = out + sizeof(JournalRecordHeader);
+        memcpy(body, header, headerSize);
+        memcpy(body + headerSize, payload, payloadSize);
+
+        // Length goes in last so a reader never sees a half written record
+        JournalRecordHeader recordHeader{(uint32_t)length, JournalChecksum(body, length)};
+        memcpy(out + sizeof(uint32_t), &recordHeader.mChecksum, sizeof(uint32_t));
+        std::atomic_signal_fence(std::memory_order_release);
+        memcpy(out, &recordHeader.mLength, sizeof(uint32_t));
+
+        mOffset += recordSize;
+        ++mRecords;
+
+        if(mConfig.mFlush == JournalFlush::PER_MESSAGE) Sync();
+    }
+
+    // Called once per processing batch, off the per message path
+    inline void EndBatch()
+    {
+        if(mConfig.mFlush != JournalFlush::PER_BATCH) return;
+        SyncRolled();
+        Sync();
+    }
+
+    inline void Sync()
+    {
+        if(mOffset == mSynced) return;
+        SyncRange(mSegments[mCurrent], mSynced, mOffset);
+        mSynced = mOffset;
+    }
+
+    void SyncRange(const Segment& segment, size_t from, size_t to)
+    {
+        if(!segment.mBase || from >= to) return;
+        size_t start = from & ~(mPageSize - 1);
+        if(msync(segment.mBase + start, to - start, MS_SYNC) != 0) ++mSyncErrors;
+    }
+
+    // Moves appends to the next segment, mapped ahead by the preparer. The
+    // rolled one is synced with the batch when flushing per batch, and
+    // unmapped by the preparer.
+    void Roll()
+    {
+        TakeNext();
+
+        SyncRolled();
+        Segment& segment = mSegments[mCurrent];
+        JournalRecordHeader marker{END_OF_SEGMENT, 0};
+        memcpy(segment.mBase + mOffset, &marker, sizeof(marker));
+        mOffset += sizeof(marker);
+        mRolled = segment;
+        mRolledSynced = mSynced;
+        mRolledEnd = mOffset;
+        segment.mBase = nullptr;
+        if(mConfig.mFlush != JournalFlush::PER_BATCH) RetireRolled();
+
+        ++mCurrent;
+        mOffset = 0;
+        mSynced = 0;
+    }
+
+    // Only waits when appends outran the preparer by a whole segment
+    void TakeNext()
+    {
+        if(mCurrent + 1 < mSegments.size()) return;
+        while(!mNextReady.load(std::memory_order_acquire))
+        {
+            if(mPrepareFailed.load(std::memory_order_acquire))
+            {
+                throw std::runtime_error("Journal cannot prepare " + SegmentPath(mSegments.size()));
+            }
+            ++mPrepareWaits;
+            std::this_thread::yield();
+        }
+        AddSegment(mSegments.size(), mNext);
+        mNextReady.store(false, std::memory_order_release);
+    }
+
+    // Records of the rolled segment written since the last sync are part
+    // of the batch being synced
+    void SyncRolled()
+    {
+        if(!mRolled.mBase) return;
+        SyncRange(mRolled, mRolledSynced, mRolledEnd);
+        RetireRolled();
+    }
+
+    // The preparer unmaps it, in the rare case it has not taken the last
+    // one yet it is unmapped here
+    void RetireRolled()
+    {
+        char* empty = nullptr;
+        if(!mRetired.compare_exchange_strong(empty, mRolled.mBase, std::memory_order_release))
+        {
+            munmap(mRolled.mBase, mConfig.mSegmentSize);
+        }
+        mRolled.mBase = nullptr;
+    }
+
+    void RunPrepare()
+    {
+        while(mPrepareRunning.load(std::memory_order_acquire))
+        {
+            if(char* retired = mRetired.exchange(nullptr, std::memory_order_acquire))
+            {
+                munmap(retired, mConfig.mSegmentSize);
+            }
+            if(!mNextReady.load(std::memory_order_acquire) && !mPrepareFailed.load(std::memory_order_relaxed))
+            {
+                try
+                {
+                    mNext = CreateSegment(mPrepareIndex++);
+                    mNextReady.store(true, std::memory_order_release);
+                }
+                catch(const std::exception& e)
+                {
+                    fprintf(stderr, "%s\n", e.what());
+                    mPrepareFailed.store(true, std::memory_order_release);
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(mConfig.mPrepareIntervalUs));
+        }
+    }
+
+    size_t CountSegments() const
+    {
+        size_t count = 0;
+        struct stat st;
+        while(stat(SegmentPath(count).c_str(), &st) == 0) ++count;
+        return count;
+    }
+
+    void MapSegment(size_t index)
+    {
+        AddSegment(index, CreateSegment(index));
+    }
+
+    Segment CreateSegment(size_t index) const
+    {
+        if(index >= mConfig.mMaxSegments) throw std::runtime_error("Journal out of segments");
+        std::string path = SegmentPath(index);
+        int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if(fd < 0) throw std::runtime_error("Journal cannot open " + path);
+        if(posix_fallocate(fd, 0, mConfig.mSegmentSize) != 0 && ftruncate(fd, mConfig.mSegmentSize) != 0)
+        {
+            close(fd);
+            throw std::runtime_error("Journal cannot allocate " + path);
+        }
+
+        // Pre-faulted so appends never take a page fault
+        void* base = mmap(nullptr, mConfig.mSegmentSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, 0);
+        if(base == MAP_FAILED)
+        {
+            close(fd);
+            throw std::runtime_error("Journal cannot map " + path);
+        }
+
+        return Segment{fd, static_cast<char*>(base)};
+    }
+
+    void AddSegment(size_t index, const Segment& segment)
+    {
+        mSegments.push_back(segment);
+        mFds[index].store(segment.mFd, std::memory_order_relaxed);
+        mSegmentCount.store(mSegments.size(), std::memory_order_release);
+    }
+
+    void Unmap(Segment& segment)
+    {
+        munmap(segment.mBase, mConfig.mSegmentSize);
+        segment.mBase = nullptr;
+    }
+
+    void RunAsyncSync()
+    {
+        size_t synced = mCurrent;
+        while(mSyncRunning.load(std::memory_order_acquire))
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(mConfig.mAsyncIntervalUs));
+            size_t count = mSegmentCount.load(std::memory_order_acquire);
+            for(size_t i = synced; i < count; ++i)
+            {
+                if(fdatasync(mFds[i].load(std::memory_order_relaxed)) != 0) ++mSyncErrors;
+            }
+            // The newest one is still being appended to
+            synced = count ? count - 1 : 0;
+        }
+    }
+
+    const JournalConfig mConfig;
+    const size_t mPageSize;
+    std::vector<Segment> mSegments;
+    std::unique_ptr<std::atomic<int>[]> mFds;
+    std::atomic<size_t> mSegmentCount{0};
+    size_t mCurrent = SIZE_MAX;
+    size_t mOffset = 0;
+    size_t mSynced = 0;
+    uint64_t mRecords = 0;
+    uint64_t mPrepareWaits = 0;   // yields waiting on the preparer at a roll
+    std::atomic<uint64_t> mSyncErrors{0};
+
+    // The rolled segment until its tail is synced and it is handed to the
+    // preparer to unmap
+    Segment mRolled;
+    size_t mRolledSynced = 0;
+    size_t mRolledEnd = 0;
+
+    // Written by the preparer while mNextReady is false, taken by a roll
+    Segment mNext;
+    std::atomic<bool> mNextReady{false};
+    std::atomic<char*> mRetired{nullptr};
+    std::atomic<bool> mPrepareFailed{false};
+    size_t mPrepareIndex = 0;     // preparer only once started
+    std::atomic<bool> mPrepareRunning{false};
+    std::thread mPrepareThread;
+
+    std::atomic<bool> mSyncRunning{false};
+    std::thread mSyncThread;
+};
+
+}
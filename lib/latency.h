@@ -0,0 +1,216 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Latency instrumentation only exists when built with REDHEADS_LATENCY,
+// otherwise everything wrapped in RH_LATENCY() compiles away
+#ifdef REDHEADS_LATENCY
+#define RH_LATENCY(...) __VA_ARGS__
+#else
+#define RH_LATENCY(...)
+#endif
+
+namespace redheads
+{
+
+// The cycle counter, or elsewhere the monotonic clock in nanoseconds.
+// Only ever differenced and scaled by TscPerNs.
+inline uint64_t Tsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+// TSC ticks per nanosecond, measured once against the steady clock
+inline double TscPerNs()
+{
+    static const double ticksPerNs = []
+    {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t tscStart = Tsc();
+        while(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(10));
+        uint64_t tscEnd = Tsc();
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        return (tscEnd - tscStart) / ns;
+    }();
+    return ticksPerNs;
+}
+
+// Log-linear histogram in the style of HdrHistogram. Values below
+// 2^SUB_BITS are exact, above that each power of two is split into
+// 2^SUB_BITS buckets, so any value is within about 3% of its bucket.
+struct LatencyHistogram
+{
+    static constexpr unsigned SUB_BITS = 5;
+    static constexpr size_t SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    static inline size_t Bucket(uint64_t value)
+    {
+        if(value < SUB_BUCKETS) return value;
+        unsigned exponent = 63 - __builtin_clzll(value);
+        unsigned shift = exponent - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    // Lowest value falling in the bucket
+    static inline uint64_t BucketValue(size_t bucket)
+    {
+        if(bucket < SUB_BUCKETS) return bucket;
+        unsigned shift = bucket / SUB_BUCKETS - 1;
+        return (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    }
+
+    inline void Record(uint64_t value)
+    {
+        ++mCounts[Bucket(value)];
+        ++mCount;
+        if(value > mMax) mMax = value;
+    }
+
+    uint64_t Percentile(double p) const
+    {
+        if(!mCount) return 0;
+        uint64_t rank = (uint64_t)(p * mCount);
+        if(rank >= mCount) rank = mCount - 1;
+        uint64_t seen = 0;
+        for(size_t i = 0; i < BUCKETS; ++i)
+        {
+            seen += mCounts[i];
+            if(seen > rank) return BucketValue(i);
+        }
+        return mMax;
+    }
+
+    void Reset()
+    {
+        memset(mCounts, 0, sizeof(mCounts));
+        mCount = 0;
+        mMax = 0;
+    }
+
+    uint64_t mCounts[BUCKETS] = {};
+    uint64_t mCount = 0;
+    uint64_t mMax = 0;
+};
+
+enum LatencyStage : uint8_t
+{
+    LAT_QUEUE,    // receive to dispatch, decode, queueing and journaling
+    LAT_MATCH,    // dispatch to match end
+    LAT_PUBLISH,  // match end to handed to the publisher at batch end
+    LAT_TOTAL,    // receive to publish
+    LAT_BOOK_REQ, // each Book::*Req call, an operation can reach several books
+    LAT_STAGES
+};
+
+// Owned by the thread running the engine. Stamps taken at receive,
+// dispatch and match end are held per operation until the batch is
+// published, then folded into histograms per message id and stage.
+struct LatencyRecorder
+{
+    static constexpr size_t MAX_MSG_IDS = 32; // more than EngMsgId has
+    static constexpr size_t MAX_PENDING = 4096;
+
+    struct Pending
+    {
+        uint8_t  mMsgId;
+        uint64_t mReceive;
+        uint64_t mDispatch;
+        uint64_t mMatchEnd;
+    };
+
+    LatencyRecorder()
+    : mTicksPerNs(TscPerNs())
+    , mHistograms(MAX_MSG_IDS * LAT_STAGES)
+    {
+        mPending.reserve(MAX_PENDING);
+    }
+
+    inline LatencyHistogram& Histogram(uint8_t msgId, LatencyStage stage)
+    {
+        return mHistograms[(msgId % MAX_MSG_IDS) * LAT_STAGES + stage];
+    }
+
+    // Stamp of the datagram carrying the next operation
+    inline void Receive(uint64_t tsc)
+    {
+        mReceive = tsc;
+    }
+
+    inline void Dispatch(uint8_t msgId)
+    {
+        uint64_t now = Tsc();
+        mCurrent = Pending{msgId, mReceive ? mReceive : now, now, 0};
+        mReceive = 0;
+    }
+
+    inline void MatchEnd()
+    {
+        mCurrent.mMatchEnd = Tsc();
+        if(mPending.size() == MAX_PENDING) Publish();
+        mPending.push_back(mCurrent);
+    }
+
+    inline void BookReq(uint8_t msgId, uint64_t start)
+    {
+        Histogram(msgId, LAT_BOOK_REQ).Record(Tsc() - start);
+    }
+
+    // Everything matched since the last call has been handed on
+    void Publish()
+    {
+        uint64_t now = Tsc();
+        for(const auto& op : mPending)
+        {
+            Histogram(op.mMsgId, LAT_QUEUE).Record(op.mDispatch - op.mReceive);
+            Histogram(op.mMsgId, LAT_MATCH).Record(op.mMatchEnd - op.mDispatch);
+            Histogram(op.mMsgId, LAT_PUBLISH).Record(now - op.mMatchEnd);
+            Histogram(op.mMsgId, LAT_TOTAL).Record(now - op.mReceive);
+        }
+        mPending.clear();
+    }
+
+    // Writes p50/p99/p99.9/max in ns of every populated histogram and
+    // starts the next interval
+    void Dump(FILE* out, bool reset=true)
+    {
+        static const char* stages[LAT_STAGES] = {"queue", "match", "publish", "total", "bookreq"};
+        double ticksPerNs = mTicksPerNs;
+        fprintf(out, "%6s %-8s %10s %9s %9s %9s %9s\n", "msg id", "stage", "count", "p50 ns", "p99", "p99.9", "max");
+        for(size_t msgId = 0; msgId < MAX_MSG_IDS; ++msgId)
+        {
+            for(size_t stage = 0; stage < LAT_STAGES; ++stage)
+            {
+                auto& hist = Histogram(msgId, LatencyStage(stage));
+                if(!hist.mCount) continue;
+                fprintf(out, "%6zu %-8s %10lu %9.0f %9.0f %9.0f %9.0f\n", msgId, stages[stage], hist.mCount,
+                    hist.Percentile(0.5) / ticksPerNs, hist.Percentile(0.99) / ticksPerNs,
+                    hist.Percentile(0.999) / ticksPerNs, hist.mMax / ticksPerNs);
+                if(reset) hist.Reset();
+            }
+        }
+        fflush(out);
+    }
+
+    const double mTicksPerNs;
+    std::vector<LatencyHistogram> mHistograms;
+    std::vector<Pending> mPending;
+    Pending mCurrent{};
+    uint64_t mReceive = 0;
+};
+
+}
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include "engine.h"
+#include "publisher.h"
+#include "snapshot.h"
+#include "spsc_ring.h"
+#include "thread.h"
+#include "udp_ingest.h"
+
+namespace redheads
+{
+
+// Sequenced request from the decode stage
+struct alignas(CACHE_LINE_SIZE) ReqSlot
+{
+    RH_LATENCY(uint64_t mReceiveTsc;)
+    uint32_t mSize;
+    char mData[MAX_MSG_SIZE];
+};
+
+enum IndSlotFlags : uint8_t
+{
+    END_OF_BATCH = 1 << 0,
+};
+
+// One indication from the match stage, a single cache line
+struct alignas(CACHE_LINE_SIZE) IndSlot
+{
+    uint8_t  mFlags;
+    EngMsgId mMsgId;
+    uint8_t  mLength;
+    char     mData[CACHE_LINE_SIZE - 3];
+};
+
+typedef SpscRing<ReqSlot> ReqRing;
+typedef SpscRing<IndSlot> IndRing;
+
+// Match stage side of the indication ring. Copies each indication into a
+// slot and nothing more, encoding is left to the publish stage.
+struct IndRingWriter : IEngineClient
+{
+    IndRingWriter(IndRing& ring) : mRing(ring) {}
+
+    void Handle(const BookClearInd&& ind)  { Write(EngMsgId::PART_BOOK_CLEAR_IND, ind); }
+    void Handle(const BookInsertInd&& ind) { Write(EngMsgId::PART_BOOK_INSERT_IND, ind); }
+    void Handle(const BookDeleteInd&& ind) { Write(EngMsgId::PART_BOOK_DELETE_IND, ind); }
+    void Handle(const BookAmendInd&& ind)  { Write(EngMsgId::PART_BOOK_AMEND_IND, ind); }
+    void Handle(const BookTradeInd&& ind)  { Write(EngMsgId::PART_BOOK_TRADE_IND, ind); }
+    void Handle(const BookSweepInd&& ind)  { Write(EngMsgId::PART_BOOK_SWEEP_IND, ind); }
+    void Handle(const BookFillInd&& ind)   { Write(EngMsgId::PART_BOOK_FILL_IND, ind); }
+    void Handle(const BookDepthInd&& ind)  { Write(EngMsgId::PART_BOOK_DEPTH_IND, ind); }
+    void Handle(const EngAvailableBooksInd&& ind) { Write(EngMsgId::PART_BOOK_AVAIL_IND, ind); }
+
+    // Private to the requesting gateway, not market data
+    void Handle(const BookErrorInd&& ind) {}
+    void Handle(const EngOperationCnf&& cnf) {}
+    void Handle(const EngOperationRangeCnf&& cnf) {}
+    void Handle(const EngOperationRej&& rej) {}
+
+    template<typename T>
+    inline void Write(EngMsgId msgId, const T& ind)
+    {
+        static_assert(sizeof(T) <= sizeof(IndSlot::mData), "Indication does not fit in a slot");
+        IndSlot* slot = Claim();
+        slot->mFlags = 0;
+        slot->mMsgId = msgId;
+        slot->mLength = sizeof(T);
+        memcpy(slot->mData, &ind, sizeof(T));
+        mRing.Push();
+        mPending = true;
+    }
+
+    inline void EndBatch()
+    {
+        if(!mPending) return;
+        IndSlot* slot = Claim();
+        slot->mFlags = END_OF_BATCH;
+        mRing.Push();
+        mPending = false;
+    }
+
+    inline IndSlot* Claim()
+    {
+        IndSlot* slot;
+        while(!(slot = mRing.Back()))
+        {
+            ++mStalls;
+            CpuRelax();
+        }
+        return slot;
+    }
+
+    IndRing& mRing;
+    bool mPending = false;
+    uint64_t mStalls = 0;
+};
+
+struct PipelineConfig
+{
+    int mDecodeCore = NO_CORE;
+    int mMatchCore = NO_CORE;
+    int mPublishCore = NO_CORE;
+    int mMatchRtPriority = 0;  // SCHED_FIFO priority of the match stage, 0 keeps the default
+    size_t mReqRingSize = 4096;
+    size_t mIndRingSize = 65536;
+    size_t mPacketRingSize = 4096;
+};
+
+// Decode, match and publish each on their own pinned thread, joined by
+// single producer single consumer rings:
+//   decode  - recvmmsg, size and sequence checks, copy into the request ring
+//   match   - Engine/Book processing, indications copied into the ind ring
+//   publish - packet encoding and sendmmsg to both feeds
+// A batch ends whenever the match thread finds the request ring empty.
+// Processing a request makes no syscalls, except msync when journaling
+// per message and mmap when the order pools ran dry before Idle grew them
+// (ImmediateCleanup). Between batches the match thread does make them:
+//   Journal::EndBatch - msync of the batch when journaling per batch
+//   Engine::Idle      - mmap and mlock of pool segments at the low water mark
+//   Snapshotter::Take - fork, only when a snapshot was requested, and a read
+//                       of /proc/meminfo first when the pools are hugetlb
+//   latency dump      - stdout writes, only when requested
+struct Pipeline
+{
+    Pipeline(UdpIngest& ingest, int sockFdA, int sockFdB, const PipelineConfig& config, 
+        Snapshotter* snapshotter=nullptr)
+    : mConfig(config)
+    , mIngest(ingest)
+    , mReqRing(config.mReqRingSize)
+    , mIndRing(config.mIndRingSize)
+    , mWriter(mIndRing)
+    , mEngine(mWriter)
+    , mPublisher(sockFdA, sockFdB, config.mPacketRingSize)
+    , mEncoder(mPublisher.mRing)
+    , mSnapshotter(snapshotter)
+    {
+    }
+
+    ~Pipeline()
+    {
+        Stop();
+    }
+
+    void Init(size_t initLevelAlloc, size_t initOrderAlloc, size_t initClientAlloc)
+    {
+        mEngine.Init(initLevelAlloc, initOrderAlloc, initClientAlloc);
+    }
+
+    void Start()
+    {
+        // Carry on from whatever the engine recovered
+        mLastOpId = mEngine.mLastOpId;
+        mPublishRunning.store(true, std::memory_order_release);
+        mMatchRunning.store(true, std::memory_order_release);
+        mDecodeRunning.store(true, std::memory_order_release);
+        StartStage(mPublishThread, mConfig.mPublishCore, "publish", [this]{ RunPublish(); });
+        StartStage(mMatchThread, mConfig.mMatchCore, "match", [this]{ RunMatch(); });
+        if(!SetRealtime(mMatchThread.native_handle(), mConfig.mMatchRtPriority))
+        {
+            fprintf(stderr, "Failed to make the match stage real time\n");
+        }
+        StartStage(mDecodeThread, mConfig.mDecodeCore, "decode", [this]{ RunDecode(); });
+    }
+
+    // Stops stages upstream first so everything accepted is published
+    void Stop()
+    {
+        StopStage(mDecodeRunning, mDecodeThread);
+        StopStage(mMatchRunning, mMatchThread);
+        StopStage(mPublishRunning, mPublishThread);
+    }
+
+    template<typename F>
+    void StartStage(std::thread& thread, int core, const char* name, F&& run)
+    {
+        thread = std::thread(std::forward<F>(run));
+        if(!PinThread(thread.native_handle(), core))
+        {
+            fprintf(stderr, "Failed to pin %s stage to core %d\n", name, core);
+        }
+    }
+
+    // Taken by the match stage the next time it is idle
+    void RequestSnapshot()
+    {
+        mSnapshotRequested.store(true, std::memory_order_release);
+    }
+
+    // Latency histograms are written by the match stage the next time it is idle
+    void RequestLatencyDump()
+    {
+        mLatencyDumpRequested.store(true, std::memory_order_release);
+    }
+
+    void StopStage(std::atomic<bool>& running, std::thread& thread)
+    {
+        running.store(false, std::memory_order_release);
+        if(thread.joinable()) thread.join();
+    }
+
+    void RunDecode()
+    {
+        while(mDecodeRunning.load(std::memory_order_acquire))
+        {
+            int received = mIngest.Poll([this](const char* buf, size_t size){ Decode(buf, size); });
+            if(received < 0)
+            {
+                fprintf(stderr, "recvmmsg failed\n");
+                return;
+            }
+            if(received == 0) CpuRelax();
+        }
+    }
+
+    inline void Decode(const char* buf, size_t size)
+    {
+        if(UNLIKELY(size < sizeof(EngOperationReq) || size > MAX_MSG_SIZE)) return;
+        const auto& req = *reinterpret_cast<const EngOperationReq*>(buf);
+
+        if(req.mOperationId.mSequence > mLastOpId+1) return;
+        if(req.mOperationId.mSequence <= mLastOpId) return;
+        size_t count = OperationCount(req, buf+sizeof(req), size-sizeof(req));
+        if(UNLIKELY(!count)) return;
+        mLastOpId = req.mOperationId.mSequence + count - 1;
+
+        ReqSlot* slot;
+        while(!(slot = mReqRing.Back()))
+        {
+            ++mDecodeStalls;
+            CpuRelax();
+        }
+        RH_LATENCY(slot->mReceiveTsc = mIngest.mPollTsc);
+        slot->mSize = size;
+        memcpy(slot->mData, buf, size);
+        mReqRing.Push();
+    }
+
+    void RunMatch()
+    {
+        while(mMatchRunning.load(std::memory_order_acquire) || !mReqRing.Empty())
+        {
+            ReqSlot* slot = mReqRing.Front();
+            if(!slot)
+            {
+                mEngine.EndBatch();
+                mWriter.EndBatch();
+                RH_LATENCY(mEngine.mLatency.Publish());
+                RH_LATENCY(if(mLatencyDumpRequested.exchange(false, std::memory_order_relaxed)) mEngine.mLatency.Dump(stdout));
+                if(mSnapshotter && mSnapshotRequested.load(std::memory_order_relaxed))
+                {
+                    mSnapshotRequested.store(false, std::memory_order_relaxed);
+                    mSnapshotter->Take(mEngine);
+                }
+                if(!mEngine.Idle()) CpuRelax();
+                continue;
+            }
+
+            const auto& req = *reinterpret_cast<const EngOperationReq*>(slot->mData);
+            RH_LATENCY(mEngine.mLatency.Receive(slot->mReceiveTsc));
+            mEngine.Process(req, slot->mData+sizeof(req), slot->mSize-sizeof(req));
+            mReqRing.Pop();
+        }
+        mEngine.EndBatch();
+        mWriter.EndBatch();
+        RH_LATENCY(mEngine.mLatency.Publish());
+    }
+
+    void RunPublish()
+    {
+        while(mPublishRunning.load(std::memory_order_acquire) || !mIndRing.Empty())
+        {
+            size_t ready = mIndRing.Size();
+            for(size_t i = 0; i < ready; ++i)
+            {
+                const IndSlot* slot = mIndRing.Front();
+                if(slot->mFlags & END_OF_BATCH) mEncoder.EndBatch();
+                else mEncoder.Encode(slot->mMsgId, slot->mData, slot->mLength);
+                mIndRing.Pop();
+
+                // This thread also drains the packet ring, never let it fill
+                if(mPublisher.mRing.Size() >= MAX_MD_SEND_BATCH) mPublisher.SendReady();
+            }
+
+            while(mPublisher.SendReady());
+            if(!ready) CpuRelax();
+        }
+        mEncoder.EndBatch();
+        while(mPublisher.SendReady());
+    }
+
+    const PipelineConfig mConfig;
+    UdpIngest& mIngest;
+    ReqRing mReqRing;
+    IndRing mIndRing;
+    IndRingWriter mWriter;
+    Engine mEngine;
+    MdPublisher mPublisher;
+    MdEncoder mEncoder;
+    Snapshotter* mSnapshotter;
+    std::atomic<bool> mSnapshotRequested{false};
+    std::atomic<bool> mLatencyDumpRequested{false};
+    uint16_t mLastOpId = 0;
+    uint64_t mDecodeStalls = 0;
+
+    std::atomic<bool> mDecodeRunning{false};
+    std::atomic<bool> mMatchRunning{false};
+    std::atomic<bool> mPublishRunning{false};
+    std::thread mDecodeThread;
+    std::thread mMatchThread;
+    std::thread mPublishThread;
+};
+
+}
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+
+#include "engine.h"
+#include "spsc_ring.h"
+#include "thread.h"
+
+namespace redheads
+{
+
+constexpr size_t MAX_MD_PACKET_SIZE = 1472; // 1500 MTU less IP and UDP headers
+constexpr size_t MAX_MD_SEND_BATCH  = 64;
+
+#pragma pack(push, 1)
+
+// Every packet on the A and B feeds starts with this. Sequence numbers are
+// per packet and contiguous so consumers can detect gaps and arbitrate A/B.
+struct MdPacketHeader
+{
+    uint64_t mSequence;
+    uint16_t mCount;
+};
+
+// Precedes every indication in a packet
+struct MdMsgHeader
+{
+    EngMsgId mMsgId;
+    uint8_t  mLength;
+};
+
+#pragma pack(pop)
+
+struct alignas(CACHE_LINE_SIZE) MdPacket
+{
+    uint32_t mSize;
+    char mData[MAX_MD_PACKET_SIZE];
+};
+
+typedef SpscRing<MdPacket> MdPacketRing;
+
+// Packs indications from the matching thread into packets in the publish
+// ring. A packet goes out when the next message would not fit or at the end
+// of a processing batch, never per message.
+struct MdEncoder : IEngineClient
+{
+    MdEncoder(MdPacketRing& ring, size_t packetSize=MAX_MD_PACKET_SIZE)
+    : mRing(ring)
+    , mPacketSize(std::min(packetSize, MAX_MD_PACKET_SIZE))
+    {
+    }
+
+    void Handle(const BookClearInd&& ind)  { Encode(EngMsgId::PART_BOOK_CLEAR_IND, ind); }
+    void Handle(const BookInsertInd&& ind) { Encode(EngMsgId::PART_BOOK_INSERT_IND, ind); }
+    void Handle(const BookDeleteInd&& ind) { Encode(EngMsgId::PART_BOOK_DELETE_IND, ind); }
+    void Handle(const BookAmendInd&& ind)  { Encode(EngMsgId::PART_BOOK_AMEND_IND, ind); }
+    void Handle(const BookTradeInd&& ind)  { Encode(EngMsgId::PART_BOOK_TRADE_IND, ind); }
+    void Handle(const BookSweepInd&& ind)  { Encode(EngMsgId::PART_BOOK_SWEEP_IND, ind); }
+    void Handle(const BookFillInd&& ind)   { Encode(EngMsgId::PART_BOOK_FILL_IND, ind); }
+    void Handle(const BookDepthInd&& ind)  { Encode(EngMsgId::PART_BOOK_DEPTH_IND, ind); }
+    void Handle(const EngAvailableBooksInd&& ind) { Encode(EngMsgId::PART_BOOK_AVAIL_IND, ind); }
+
+    // Private to the requesting gateway, not market data
+    void Handle(const BookErrorInd&& ind) {}
+    void Handle(const EngOperationCnf&& cnf) {}
+    void Handle(const EngOperationRangeCnf&& cnf) {}
+    void Handle(const EngOperationRej&& rej) {}
+
+    template<typename T>
+    inline void Encode(EngMsgId msgId, const T& ind)
+    {
+        static_assert(sizeof(MdMsgHeader) + sizeof(T) + sizeof(MdPacketHeader) <= MAX_MD_PACKET_SIZE,
+            "Indication does not fit in a packet");
+        Encode(msgId, reinterpret_cast<const char*>(&ind), sizeof(T));
+    }
+
+    inline void Encode(EngMsgId msgId, const char* ind, uint8_t length)
+    {
+        if(UNLIKELY(!mOrderUpdates) && IsOrderUpdate(msgId)) return;
+        size_t size = sizeof(MdMsgHeader) + length;
+
+        if(UNLIKELY(mPacket && mPacket->mSize + size > mPacketSize)) Flush();
+        if(UNLIKELY(!mPacket)) Open();
+
+        char* out = mPacket->mData + mPacket->mSize;
+        MdMsgHeader header{msgId, length};
+        memcpy(out, &header, sizeof(header));
+        memcpy(out + sizeof(header), ind, length);
+        mPacket->mSize += size;
+        ++mCount;
+    }
+
+    // Per order changes to resting orders, which conflated depth replaces
+    static inline bool IsOrderUpdate(EngMsgId msgId)
+    {
+        return msgId == EngMsgId::PART_BOOK_INSERT_IND || msgId == EngMsgId::PART_BOOK_DELETE_IND ||
+            msgId == EngMsgId::PART_BOOK_AMEND_IND;
+    }
+
+    // Called once the engine has finished a batch of requests
+    inline void EndBatch()
+    {
+        if(mPacket) Flush();
+    }
+
+    inline void Open()
+    {
+        while(!(mPacket = mRing.Back()))
+        {
+            ++mStalls;
+            CpuRelax();
+        }
+        mPacket->mSize = sizeof(MdPacketHeader);
+        mCount = 0;
+    }
+
+    inline void Flush()
+    {
+        MdPacketHeader header{++mSequence, mCount};
+        memcpy(mPacket->mData, &header, sizeof(header));
+        mRing.Push();
+        mPacket = nullptr;
+    }
+
+    MdPacketRing& mRing;
+    const size_t mPacketSize;
+    MdPacket* mPacket = nullptr;
+    uint16_t mCount = 0;
+    uint64_t mSequence = 0;
+    bool mOrderUpdates = true;  // false leaves depth, trades and book events only
+    uint64_t mStalls = 0; // ring full, publisher fell behind
+};
+
+// Drains the publish ring on its own thread and sends each run of packets
+// to both feeds with one sendmmsg per feed. The feed sockets are expected
+// to be connected to their destinations.
+struct MdPublisher
+{
+    MdPublisher(int sockFdA, int sockFdB, size_t ringSize, int core=NO_CORE)
+    : mRing(ringSize)
+    , mCore(core)
+    , mFeeds{{sockFdA, {}, {}}, {sockFdB, {}, {}}}
+    {
+        for(auto& feed : mFeeds)
+        {
+            feed.mIovs.resize(ringSize);
+            feed.mMsgs.resize(ringSize);
+            for(size_t i = 0; i < ringSize; ++i)
+            {
+                feed.mIovs[i].iov_base = mRing.mSlots[i].mData;
+                feed.mMsgs[i] = mmsghdr();
+                feed.mMsgs[i].msg_hdr.msg_iov = &feed.mIovs[i];
+                feed.mMsgs[i].msg_hdr.msg_iovlen = 1;
+            }
+        }
+    }
+
+    ~MdPublisher()
+    {
+        Stop();
+    }
+
+    void Start()
+    {
+        mRunning.store(true, std::memory_order_release);
+        mThread = std::thread([this]{ Run(); });
+        if(!PinThread(mThread.native_handle(), mCore))
+        {
+            fprintf(stderr, "Failed to pin publisher to core %d\n", mCore);
+        }
+    }
+
+    void Stop()
+    {
+        mRunning.store(false, std::memory_order_release);
+        if(mThread.joinable()) mThread.join();
+    }
+
+    void Run()
+    {
+        while(mRunning.load(std::memory_order_acquire) || !mRing.Empty())
+        {
+            if(!SendReady()) CpuRelax();
+        }
+    }
+
+    // Sends the next run of ready packets, returns how many were sent. Can
+    // be called directly instead of Start() to send from the encoding thread
+    size_t SendReady()
+    {
+        size_t ready = mRing.Size();
+        if(!ready) return 0;
+
+        size_t first = mRing.FrontIndex();
+        size_t count = std::min(std::min(ready, MAX_MD_SEND_BATCH), mRing.mMask + 1 - first);
+        for(auto& feed : mFeeds)
+        {
+            for(size_t i = first; i < first + count; ++i) feed.mIovs[i].iov_len = mRing.mSlots[i].mSize;
+            Send(feed, first, count);
+        }
+        mRing.Pop(count);
+        mPackets += count;
+        ++mBatches;
+        return count;
+    }
+
+    struct Feed
+    {
+        int mFd;
+        std::vector<iovec> mIovs;
+        std::vector<mmsghdr> mMsgs;
+    };
+
+    void Send(Feed& feed, size_t first, size_t count)
+    {
+        while(count)
+        {
+            int sent = sendmmsg(feed.mFd, &feed.mMsgs[first], count, 0);
+            if(sent < 0)
+            {
+                if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+                // Dropped on this feed only, consumers recover it from the other
+                ++mSendErrors;
+                return;
+            }
+            first += sent;
+            count -= sent;
+        }
+    }
+
+    MdPacketRing mRing;
+    int mCore;
+    Feed mFeeds[2];
+    std::atomic<bool> mRunning{false};
+    std::thread mThread;
+    uint64_t mPackets = 0;
+    uint64_t mBatches = 0;
+    uint64_t mSendErrors = 0;
+};
+
+}
@@ -0,0 +1,387 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "thread.h"
+
+namespace redheads
+{
+
+constexpr size_t MAX_RECOVERY_BOOKS     = 65536;
+constexpr size_t RECOVERY_BUDGET        = 4096; // books checked plus orders copied per idle call
+constexpr size_t RECOVERY_READ_ATTEMPTS = 16;   // torn reads of one image before giving up on it
+constexpr int RECOVERY_SEND_TIMEOUT_MS  = 1000; // a client slower than this is dropped
+
+#pragma pack(push, 1)
+
+// Starts a response on the recovery socket, followed by mBooks images
+struct RecoveryHeader
+{
+    uint32_t mBooks;
+};
+
+// A book as it stood once the feed packet mSequence had been encoded, so a
+// subscriber applies feed packets after mSequence on top of it. Followed
+// by mBidOrders then mAskOrders RecoveryOrders, best price first and in
+// queue order within a price.
+struct RecoveryBookImage
+{
+    uint64_t       mSequence;
+    EngSeriesId    mSeries;
+    uint16_t       mBookId;
+    BookBehaviours mBehaviours;
+    uint32_t       mBidOrders;
+    uint32_t       mAskOrders;
+};
+
+struct RecoveryOrder
+{
+    uint64_t mOrderId;
+    uint16_t mClientId;
+    int64_t  mPrice;
+    int64_t  mVolume;
+};
+
+#pragma pack(pop)
+
+// Serialised image with room to spare. Replaced rather than resized so a
+// reader never sees its memory go away under it.
+struct ImageStorage
+{
+    size_t mCapacity;
+    size_t mSize;
+    char   mData[];
+
+    static ImageStorage* Create(size_t capacity)
+    {
+        auto* storage = static_cast<ImageStorage*>(malloc(sizeof(ImageStorage) + capacity));
+        if(!storage) throw std::bad_alloc();
+        storage->mCapacity = capacity;
+        storage->mSize = 0;
+        return storage;
+    }
+};
+
+// Two images of one book, each behind its own sequence lock. The writer
+// only ever rewrites the one readers were not pointed at, so a read is only
+// retried if the book was imaged twice while it copied.
+struct BookImageSlot
+{
+    ~BookImageSlot()
+    {
+        free(mStorage[0].load(std::memory_order_relaxed));
+        free(mStorage[1].load(std::memory_order_relaxed));
+    }
+
+    std::atomic<uint64_t> mSeq[2] = {{0}, {0}};          // odd while being written
+    std::atomic<ImageStorage*> mStorage[2] = {{nullptr}, {nullptr}};
+    std::atomic<int> mLatest{-1};                        // buffer readers copy, -1 before the first image
+    uint64_t mVersion = 0;                               // Engine::mBookVersions the latest was taken at
+    bool mImaged = false;
+};
+
+// Book images for late joiners, written by the matching thread while it is
+// idle and copied out by the recovery thread. The matching thread never
+// waits on a reader: torn copies are the reader's problem, and storage a
+// reader could still hold is only freed once no read is in progress.
+struct RecoveryImages
+{
+    RecoveryImages(size_t maxBooks=MAX_RECOVERY_BOOKS)
+    : mMaxBooks(maxBooks)
+    , mSlots(new std::atomic<BookImageSlot*>[maxBooks])
+    {
+        for(size_t i = 0; i < maxBooks; ++i) mSlots[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~RecoveryImages()
+    {
+        for(size_t i = 0; i < mBooks.load(std::memory_order_relaxed); ++i) delete mSlots[i].load();
+        for(auto* storage : mRetired) free(storage);
+    }
+
+    RecoveryImages(const RecoveryImages&) = delete;
+    RecoveryImages& operator=(const RecoveryImages&) = delete;
+
+    // Matching thread, once everything up to packet sequence has been
+    // encoded. Images books changed since their last image, round robin,
+    // until budget books checked and orders copied. Returns true while
+    // books may be left to image.
+    bool Refresh(const Engine& engine, uint64_t sequence, size_t budget=RECOVERY_BUDGET)
+    {
+        FreeRetired();
+
+        size_t books = std::min(engine.mBooks.size(), mMaxBooks);
+        if(mBooks.load(std::memory_order_relaxed) == books && mClean == engine.mBookUpdates) return false;
+        for(size_t i = mBooks.load(std::memory_order_relaxed); i < books; ++i)
+        {
+            mSlots[i].store(new BookImageSlot(), std::memory_order_relaxed);
+            mBooks.store(i + 1, std::memory_order_release);
+        }
+
+        // Any change may be behind the cursor, so clean takes a full lap
+        // with no requests in between
+        if(mLapUpdates != engine.mBookUpdates)
+        {
+            mLapUpdates = engine.mBookUpdates;
+            mLapChecked = 0;
+        }
+
+        size_t cost = 0;
+        while(mLapChecked < books && cost < budget)
+        {
+            size_t idx = mCursor++ % books;
+            ++mLapChecked;
+            ++cost;
+            auto& slot = *mSlots[idx].load(std::memory_order_relaxed);
+            if(slot.mImaged && slot.mVersion == engine.mBookVersions[idx]) continue;
+            cost += Write(engine, idx, slot, sequence);
+            slot.mVersion = engine.mBookVersions[idx];
+            slot.mImaged = true;
+            ++mImagesTaken;
+        }
+        if(mLapChecked < books) return true;
+        mClean = mLapUpdates;
+        return false;
+    }
+
+    // Returns the orders written
+    size_t Write(const Engine& engine, size_t idx, BookImageSlot& slot, uint64_t sequence)
+    {
+        const auto& book = engine.mBooks[idx];
+        RecoveryBookImage image{sequence, engine.mBookSeries[idx], book.mBookId, book.mBehaviours, 0, 0};
+        book.ForEachLevel(true, [&](int64_t, const Level& level){ image.mBidOrders += level.mOrders; });
+        book.ForEachLevel(false, [&](int64_t, const Level& level){ image.mAskOrders += level.mOrders; });
+        size_t orders = image.mBidOrders + image.mAskOrders;
+        size_t size = sizeof(image) + orders * sizeof(RecoveryOrder);
+
+        int latest = slot.mLatest.load(std::memory_order_relaxed);
+        int buffer = latest < 0 ? 0 : 1 - latest;
+        uint64_t seq = slot.mSeq[buffer].load(std::memory_order_relaxed);
+        slot.mSeq[buffer].store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        ImageStorage* storage = slot.mStorage[buffer].load(std::memory_order_relaxed);
+        if(!storage || storage->mCapacity < size)
+        {
+            if(storage) mRetired.push_back(storage);
+            storage = ImageStorage::Create(std::max(size + size / 2, (size_t)256));
+            slot.mStorage[buffer].store(storage, std::memory_order_release);
+        }
+
+        char* out = storage->mData;
+        memcpy(out, &image, sizeof(image));
+        out += sizeof(image);
+        const auto& pool = engine.mBookMem.mOrderPool;
+        const auto& infos = engine.mBookMem.mOrderInfoPool;
+        auto writeLevel = [&](int64_t price, const Level& level)
+        {
+            for(OrderLoc loc = level.mLead; loc != NULL_ORDER; loc = pool[loc].mNext)
+            {
+                RecoveryOrder order{infos[loc].mOrderId, infos[loc].mClientId, price, pool[loc].mVolume};
+                memcpy(out, &order, sizeof(order));
+                out += sizeof(order);
+                if(loc == level.mEnd) break;
+            }
+        };
+        book.ForEachLevel(true, writeLevel);
+        book.ForEachLevel(false, writeLevel);
+        storage->mSize = size;
+
+        slot.mSeq[buffer].store(seq + 2, std::memory_order_release);
+        slot.mLatest.store(buffer, std::memory_order_release);
+        return orders;
+    }
+
+    // Storage replaced while a read may have been under way is freed once
+    // the reader is between reads. The replacements were stored before the
+    // fence and Collect fences between raising mReading and loading storage,
+    // so either the reader is seen or its read sees only the replacements.
+    void FreeRetired()
+    {
+        if(mRetired.empty()) return;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(mReading.load(std::memory_order_acquire)) return;
+        for(auto* storage : mRetired) free(storage);
+        mRetired.clear();
+    }
+
+    // Recovery thread. Appends a consistent copy of every book imaged so far
+    // to out and returns how many. Books torn on every attempt are left out.
+    uint32_t Collect(std::vector<char>& out)
+    {
+        mReading.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint32_t collected = 0;
+        size_t books = mBooks.load(std::memory_order_acquire);
+        for(size_t i = 0; i < books; ++i)
+        {
+            if(CopyImage(*mSlots[i].load(std::memory_order_relaxed), out)) ++collected;
+        }
+        mReading.store(false, std::memory_order_release);
+        return collected;
+    }
+
+    bool CopyImage(const BookImageSlot& slot, std::vector<char>& out)
+    {
+        for(size_t attempt = 0; attempt < RECOVERY_READ_ATTEMPTS; ++attempt)
+        {
+            int buffer = slot.mLatest.load(std::memory_order_acquire);
+            if(buffer < 0) return false;
+            uint64_t seq = slot.mSeq[buffer].load(std::memory_order_acquire);
+            if(seq & 1)
+            {
+                ++mTornReads;
+                continue;
+            }
+            const ImageStorage* storage = slot.mStorage[buffer].load(std::memory_order_acquire);
+            size_t size = std::min(storage->mSize, storage->mCapacity);
+            size_t start = out.size();
+            out.resize(start + size);
+            memcpy(out.data() + start, storage->mData, size);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(slot.mSeq[buffer].load(std::memory_order_relaxed) == seq) return true;
+            out.resize(start);
+            ++mTornReads;
+        }
+        ++mGaveUp;
+        return false;
+    }
+
+    const size_t mMaxBooks;
+    std::unique_ptr<std::atomic<BookImageSlot*>[]> mSlots;
+    std::atomic<size_t> mBooks{0};      // slots published to the reader
+    std::atomic<bool> mReading{false};
+    std::vector<ImageStorage*> mRetired; // matching thread only
+    size_t mCursor = 0;
+    uint64_t mLapUpdates = 0;            // Engine::mBookUpdates the current lap started at
+    size_t mLapChecked = 0;
+    uint64_t mClean = ~0ull;             // Engine::mBookUpdates when every book was last imaged
+    uint64_t mImagesTaken = 0;
+    uint64_t mTornReads = 0;             // recovery thread only
+    uint64_t mGaveUp = 0;
+};
+
+// Serves every book image to each client that connects to a unix stream
+// socket, then closes the connection. Runs on its own thread, a burst of
+// clients queues in the listen backlog and only ever waits on this thread.
+struct RecoveryServer
+{
+    RecoveryServer(RecoveryImages& images, const std::string& path, int core=NO_CORE)
+    : mImages(images)
+    , mPath(path)
+    , mCore(core)
+    {
+    }
+
+    ~RecoveryServer()
+    {
+        Stop();
+    }
+
+    bool Start()
+    {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if(mPath.size() >= sizeof(addr.sun_path)) return false;
+        strncpy(addr.sun_path, mPath.c_str(), sizeof(addr.sun_path) - 1);
+
+        mListenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(mListenFd < 0) return false;
+        unlink(mPath.c_str());
+        if(bind(mListenFd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(mListenFd, 64) < 0)
+        {
+            close(mListenFd);
+            mListenFd = -1;
+            return false;
+        }
+
+        mRunning.store(true, std::memory_order_release);
+        mThread = std::thread([this]{ Run(); });
+        if(!PinThread(mThread.native_handle(), mCore))
+        {
+            fprintf(stderr, "Failed to pin recovery thread to core %d\n", mCore);
+        }
+        return true;
+    }
+
+    void Stop()
+    {
+        mRunning.store(false, std::memory_order_release);
+        if(mThread.joinable()) mThread.join();
+        if(mListenFd >= 0)
+        {
+            close(mListenFd);
+            unlink(mPath.c_str());
+            mListenFd = -1;
+        }
+    }
+
+    void Run()
+    {
+        std::vector<char> response;
+        while(mRunning.load(std::memory_order_acquire))
+        {
+            pollfd pfd{mListenFd, POLLIN, 0};
+            if(poll(&pfd, 1, 100) <= 0) continue;
+            int fd = accept(mListenFd, nullptr, nullptr);
+            if(fd < 0) continue;
+
+            timeval timeout{RECOVERY_SEND_TIMEOUT_MS / 1000, (RECOVERY_SEND_TIMEOUT_MS % 1000) * 1000};
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            response.resize(sizeof(RecoveryHeader));
+            RecoveryHeader header{mImages.Collect(response)};
+            memcpy(response.data(), &header, sizeof(header));
+            if(Send(fd, response)) ++mServed;
+            else ++mFailed;
+            close(fd);
+        }
+    }
+
+    static bool Send(int fd, const std::vector<char>& data)
+    {
+        size_t sent = 0;
+        while(sent < data.size())
+        {
+            ssize_t count = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if(count < 0 && errno == EINTR) continue;
+            if(count <= 0) return false;
+            sent += count;
+        }
+        return true;
+    }
+
+    void Dump(FILE* out) const
+    {
+        fprintf(out, "recovery served %lu failed %lu images %lu torn reads %lu gave up %lu\n", mServed, mFailed,
+            mImages.mImagesTaken, mImages.mTornReads, mImages.mGaveUp);
+    }
+
+    RecoveryImages& mImages;
+    const std::string mPath;
+    int mCore;
+    int mListenFd = -1;
+    std::atomic<bool> mRunning{false};
+    std::thread mThread;
+    uint64_t mServed = 0;
+    uint64_t mFailed = 0;
+};
+
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <new>
+#include <sys/mman.h>
+#include <type_traits>
+#include <vector>
+
+namespace redheads
+{
+
+constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+constexpr size_t SMALL_PAGE_SIZE = 4096;
+
+constexpr unsigned FloorLog2(size_t value)
+{
+    unsigned bits = 0;
+    while(value >>= 1) ++bits;
+    return bits;
+}
+
+// Huge pages the system has free and not yet promised to a mapping
+inline size_t UnreservedHugePages()
+{
+    FILE* meminfo = fopen("/proc/meminfo", "r");
+    if(!meminfo) return 0;
+    char line[128];
+    long free = 0, reserved = 0;
+    while(fgets(line, sizeof(line), meminfo))
+    {
+        sscanf(line, "HugePages_Free: %ld", &free);
+        sscanf(line, "HugePages_Rsvd: %ld", &reserved);
+    }
+    fclose(meminfo);
+    return free > reserved ? free - reserved : 0;
+}
+
+// Elements held in fixed size segments mapped one at a time, so growing
+// adds segments and never moves what is already there. References into
+// the pool stay valid for its lifetime. Segments are a huge page where
+// the system has them reserved, otherwise transparent huge pages are
+// asked for, and are pre-faulted as they are mapped.
+//
+// Mappings are private, so after a fork each huge page written is copied
+// whole on its first write, on the writing thread. A copy the system has
+// no free huge page for kills the child with SIGBUS when it reads the
+// page, the parent keeps its own. Transparent huge pages are split on
+// their first write instead and only the small page is copied.
+template<typename T>
+struct SegmentedPool
+{
+    static_assert(std::is_trivially_destructible<T>::value, "Pool elements are never destroyed");
+    static constexpr unsigned SEGMENT_BITS = sizeof(T) < HUGE_PAGE_SIZE ? FloorLog2(HUGE_PAGE_SIZE / sizeof(T)) : 0;
+    static constexpr size_t SEGMENT_SIZE = size_t(1) << SEGMENT_BITS;
+    static constexpr size_t SEGMENT_MASK = SEGMENT_SIZE - 1;
+    static constexpr size_t SEGMENT_BYTES = (SEGMENT_SIZE*sizeof(T) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+    SegmentedPool() = default;
+    SegmentedPool(const SegmentedPool&) = delete;
+    SegmentedPool& operator=(const SegmentedPool&) = delete;
+
+    ~SegmentedPool()
+    {
+        for(auto segment : mSegments) munmap(segment, SEGMENT_BYTES);
+    }
+
+    inline T& operator[](size_t idx)
+    {
+        return mSegments[idx >> SEGMENT_BITS][idx & SEGMENT_MASK];
+    }
+
+    inline const T& operator[](size_t idx) const
+    {
+        return mSegments[idx >> SEGMENT_BITS][idx & SEGMENT_MASK];
+    }
+
+    inline size_t size() const { return mSize; }
+    inline bool empty() const { return mSize == 0; }
+    inline size_t capacity() const { return mSegments.size() * SEGMENT_SIZE; }
+
+    // Segments stay mapped when shrinking
+    void resize(size_t size, const T& value = T())
+    {
+        Reserve(size);
+        for(size_t i = mSize; i < size; ++i) new (&(*this)[i]) T(value);
+        mSize = size;
+    }
+
+    void assign(size_t size, const T& value)
+    {
+        Reserve(size);
+        for(size_t i = 0; i < size; ++i) new (&(*this)[i]) T(value);
+        mSize = size;
+    }
+
+    // Maps segments until size elements fit
+    void Reserve(size_t size)
+    {
+        while(capacity() < size) mSegments.push_back(MapSegment());
+    }
+
+    // Locks every segment mapped now or later into memory, false when the
+    // memlock limit refused some of them
+    bool Lock()
+    {
+        mLocked = true;
+        bool locked = true;
+        for(auto segment : mSegments) locked &= (mlock(segment, SEGMENT_BYTES) == 0);
+        return locked;
+    }
+
+    T* MapSegment()
+    {
+        void* segment = mmap(nullptr, SEGMENT_BYTES, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if(segment != MAP_FAILED)
+        {
+            mHugePages += SEGMENT_BYTES / HUGE_PAGE_SIZE;
+        }
+        else
+        {
+            segment = mmap(nullptr, SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(segment == MAP_FAILED) throw std::bad_alloc();
+            // Advised before the first touch so the faults can take huge pages
+            madvise(segment, SEGMENT_BYTES, MADV_HUGEPAGE);
+            for(size_t offset = 0; offset < SEGMENT_BYTES; offset += SMALL_PAGE_SIZE)
+            {
+                static_cast<volatile char*>(segment)[offset] = 0;
+            }
+        }
+        if(mLocked) mlock(segment, SEGMENT_BYTES);
+        return static_cast<T*>(segment);
+    }
+
+    std::vector<T*> mSegments;
+    size_t mSize = 0;
+    size_t mHugePages = 0;  // of segments backed by hugetlb
+    bool mLocked = false;
+};
+
+}
@@ -0,0 +1,328 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "engine.h"
+#include "spsc_ring.h"
+#include "thread.h"
+
+namespace redheads
+{
+
+constexpr size_t MAX_SHARDS = 64;
+
+// Shards still to finish an operation or batch spread over several. Slots
+// are preallocated by the router and free again once back to 0, padded so
+// shards finishing neighbouring slots rarely share a line.
+struct PendingConfirm
+{
+    std::atomic<uint32_t> mShards{0};
+    char mPad[CACHE_LINE_SIZE - sizeof(std::atomic<uint32_t>)];
+};
+
+struct alignas(CACHE_LINE_SIZE) ShardMsg
+{
+    // Set when the operation or batch spans shards, the last shard to finish
+    // confirms the mConfirmCount operations from mConfirmId
+    PendingConfirm* mPending;
+    OperationId mConfirmId;
+    uint16_t mConfirmCount;
+    bool mApply;        // false for an operation the single Engine would reject, only confirmed
+    uint32_t mSize;
+    char mData[MAX_MSG_SIZE];
+};
+
+// One Engine, with its own SharedBookMem, owned by a pinned worker thread.
+// Operations arrive already sequenced so each shard sees them in the order
+// the router accepted them.
+struct EngineShard
+{
+    EngineShard(IEngineClient& client, int core, size_t ringSize)
+    : mEngine(client)
+    , mRing(ringSize)
+    , mCore(core)
+    {
+    }
+
+    void Start()
+    {
+        mRunning.store(true, std::memory_order_release);
+        mThread = std::thread([this]{ Run(); });
+        if(!PinThread(mThread.native_handle(), mCore))
+        {
+            fprintf(stderr, "Failed to pin shard to core %d\n", mCore);
+        }
+    }
+
+    void Stop()
+    {
+        mRunning.store(false, std::memory_order_release);
+        if(mThread.joinable()) mThread.join();
+    }
+
+    void Push(const char* buf, size_t size, bool apply, PendingConfirm* pending,
+        const OperationId& confirmId = OperationId(), uint16_t confirmCount = 1)
+    {
+        ShardMsg* msg;
+        while(!(msg = mRing.Back())) CpuRelax();
+        msg->mPending = pending;
+        msg->mConfirmId = confirmId;
+        msg->mConfirmCount = confirmCount;
+        msg->mApply = apply;
+        msg->mSize = size;
+        memcpy(msg->mData, buf, size);
+        mRing.Push();
+    }
+
+    void Run()
+    {
+        // Drain whatever was routed before stopping
+        while(mRunning.load(std::memory_order_acquire) || !mRing.Empty())
+        {
+            ShardMsg* msg = mRing.Front();
+            if(!msg)
+            {
+                mEngine.EndBatch();
+                RH_LATENCY(mEngine.mLatency.Publish());
+                if(!mEngine.Idle()) CpuRelax();
+                continue;
+            }
+
+            const auto& req = *reinterpret_cast<const EngOperationReq*>(msg->mData);
+            if(!msg->mPending)
+            {
+                if(msg->mApply) mEngine.Process(req, msg->mData+sizeof(req), msg->mSize-sizeof(req));
+                else mEngine.Confirm(req.mOperationId);
+            }
+            else
+            {
+                if(msg->mApply) mEngine.Apply(req, msg->mData+sizeof(req), msg->mSize-sizeof(req));
+                if(msg->mPending->mShards.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                {
+                    mEngine.Confirm(msg->mConfirmId, msg->mConfirmCount);
+                }
+            }
+            mRing.Pop();
+        }
+    }
+
+    Engine mEngine;
+    SpscRing<ShardMsg> mRing;
+    int mCore;
+    std::atomic<bool> mRunning{false};
+    std::thread mThread;
+};
+
+// Shards holding a series' books and how many books it maps to, counted
+// the way Engine::CreateBook fills its lookup
+struct SeriesRoute
+{
+    uint64_t mShards = 0;
+    uint32_t mBooks = 0;
+};
+
+// Spreads books over shards by EngSeriesId. HandleMsg runs on the receiving
+// thread, does the sequencing the single Engine would do and hands each
+// operation to the shard owning its books. Each shard reports to its own
+// IEngineClient from its own thread.
+struct ShardedEngine
+{
+    ShardedEngine(const std::vector<IEngineClient*>& clients, const std::vector<int>& cores, size_t ringSize)
+    {
+        assert(!clients.empty() && clients.size() <= MAX_SHARDS && "Unsupported shard count");
+        for(size_t i = 0; i < clients.size(); ++i)
+        {
+            int core = i < cores.size() ? cores[i] : NO_CORE;
+            mShards.emplace_back(new EngineShard(*clients[i], core, ringSize));
+        }
+        // Every operation in flight holds a ring entry, so this many are
+        // never all taken at once
+        mPendingSlots = ringSize * clients.size();
+        mPending.reset(new PendingConfirm[mPendingSlots]);
+        mSeriesShards.set_empty_key(EmptyEngSeriesId());
+        mBookIdUsed.assign(std::numeric_limits<uint16_t>::max() + 1, false);
+    }
+
+    ~ShardedEngine()
+    {
+        Stop();
+    }
+
+    void Init(size_t initLevelAlloc, size_t initOrderAlloc, size_t initClientAlloc)
+    {
+        for(auto& shard : mShards)
+        {
+            shard->mEngine.Init(initLevelAlloc, initOrderAlloc, initClientAlloc);
+            shard->Start();
+        }
+    }
+
+    void Stop()
+    {
+        for(auto& shard : mShards) shard->Stop();
+    }
+
+    inline size_t ShardOf(const EngSeriesId& series) const
+    {
+        return EngSeriesIdHash()(series) % mShards.size();
+    }
+
+    void HandleMsg(const char* buf, size_t size)
+    {
+        if(UNLIKELY(size < sizeof(EngOperationReq) || size > MAX_MSG_SIZE)) return;
+        const auto& req = *reinterpret_cast<const EngOperationReq*>(buf);
+
+        if(req.mOperationId.mSequence > mLastOpId+1) return;
+        if(req.mOperationId.mSequence <= mLastOpId) return;
+
+        if(req.mMsgId == EngMsgId::PART_OP_BATCH_REQ)
+        {
+            RouteBatch(req, buf, size);
+            return;
+        }
+        if(UNLIKELY(!WellFormed(req, buf + sizeof(req), size - sizeof(req))))
+        {
+            // Rejected by the shard, the sequence is not used up
+            mShards[ShardOf(req.mSeries)]->Push(buf, size, true, nullptr);
+            return;
+        }
+        mLastOpId = req.mOperationId.mSequence;
+
+        bool apply;
+        uint64_t shards = RouteOp(req, apply);
+        if(LIKELY(__builtin_popcountll(shards) == 1))
+        {
+            mShards[__builtin_ctzll(shards)]->Push(buf, size, apply, nullptr);
+            return;
+        }
+
+        auto* pending = AcquirePending(__builtin_popcountll(shards));
+        for(size_t i = 0; i < mShards.size(); ++i)
+        {
+            if(shards & (1ull << i)) mShards[i]->Push(buf, size, true, pending, req.mOperationId);
+        }
+    }
+
+    // Waits out the rare slot whose shards are still behind
+    inline PendingConfirm* AcquirePending(uint32_t shards)
+    {
+        auto* pending = &mPending[mNextPending++ % mPendingSlots];
+        while(pending->mShards.load(std::memory_order_acquire)) CpuRelax();
+        pending->mShards.store(shards, std::memory_order_relaxed);
+        return pending;
+    }
+
+    // A batch whose operations all land on one shard, and that shard's
+    // books are all each operation would reach, goes there whole and is
+    // confirmed by it. Otherwise each operation goes to its own shards and
+    // whichever finishes last confirms the batch.
+    void RouteBatch(const EngOperationReq& batch, const char* buf, size_t size)
+    {
+        const char* body = buf + sizeof(batch);
+        size_t bodySize = size - sizeof(batch);
+        uint64_t shards = 0;
+        uint32_t pushes = 0;
+        bool whole = true;
+        size_t routed = 0;
+        uint64_t opShards[std::numeric_limits<uint8_t>::max()];
+        bool opApply[std::numeric_limits<uint8_t>::max()];
+        size_t count = ForEachBatchOp(batch, body, bodySize, [&](const EngOperationReq& op, const char*, size_t)
+        {
+            opShards[routed] = RouteOp(op, opApply[routed]);
+            shards |= opShards[routed];
+            pushes += __builtin_popcountll(opShards[routed]);
+            whole &= opApply[routed];
+            ++routed;
+        });
+        if(UNLIKELY(!count))
+        {
+            mShards[ShardOf(batch.mSeries)]->Push(buf, size, true, nullptr);
+            return;
+        }
+        mLastOpId = batch.mOperationId.mSequence + count - 1;
+
+        if(LIKELY(whole && __builtin_popcountll(shards) == 1))
+        {
+            mShards[__builtin_ctzll(shards)]->Push(buf, size, true, nullptr);
+            return;
+        }
+
+        // Routed as they were when the first pass registered any creates
+        auto* pending = AcquirePending(pushes);
+        routed = 0;
+        ForEachBatchOp(batch, body, bodySize, [&](const EngOperationReq& op, const char* opBody, size_t opSize)
+        {
+            const char* opBuf = opBody - sizeof(op);
+            for(size_t i = 0; i < mShards.size(); ++i)
+            {
+                if(opShards[routed] & (1ull << i))
+                {
+                    mShards[i]->Push(opBuf, opSize + sizeof(op), opApply[routed], pending, batch.mOperationId, count);
+                }
+            }
+            ++routed;
+        });
+    }
+
+    // Shards an operation goes to, registering the shard of a new book.
+    // Clears apply for what the single Engine would reject: a create of a
+    // series or book id it already knows, or anything but a bulk delete on a
+    // series of several books. That goes to one shard to be confirmed only, as a shard
+    // seeing some of the books would otherwise act on them.
+    inline uint64_t RouteOp(const EngOperationReq& req, bool& apply)
+    {
+        if(req.mMsgId != EngMsgId::PART_BOOK_CREATE_REQ) return Lookup(req, apply);
+
+        size_t owner = ShardOf(req.mSeries);
+        uint16_t bookId = reinterpret_cast<const EngCreateBookReq&>(req).mBookId;
+        apply = mSeriesShards.find(req.mSeries) == mSeriesShards.end() && !mBookIdUsed[bookId];
+        if(apply)
+        {
+            mBookIdUsed[bookId] = true;
+            AddSeriesShard(req.mSeries, owner);
+            AddSeriesShard(MaskEngSeriesIdByInstrType(req.mSeries), owner);
+            AddSeriesShard(MaskEngSeriesIdByInstrClass(req.mSeries), owner);
+            AddSeriesShard(MaskEngSeriesIdByUnderlying(req.mSeries), owner);
+        }
+        return 1ull << owner;
+    }
+
+    inline uint64_t Lookup(const EngOperationReq& req, bool& apply) const
+    {
+        apply = true;
+        auto itr = mSeriesShards.find(req.mSeries);
+        // Unknown series still goes to its shard so it is confirmed in order
+        if(itr == mSeriesShards.end()) return 1ull << ShardOf(req.mSeries);
+        const auto& route = itr->second;
+        if(req.mMsgId != EngMsgId::PART_BOOK_CREATE_REQ && req.mMsgId != EngMsgId::PART_BOOK_OP_BULK_DEL_REQ &&
+            route.mBooks > 1)
+        {
+            apply = false;
+            return route.mShards & -route.mShards;
+        }
+        return route.mShards;
+    }
+
+    inline void AddSeriesShard(const EngSeriesId& series, size_t shard)
+    {
+        auto& route = mSeriesShards[series];
+        route.mShards |= (1ull << shard);
+        ++route.mBooks;
+    }
+
+    std::vector<std::unique_ptr<EngineShard>> mShards;
+    google::dense_hash_map<EngSeriesId, SeriesRoute, EngSeriesIdHash> mSeriesShards;
+    std::vector<bool> mBookIdUsed; // by book id, unique over all shards
+    std::unique_ptr<PendingConfirm[]> mPending;
+    size_t mPendingSlots = 0;
+    size_t mNextPending = 0;
+    uint16_t mLastOpId = 0;
+};
+
+}
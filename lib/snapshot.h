@@ -0,0 +1,510 @@
+#pragma once
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "engine.h"
+
+namespace redheads
+{
+
+constexpr uint64_t SNAPSHOT_MAGIC   = 0x544F4E5350414E53ull; // "SNAPSNOT"
+constexpr uint32_t SNAPSHOT_VERSION = 6;
+
+#pragma pack(push, 1)
+
+struct SnapshotHeader
+{
+    uint64_t mMagic;
+    uint32_t mVersion;
+    uint16_t mLastOpId;
+    uint64_t mJournalSegment;
+    uint64_t mJournalOffset;
+    uint32_t mBooks;
+};
+
+// Follows the header. Order ids are derived from slots and their
+// generations, so the pool is restored exactly as it was for the journal
+// tail to hand out the same ids. Followed by mSlots generations, mFree
+// free slots in free list order and the slots of mDropped swept level
+// chains not yet freed, each ended by NULL_ORDER.
+struct SnapshotPool
+{
+    uint32_t mSlots;
+    uint32_t mFree;
+    uint32_t mDropped;
+};
+
+// Followed by bid levels, ask levels, quote clients and client order
+// lists, each list ended by an entry with a zero count
+struct SnapshotBook
+{
+    EngSeriesId    mSeries;
+    uint16_t       mBookId;
+    BookBehaviours mBehaviours;
+    uint64_t       mTradeId;
+};
+
+// Followed by mOrders SnapshotOrders in queue order
+struct SnapshotLevel
+{
+    int64_t  mPrice;
+    uint32_t mOrders;
+};
+
+struct SnapshotOrder
+{
+    uint32_t mSlot;
+    uint16_t mClientId;
+    uint64_t mOrderId;
+    int64_t  mVolume;
+    char     mVarText[VAR_TEXT_SIZE];
+};
+
+// Followed by mOrders quote order ids
+struct SnapshotQuotes
+{
+    uint16_t mClientId;
+    uint32_t mOrders;
+};
+
+// Followed by the slots of the client's live bids then asks, oldest first
+struct SnapshotClientOrders
+{
+    uint16_t mClientId;
+    uint32_t mBids;
+    uint32_t mAsks;
+};
+
+#pragma pack(pop)
+
+// Buffered writer that never allocates, it runs in a forked child of a
+// multithreaded process
+struct SnapshotWriter
+{
+    SnapshotWriter(int fd) : mFd(fd) {}
+
+    template<typename T>
+    inline void Put(const T& value)
+    {
+        Write(&value, sizeof(T));
+    }
+
+    void Write(const void* data, size_t size)
+    {
+        const char* in = static_cast<const char*>(data);
+        while(size)
+        {
+            size_t chunk = std::min(size, sizeof(mBuf) - mUsed);
+            memcpy(mBuf + mUsed, in, chunk);
+            mUsed += chunk;
+            in += chunk;
+            size -= chunk;
+            if(mUsed == sizeof(mBuf)) Drain();
+        }
+    }
+
+    bool Finish()
+    {
+        Drain();
+        return mOk && fdatasync(mFd) == 0;
+    }
+
+    void Drain()
+    {
+        size_t done = 0;
+        while(mOk && done < mUsed)
+        {
+            ssize_t written = write(mFd, mBuf + done, mUsed - done);
+            if(written < 0 && errno == EINTR) continue;
+            if(written <= 0) mOk = false;
+            else done += written;
+        }
+        mUsed = 0;
+    }
+
+    int mFd;
+    bool mOk = true;
+    size_t mUsed = 0;
+    char mBuf[1 << 16];
+};
+
+struct SnapshotReader
+{
+    SnapshotReader(const char* data, size_t size) : mPos(data), mEnd(data + size) {}
+
+    template<typename T>
+    inline bool Get(T& value)
+    {
+        if((size_t)(mEnd - mPos) < sizeof(T)) return false;
+        memcpy(&value, mPos, sizeof(T));
+        mPos += sizeof(T);
+        return true;
+    }
+
+    const char* mPos;
+    const char* mEnd;
+};
+
+inline void WriteSnapshotSide(SnapshotWriter& out, const EngineBook& book, bool isBid)
+{
+    const auto& pool = book.mMem.mOrderPool;
+    const auto& infos = book.mMem.mOrderInfoPool;
+    book.ForEachLevel(isBid, [&](int64_t price, const Level& level)
+    {
+        out.Put(SnapshotLevel{price, level.mOrders});
+        for(OrderLoc loc = level.mLead; loc != NULL_ORDER; loc = pool[loc].mNext)
+        {
+            const auto& info = infos[loc];
+            SnapshotOrder snap{loc, info.mClientId, info.mOrderId, pool[loc].mVolume, {}};
+            memcpy(snap.mVarText, book.mMem.mOrderExtraInfoPool[loc].mVarText, VAR_TEXT_SIZE);
+            out.Put(snap);
+            if(loc == level.mEnd) break;
+        }
+    });
+    out.Put(SnapshotLevel{0, 0});
+}
+
+// Slot generations, the free list and dropped levels shared by every book
+inline void WriteSnapshotPool(SnapshotWriter& out, const SharedBookMem& mem)
+{
+    out.Put(SnapshotPool{(uint32_t)mem.mOrderInfoPool.size(), (uint32_t)mem.mOrderFreeList.size(),
+        (uint32_t)mem.mDroppedLevels.size()});
+    for(size_t i = 0; i < mem.mOrderInfoPool.size(); ++i) out.Put(mem.mOrderInfoPool[i].mGeneration);
+    out.Write(mem.mOrderFreeList.data(), mem.mOrderFreeList.size() * sizeof(OrderLoc));
+
+    for(OrderLoc lead : mem.mDroppedLevels)
+    {
+        for(OrderLoc loc = lead; loc != NULL_ORDER; loc = mem.mOrderPool[loc].mNext) out.Put(loc);
+        out.Put(NULL_ORDER);
+    }
+}
+
+inline uint32_t CountClientOrders(const SharedBookMem& mem, const ClientOrderList& list)
+{
+    uint32_t orders = 0;
+    for(OrderLoc loc = list.mLead; loc != NULL_ORDER; loc = mem.mOrderInfoPool[loc].mClientNext) ++orders;
+    return orders;
+}
+
+inline void WriteClientOrderList(SnapshotWriter& out, const SharedBookMem& mem, const ClientOrderList& list)
+{
+    for(OrderLoc loc = list.mLead; loc != NULL_ORDER; loc = mem.mOrderInfoPool[loc].mClientNext) out.Put(loc);
+}
+
+// Client order lists of one book, in order so bulk deletes after a restore
+// report in the same order
+inline void WriteSnapshotClientOrders(SnapshotWriter& out, const EngineBook& book)
+{
+    const auto& mem = book.mMem;
+    for(const auto& orders : mem.mClientOrders)
+    {
+        if((orders.first >> 16) != book.mBookId) continue;
+        uint32_t bids = CountClientOrders(mem, orders.second.mBids);
+        uint32_t asks = CountClientOrders(mem, orders.second.mAsks);
+        if(!bids && !asks) continue;
+        out.Put(SnapshotClientOrders{(uint16_t)orders.first, bids, asks});
+        WriteClientOrderList(out, mem, orders.second.mBids);
+        WriteClientOrderList(out, mem, orders.second.mAsks);
+    }
+    out.Put(SnapshotClientOrders{0, 0, 0});
+}
+
+// State of every book, orders keep their slots so matching and id
+// allocation carry on exactly as they would have
+inline bool WriteSnapshot(const Engine& engine, int fd)
+{
+    SnapshotWriter out(fd);
+    JournalPosition position = engine.mJournal ? engine.mJournal->Position() : JournalPosition();
+    out.Put(SnapshotHeader{SNAPSHOT_MAGIC, SNAPSHOT_VERSION, engine.mLastOpId,
+        position.mSegment, position.mOffset, (uint32_t)engine.mBooks.size()});
+    WriteSnapshotPool(out, engine.mBookMem);
+
+    for(size_t i = 0; i < engine.mBooks.size(); ++i)
+    {
+        const auto& book = engine.mBooks[i];
+        out.Put(SnapshotBook{engine.mBookSeries[i], book.mBookId, book.mBehaviours, book.mTradeId});
+        WriteSnapshotSide(out, book, true);
+        WriteSnapshotSide(out, book, false);
+
+        for(const auto& quotes : book.mClientQuotes)
+        {
+            if(quotes.second.empty()) continue;
+            out.Put(SnapshotQuotes{quotes.first, (uint32_t)quotes.second.size()});
+            out.Write(quotes.second.data(), quotes.second.size() * sizeof(uint64_t));
+        }
+        out.Put(SnapshotQuotes{0, 0});
+        WriteSnapshotClientOrders(out, book);
+    }
+    return out.Finish();
+}
+
+inline bool LoadSnapshotSide(SnapshotReader& in, EngineBook& book, bool isBid)
+{
+    SnapshotLevel level;
+    while(in.Get(level))
+    {
+        if(!level.mOrders) return true;
+        for(uint32_t i = 0; i < level.mOrders; ++i)
+        {
+            SnapshotOrder order;
+            if(!in.Get(order) || order.mSlot == NULL_ORDER || order.mOrderId == NULL_ID ||
+                order.mSlot >= book.mMem.mOrderPool.size()) return false;
+            book.RestoreOrder(isBid, order.mSlot, order.mOrderId, order.mClientId, level.mPrice,
+                order.mVolume, order.mVarText);
+        }
+    }
+    return false;
+}
+
+inline bool LoadSnapshotPool(SnapshotReader& in, SharedBookMem& mem)
+{
+    SnapshotPool pool;
+    if(!in.Get(pool) || !pool.mSlots || pool.mSlots > MAX_ORDER_SLOTS || pool.mFree >= pool.mSlots) return false;
+
+    mem.mOrderPool.assign(pool.mSlots, Order());
+    mem.mOrderInfoPool.assign(pool.mSlots, OrderInfo());
+    mem.mOrderExtraInfoPool.resize(pool.mSlots);
+    for(uint32_t i = 0; i < pool.mSlots; ++i)
+    {
+        if(!in.Get(mem.mOrderInfoPool[i].mGeneration)) return false;
+    }
+    mem.mOrderFreeList.resize(pool.mFree);
+    for(auto& loc : mem.mOrderFreeList)
+    {
+        if(!in.Get(loc) || loc == NULL_ORDER || loc >= pool.mSlots) return false;
+    }
+    mem.mOrderFreeList.reserve(pool.mSlots);
+
+    mem.mDroppedLevels.clear();
+    for(uint32_t i = 0; i < pool.mDropped; ++i)
+    {
+        OrderLoc prev = NULL_ORDER;
+        OrderLoc loc = NULL_ORDER;
+        while(in.Get(loc) && loc != NULL_ORDER)
+        {
+            if(loc >= pool.mSlots) return false;
+            if(prev == NULL_ORDER) mem.mDroppedLevels.push_back(loc);
+            else mem.mOrderPool[prev].mNext = loc;
+            prev = loc;
+        }
+        if(loc != NULL_ORDER || prev == NULL_ORDER) return false;
+    }
+    return true;
+}
+
+// Relinks the client order lists of a book whose orders are restored
+inline bool LoadSnapshotClientOrders(SnapshotReader& in, EngineBook& book)
+{
+    auto& mem = book.mMem;
+    SnapshotClientOrders orders;
+    while(in.Get(orders))
+    {
+        if(!orders.mBids && !orders.mAsks) return true;
+        for(uint32_t i = 0; i < orders.mBids + orders.mAsks; ++i)
+        {
+            OrderLoc loc;
+            if(!in.Get(loc) || loc == NULL_ORDER || loc >= mem.mOrderInfoPool.size()) return false;
+            const auto& info = mem.mOrderInfoPool[loc];
+            if(info.mOrderId == NULL_ID || info.mBookId != book.mBookId || info.mClientId != orders.mClientId) return false;
+            mem.LinkClientOrder(loc, i < orders.mBids);
+        }
+    }
+    return false;
+}
+
+// Restores an initialised engine with no books. Returns false if the
+// snapshot is unreadable, with the engine reset and position untouched so
+// the whole journal can be replayed instead.
+inline bool LoadSnapshot(Engine& engine, const char* data, size_t size, JournalPosition& position)
+{
+    SnapshotReader in(data, size);
+    SnapshotHeader header;
+    if(!in.Get(header) || header.mMagic != SNAPSHOT_MAGIC || header.mVersion != SNAPSHOT_VERSION) return false;
+
+    NullEngineClient nullClient;
+    IEngineClient* client = engine.mClient;
+    engine.mClient = &nullClient;
+
+    bool ok = LoadSnapshotPool(in, engine.mBookMem);
+    for(uint32_t i = 0; ok && i < header.mBooks; ++i)
+    {
+        SnapshotBook snap;
+        if(!in.Get(snap))
+        {
+            ok = false;
+            break;
+        }
+
+        EngCreateBookReq req;
+        memset(&req, 0, sizeof(req));
+        req.mMsgId = EngMsgId::PART_BOOK_CREATE_REQ;
+        req.mSeries = snap.mSeries;
+        req.mBookId = snap.mBookId;
+        req.mBookBehaviours = snap.mBehaviours;
+        EngineBook* book = engine.CreateBook(req);
+        if(!book)
+        {
+            ok = false;
+            break;
+        }
+        book->mTradeId = snap.mTradeId;
+
+        ok = LoadSnapshotSide(in, *book, true) && LoadSnapshotSide(in, *book, false);
+        engine.QueueDepth(engine.mBooks.size() - 1);
+
+        SnapshotQuotes quotes;
+        while(ok && (ok = in.Get(quotes)) && quotes.mOrders)
+        {
+            auto& ids = book->mClientQuotes[quotes.mClientId];
+            ids.resize(quotes.mOrders);
+            for(auto& id : ids) ok = ok && in.Get(id);
+        }
+        ok = ok && LoadSnapshotClientOrders(in, *book);
+    }
+
+    engine.mClient = client;
+    if(!ok)
+    {
+        engine.Reset();
+        return false;
+    }
+    engine.mLastOpId = header.mLastOpId;
+    position = JournalPosition{header.mJournalSegment, header.mJournalOffset};
+    return true;
+}
+
+// Takes snapshots in a forked child so the matching thread only pays for the
+// fork, the child writes from its copy on write view of the engine. Files
+// are named snapshot.<ns since epoch> and only renamed into place once
+// complete, so the latest one present is always whole.
+//
+// While the child runs the matching thread also pays a copy of each pool
+// page it first writes, a whole 2MB one for hugetlb backed pools. Those
+// copies need free huge pages or the child dies part way with SIGBUS, so
+// no snapshot is taken unless enough are set aside to copy every pool
+// page (vm.nr_hugepages at least twice what the pools use).
+struct Snapshotter
+{
+    Snapshotter(const std::string& dir) : mDir(dir) {}
+
+    ~Snapshotter()
+    {
+        if(mChild > 0) waitpid(mChild, nullptr, 0);
+    }
+
+    // Call between operations on the thread that owns the engine. Returns
+    // false if the previous snapshot is still being written or too few huge
+    // pages are free
+    bool Take(const Engine& engine)
+    {
+        Reap();
+        if(mChild > 0) return false;
+        size_t hugePages = engine.mBookMem.HugePages();
+        if(hugePages && hugePages > UnreservedHugePages())
+        {
+            ++mNoHugePages;
+            return false;
+        }
+
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        uint64_t stamp = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+        std::string path = mDir + "/snapshot." + std::to_string(stamp);
+        std::string tmp = path + ".tmp";
+
+        pid_t pid = fork();
+        if(pid < 0)
+        {
+            ++mFailed;
+            return false;
+        }
+        if(pid == 0)
+        {
+            int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            bool ok = fd >= 0 && WriteSnapshot(engine, fd);
+            if(fd >= 0) close(fd);
+            _exit(ok && rename(tmp.c_str(), path.c_str()) == 0 ? 0 : 1);
+        }
+        mChild = pid;
+        ++mTaken;
+        return true;
+    }
+
+    // Non blocking, collects a finished child
+    void Reap()
+    {
+        if(mChild <= 0) return;
+        int status;
+        if(waitpid(mChild, &status, WNOHANG) == mChild)
+        {
+            if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) ++mFailed;
+            mChild = 0;
+        }
+    }
+
+    std::string Latest() const
+    {
+        std::string latest;
+        uint64_t latestStamp = 0;
+        DIR* dir = opendir(mDir.c_str());
+        if(!dir) return latest;
+        while(dirent* entry = readdir(dir))
+        {
+            uint64_t stamp;
+            char rest;
+            if(sscanf(entry->d_name, "snapshot.%" SCNu64 "%c", &stamp, &rest) == 1 && stamp > latestStamp)
+            {
+                latestStamp = stamp;
+                latest = mDir + "/" + entry->d_name;
+            }
+        }
+        closedir(dir);
+        return latest;
+    }
+
+    // Loads the latest snapshot into an initialised engine with no books.
+    // Returns false with position untouched and the engine still empty if
+    // there is none or it fails to load.
+    bool LoadLatest(Engine& engine, JournalPosition& position) const
+    {
+        std::string path = Latest();
+        if(path.empty()) return false;
+
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) return false;
+        struct stat st;
+        bool ok = false;
+        if(fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(data != MAP_FAILED)
+            {
+                ok = LoadSnapshot(engine, static_cast<const char*>(data), st.st_size, position);
+                munmap(data, st.st_size);
+            }
+        }
+        close(fd);
+        if(!ok) fprintf(stderr, "Failed to load snapshot %s\n", path.c_str());
+        return ok;
+    }
+
+    std::string mDir;
+    pid_t mChild = 0;
+    uint64_t mTaken = 0;
+    uint64_t mFailed = 0;
+    uint64_t mNoHugePages = 0;  // skipped, too few huge pages to copy the pools
+};
+
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace redheads
+{
+
+constexpr size_t CACHE_LINE_SIZE = 64;
+
+// Single producer single consumer ring of fixed size T slots. The producer
+// writes in place into Back() and publishes with Push(), the consumer reads
+// in place from Front() and hands the slot back with Pop().
+template<typename T>
+struct SpscRing
+{
+    SpscRing(size_t capacity)
+    : mMask(capacity-1)
+    {
+        assert(capacity && ((capacity & mMask) == 0) && "Capacity must be a power of two");
+        void* mem = nullptr;
+        if(posix_memalign(&mem, CACHE_LINE_SIZE, capacity*sizeof(T)) != 0) throw std::bad_alloc();
+        mSlots = static_cast<T*>(mem);
+        for(size_t i = 0; i < capacity; ++i) new(&mSlots[i]) T();
+    }
+
+    ~SpscRing()
+    {
+        for(size_t i = 0; i <= mMask; ++i) mSlots[i].~T();
+        free(mSlots);
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // Producer side, nullptr when full
+    inline T* Back()
+    {
+        size_t head = mHead.load(std::memory_order_relaxed);
+        if(head - mCachedTail > mMask)
+        {
+            mCachedTail = mTail.load(std::memory_order_acquire);
+            if(head - mCachedTail > mMask) return nullptr;
+        }
+        return &mSlots[head & mMask];
+    }
+
+    inline void Push()
+    {
+        mHead.store(mHead.load(std::memory_order_relaxed)+1, std::memory_order_release);
+    }
+
+    // Consumer side, nullptr when empty
+    inline T* Front()
+    {
+        size_t tail = mTail.load(std::memory_order_relaxed);
+        if(tail == mCachedHead)
+        {
+            mCachedHead = mHead.load(std::memory_order_acquire);
+            if(tail == mCachedHead) return nullptr;
+        }
+        return &mSlots[tail & mMask];
+    }
+
+    inline void Pop(size_t count=1)
+    {
+        mTail.store(mTail.load(std::memory_order_relaxed)+count, std::memory_order_release);
+    }
+
+    // Consumer side, slots ready to read starting from Front()
+    inline size_t Size()
+    {
+        mCachedHead = mHead.load(std::memory_order_acquire);
+        return mCachedHead - mTail.load(std::memory_order_relaxed);
+    }
+
+    // Consumer side, index of Front() in mSlots
+    inline size_t FrontIndex() const
+    {
+        return mTail.load(std::memory_order_relaxed) & mMask;
+    }
+
+    inline bool Empty() const
+    {
+        return mTail.load(std::memory_order_acquire) == mHead.load(std::memory_order_acquire);
+    }
+
+    // Padded rather than aligned so rings can live in plain heap objects
+    const size_t mMask;
+    T* mSlots;
+    char mPad0[CACHE_LINE_SIZE];
+
+    std::atomic<size_t> mHead{0};
+    size_t mCachedTail = 0;
+    char mPad1[CACHE_LINE_SIZE];
+
+    std::atomic<size_t> mTail{0};
+    size_t mCachedHead = 0;
+    char mPad2[CACHE_LINE_SIZE];
+};
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+
+namespace redheads
+{
+
+constexpr int NO_CORE = -1;
+
+inline void CpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Returns false if the thread could not be pinned
+inline bool PinThread(pthread_t thread, int core)
+{
+    if(core == NO_CORE) return true;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    return pthread_setaffinity_np(thread, sizeof(cpus), &cpus) == 0;
+}
+
+// SCHED_FIFO at priority, 0 leaves the thread's policy alone. Returns false
+// if the thread could not be made real time, usually for lack of
+// CAP_SYS_NICE or an RLIMIT_RTPRIO.
+inline bool SetRealtime(pthread_t thread, int priority)
+{
+    if(priority <= 0) return true;
+    sched_param param;
+    param.sched_priority = priority;
+    return pthread_setschedparam(thread, SCHED_FIFO, &param) == 0;
+}
+
+}
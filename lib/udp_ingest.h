@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <vector>
+#include <sys/socket.h>
+
+#include "latency.h"
+
+namespace redheads
+{
+
+struct UdpIngestStats
+{
+    UdpIngestStats(size_t batchSize) : mBatchHist(batchSize+1, 0) {}
+
+    void Dump(FILE* out) const
+    {
+        fprintf(out, "ingest syscalls %lu datagrams %lu empty %lu truncated %lu avg/syscall %.2f\n",
+            mSyscalls, mDatagrams, mEmpty, mTruncated,
+            mSyscalls ? (double)mDatagrams / mSyscalls : 0.0);
+        for(size_t i = 1; i < mBatchHist.size(); ++i)
+        {
+            if(mBatchHist[i]) fprintf(out, "  %3zu datagrams/syscall %lu\n", i, mBatchHist[i]);
+        }
+    }
+
+    uint64_t mSyscalls = 0;
+    uint64_t mDatagrams = 0;
+    uint64_t mEmpty = 0;
+    uint64_t mTruncated = 0;
+    std::vector<uint64_t> mBatchHist; // syscalls by datagrams returned
+};
+
+// Receives datagrams with recvmmsg straight into a ring of preallocated
+// buffers. Every slot's mmsghdr is built once up front so a poll is a
+// single syscall over the next contiguous run of slots.
+struct UdpIngest
+{
+    static constexpr size_t CONTROL_SIZE = CMSG_SPACE(sizeof(timespec));
+
+    UdpIngest(int fd, size_t batchSize, size_t ringDepth, size_t bufSize)
+    : mFd(fd)
+    , mBatchSize(std::min(batchSize, ringDepth))
+    , mDepth(ringDepth)
+    , mBufSize((bufSize + 63) & ~size_t(63))
+    , mMsgs(ringDepth)
+    , mIovs(ringDepth)
+    , mStats(mBatchSize)
+    {
+        void* mem = nullptr;
+        if(posix_memalign(&mem, 64, mDepth*mBufSize) != 0) throw std::bad_alloc();
+        mBufs = static_cast<char*>(mem);
+
+        for(size_t i = 0; i < mDepth; ++i)
+        {
+            mIovs[i].iov_base = mBufs + i*mBufSize;
+            mIovs[i].iov_len = bufSize;
+            mMsgs[i] = mmsghdr();
+            mMsgs[i].msg_hdr.msg_iov = &mIovs[i];
+            mMsgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    ~UdpIngest()
+    {
+        free(mBufs);
+    }
+
+    UdpIngest(const UdpIngest&) = delete;
+    UdpIngest& operator=(const UdpIngest&) = delete;
+
+    // Has the kernel stamp datagrams on arrival. Each poll that receives
+    // keeps the first datagram's stamp in mFirstRxNs and its own time in
+    // mPollNs, both realtime clock.
+    bool EnableRxTimestamps()
+    {
+        int on = 1;
+        if(setsockopt(mFd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) != 0) return false;
+        mControl.assign(mDepth*CONTROL_SIZE/sizeof(uint64_t), 0);
+        for(size_t i = 0; i < mDepth; ++i)
+        {
+            mMsgs[i].msg_hdr.msg_control = reinterpret_cast<char*>(mControl.data()) + i*CONTROL_SIZE;
+        }
+        mRxTimestamps = true;
+        return true;
+    }
+
+    // Receives up to one batch and passes each datagram to handler in place.
+    // Returns datagrams received, 0 when the socket is drained or -1 on error
+    template<typename H>
+    int Poll(H&& handler)
+    {
+        size_t count = std::min(mBatchSize, mDepth - mPos);
+        if(mRxTimestamps)
+        {
+            for(size_t i = mPos; i < mPos + count; ++i) mMsgs[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+        }
+        int received = recvmmsg(mFd, &mMsgs[mPos], count, MSG_DONTWAIT, nullptr);
+        RH_LATENCY(mPollTsc = Tsc());
+        ++mStats.mSyscalls;
+        if(received <= 0)
+        {
+            if(received < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            ++mStats.mEmpty;
+            return 0;
+        }
+
+        mStats.mDatagrams += received;
+        ++mStats.mBatchHist[received];
+        if(mRxTimestamps)
+        {
+            mPollNs = RealtimeNs();
+            mFirstRxNs = RxTimestamp(mMsgs[mPos].msg_hdr);
+        }
+        for(int i = 0; i < received; ++i)
+        {
+            const auto& msg = mMsgs[mPos+i];
+            if(msg.msg_hdr.msg_flags & MSG_TRUNC)
+            {
+                ++mStats.mTruncated;
+                continue;
+            }
+            handler(static_cast<const char*>(mIovs[mPos+i].iov_base), (size_t)msg.msg_len);
+        }
+        mPos = (mPos + received) % mDepth;
+        return received;
+    }
+
+    static inline uint64_t RealtimeNs()
+    {
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        return now.tv_sec * 1000000000ull + now.tv_nsec;
+    }
+
+    // Kernel receive stamp of the datagram or 0 when it has none
+    static inline uint64_t RxTimestamp(msghdr& hdr)
+    {
+        for(cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+        {
+            if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+            {
+                timespec stamp;
+                memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+                return stamp.tv_sec * 1000000000ull + stamp.tv_nsec;
+            }
+        }
+        return 0;
+    }
+
+    int mFd;
+    const size_t mBatchSize;
+    const size_t mDepth;
+    const size_t mBufSize;
+    size_t mPos = 0;
+    char* mBufs;
+    std::vector<mmsghdr> mMsgs;
+    std::vector<iovec> mIovs;
+    UdpIngestStats mStats;
+    std::vector<uint64_t> mControl; // a CONTROL_SIZE slice per slot when timestamping
+    bool mRxTimestamps = false;
+    uint64_t mFirstRxNs = 0;
+    uint64_t mPollNs = 0;
+    RH_LATENCY(uint64_t mPollTsc = 0;) // receive stamp of the datagrams being handled
+};
+
+}
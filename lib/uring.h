@@ -0,0 +1,447 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "latency.h"
+#include "publisher.h"
+#include "thread.h"
+#include "udp_ingest.h"
+
+namespace redheads
+{
+
+// Submission and completion rings of one io_uring, set up with the raw
+// syscalls. Only the thread owning it may submit or reap.
+struct IoUring
+{
+    IoUring() = default;
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring()
+    {
+        if(mSqes) munmap(mSqes, mSqesSize);
+        if(mCqMap && mCqMap != mSqMap) munmap(mCqMap, mCqMapSize);
+        if(mSqMap) munmap(mSqMap, mSqMapSize);
+        if(mFd >= 0) close(mFd);
+    }
+
+    // False when the kernel has no io_uring or refuses it, errno is kept
+    bool Init(unsigned entries, unsigned cqEntries=0)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        if(cqEntries)
+        {
+            params.flags |= IORING_SETUP_CQSIZE;
+            params.cq_entries = cqEntries;
+        }
+        mFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if(mFd < 0) return false;
+
+        mSqMapSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+        mCqMapSize = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if(single) mSqMapSize = mCqMapSize = std::max(mSqMapSize, mCqMapSize);
+
+        mSqMap = Map(mSqMapSize, IORING_OFF_SQ_RING);
+        mCqMap = single ? mSqMap : Map(mCqMapSize, IORING_OFF_CQ_RING);
+        mSqesSize = params.sq_entries*sizeof(io_uring_sqe);
+        mSqes = static_cast<io_uring_sqe*>(Map(mSqesSize, IORING_OFF_SQES));
+        if(!mSqMap || !mCqMap || !mSqes) return false;
+
+        char* sq = static_cast<char*>(mSqMap);
+        char* cq = static_cast<char*>(mCqMap);
+        mSqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        mSqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        mSqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        mSqEntries = params.sq_entries;
+        unsigned* sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        for(unsigned i = 0; i < mSqEntries; ++i) sqArray[i] = i;
+        mCqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        mCqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        mCqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        mCqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        mLocalTail = *mSqTail;
+        return true;
+    }
+
+    void* Map(size_t size, off_t offset)
+    {
+        void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, offset);
+        return map == MAP_FAILED ? nullptr : map;
+    }
+
+    inline int Register(unsigned opcode, const void* arg, unsigned args)
+    {
+        return (int)syscall(__NR_io_uring_register, mFd, opcode, arg, args);
+    }
+
+    // Next cleared submission entry, nullptr when the ring is full
+    inline io_uring_sqe* GetSqe()
+    {
+        unsigned head = __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+        if(mLocalTail - head >= mSqEntries) return nullptr;
+        io_uring_sqe* sqe = &mSqes[mLocalTail & mSqMask];
+        ++mLocalTail;
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // Submits everything queued and waits for minComplete completions, one
+    // syscall. Returns entries submitted or -errno. Entries the kernel did
+    // not take stay queued for the next call, and it only waits once it has
+    // taken them all, so minComplete may count entries still queued.
+    inline int Submit(unsigned minComplete=0)
+    {
+        __atomic_store_n(mSqTail, mLocalTail, __ATOMIC_RELEASE);
+        unsigned toSubmit = mLocalTail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+        if(!toSubmit && !minComplete) return 0;
+        ++mEnters;
+        int ret = (int)syscall(__NR_io_uring_enter, mFd, toSubmit, minComplete,
+            minComplete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        return ret < 0 ? -errno : ret;
+    }
+
+    // Takes back entries the kernel has not taken, returns how many
+    inline unsigned Unqueue()
+    {
+        unsigned head = __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+        unsigned dropped = mLocalTail - head;
+        mLocalTail = head;
+        __atomic_store_n(mSqTail, mLocalTail, __ATOMIC_RELEASE);
+        return dropped;
+    }
+
+    // Oldest ready completion, left in the ring, nullptr when there is none
+    inline const io_uring_cqe* Peek() const
+    {
+        unsigned head = *mCqHead;
+        if(head == __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE)) return nullptr;
+        return &mCqes[head & mCqMask];
+    }
+
+    // Calls f on up to max ready completions and returns how many there were
+    template<typename F>
+    inline unsigned Reap(F&& f, unsigned max=~0u)
+    {
+        unsigned head = *mCqHead;
+        unsigned tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+        unsigned count = std::min(tail - head, max);
+        for(unsigned i = 0; i < count; ++i) f(mCqes[(head + i) & mCqMask]);
+        __atomic_store_n(mCqHead, head + count, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    int mFd = -1;
+    void* mSqMap = nullptr;
+    void* mCqMap = nullptr;
+    size_t mSqMapSize = 0;
+    size_t mCqMapSize = 0;
+    io_uring_sqe* mSqes = nullptr;
+    size_t mSqesSize = 0;
+    unsigned* mSqHead = nullptr;
+    unsigned* mSqTail = nullptr;
+    unsigned mSqMask = 0;
+    unsigned mSqEntries = 0;
+    unsigned mLocalTail = 0;      // queued with GetSqe
+    unsigned* mCqHead = nullptr;
+    unsigned* mCqTail = nullptr;
+    unsigned mCqMask = 0;
+    io_uring_cqe* mCqes = nullptr;
+    uint64_t mEnters = 0;
+};
+
+// Receives datagrams with a single multishot recv into a ring of buffers
+// registered with the kernel, so a steady stream costs no syscalls: each
+// datagram is a completion naming the buffer it landed in, and the buffer
+// goes back to the kernel once handled. Poll matches UdpIngest::Poll.
+struct UringIngest
+{
+    static constexpr uint16_t BUFFER_GROUP = 0;
+
+    UringIngest(int fd, size_t batchSize, size_t ringDepth, size_t bufSize)
+    : mFd(fd)
+    , mBatchSize(std::min(batchSize, ringDepth))
+    , mDepth(RoundUpPow2(ringDepth))
+    , mMaxSize(bufSize)
+    , mBufSize((bufSize + 64) & ~size_t(63))
+    , mStats(mBatchSize)
+    {
+    }
+
+    ~UringIngest()
+    {
+        if(mBufRing) munmap(mBufRing, mBufRingSize);
+        free(mBufs);
+    }
+
+    UringIngest(const UringIngest&) = delete;
+    UringIngest& operator=(const UringIngest&) = delete;
+
+    static size_t RoundUpPow2(size_t value)
+    {
+        size_t pow2 = 1;
+        while(pow2 < value) pow2 <<= 1;
+        return pow2;
+    }
+
+    // False when the kernel lacks io_uring, provided buffer rings (5.19) or
+    // multishot receive (6.0), the caller then falls back to UdpIngest
+    bool Init()
+    {
+        if(mDepth > 32768 || !mRing.Init(8, 2*mDepth)) return false;
+
+        void* mem = nullptr;
+        if(posix_memalign(&mem, 64, mDepth*mBufSize) != 0) return false;
+        mBufs = static_cast<char*>(mem);
+
+        mBufRingSize = (mDepth*sizeof(io_uring_buf) + SMALL_PAGE_SIZE - 1) & ~(SMALL_PAGE_SIZE - 1);
+        void* ring = mmap(nullptr, mBufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(ring == MAP_FAILED) return false;
+        mBufRing = static_cast<io_uring_buf_ring*>(ring);
+
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = reinterpret_cast<uint64_t>(mBufRing);
+        reg.ring_entries = mDepth;
+        reg.bgid = BUFFER_GROUP;
+        if(mRing.Register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return false;
+
+        for(size_t i = 0; i < mDepth; ++i) Recycle(i);
+        PublishBuffers();
+        if(!Arm()) return false;
+
+        // A kernel without multishot receive fails the recv as it is
+        // submitted, its completion is already posted
+        const io_uring_cqe* cqe = mRing.Peek();
+        return !cqe || cqe->res >= 0;
+    }
+
+    // Ring fd, readable whenever completions are waiting
+    inline int WaitFd() const { return mRing.mFd; }
+
+    inline void Recycle(size_t bid)
+    {
+        // Not mBufRing->bufs, in C++ the header's flexible array member
+        // starts past the ring's first entry
+        io_uring_buf& buf = reinterpret_cast<io_uring_buf*>(mBufRing)[(mBufTail + mRecycled) & (mDepth - 1)];
+        buf.addr = reinterpret_cast<uint64_t>(mBufs + bid*mBufSize);
+        buf.len = mBufSize;
+        buf.bid = bid;
+        ++mRecycled;
+    }
+
+    inline void PublishBuffers()
+    {
+        mBufTail += mRecycled;
+        mRecycled = 0;
+        __atomic_store_n(&mBufRing->tail, mBufTail, __ATOMIC_RELEASE);
+    }
+
+    bool Arm()
+    {
+        io_uring_sqe* sqe = mRing.GetSqe();
+        if(!sqe) return false;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = mFd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP;
+        ++mStats.mSyscalls;
+        ++mArms;
+        return mRing.Submit() == 1;
+    }
+
+    // Hands up to one batch of received datagrams to handler in place.
+    // Returns datagrams received, 0 when none are waiting or -1 on error
+    template<typename H>
+    int Poll(H&& handler)
+    {
+        bool rearm = false;
+        int error = 0;
+        int received = 0;
+        mRing.Reap([&](const io_uring_cqe& cqe)
+        {
+            if(!(cqe.flags & IORING_CQE_F_MORE)) rearm = true;
+            if(cqe.res < 0)
+            {
+                // Out of buffers only stops the multishot, rearming resumes it
+                if(cqe.res != -ENOBUFS) error = cqe.res;
+                return;
+            }
+            size_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            // Buffers are a byte longer than any datagram handled
+            if((size_t)cqe.res > mMaxSize) ++mStats.mTruncated;
+            else handler(mBufs + bid*mBufSize, (size_t)cqe.res);
+            Recycle(bid);
+            ++received;
+        }, mBatchSize);
+        RH_LATENCY(mPollTsc = Tsc());
+
+        if(mRecycled) PublishBuffers();
+        if(rearm && !Arm()) return -1;
+        if(error) return -1;
+        if(!received)
+        {
+            ++mStats.mEmpty;
+            return 0;
+        }
+        mStats.mDatagrams += received;
+        ++mStats.mBatchHist[received];
+        return received;
+    }
+
+    int mFd;
+    const size_t mBatchSize;
+    const size_t mDepth;
+    const size_t mMaxSize;
+    const size_t mBufSize;
+    IoUring mRing;
+    char* mBufs = nullptr;
+    io_uring_buf_ring* mBufRing = nullptr;
+    size_t mBufRingSize = 0;
+    uint16_t mBufTail = 0;
+    uint16_t mRecycled = 0;
+    uint64_t mArms = 0;
+    UdpIngestStats mStats;      // syscalls are submissions, normally only rearming
+    uint64_t mFirstRxNs = 0;    // no kernel stamps on this path
+    uint64_t mPollNs = 0;
+    RH_LATENCY(uint64_t mPollTsc = 0;)
+};
+
+// MdPublisher with the sends made through io_uring. Each run of ready
+// packets becomes one send per packet per feed, all submitted and waited
+// for with a single syscall. The packet ring is registered with the kernel
+// so sends read it without pinning pages each time.
+struct UringPublisher
+{
+    UringPublisher(int sockFdA, int sockFdB, size_t ringSize, int core=NO_CORE)
+    : mRing(ringSize)
+    , mCore(core)
+    , mFeedFds{sockFdA, sockFdB}
+    {
+    }
+
+    ~UringPublisher()
+    {
+        Stop();
+    }
+
+    // False when the kernel has no io_uring, the caller then falls back to
+    // MdPublisher. Registering the ring is optional, it counts against
+    // RLIMIT_MEMLOCK and without it plain sends are used.
+    bool Init()
+    {
+        if(!mUring.Init(2*MAX_MD_SEND_BATCH)) return false;
+        iovec iov{mRing.mSlots, (mRing.mMask + 1)*sizeof(MdPacket)};
+        mFixed = mUring.Register(IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+        return true;
+    }
+
+    void Start()
+    {
+        mRunning.store(true, std::memory_order_release);
+        mThread = std::thread([this]{ Run(); });
+        if(!PinThread(mThread.native_handle(), mCore))
+        {
+            fprintf(stderr, "Failed to pin publisher to core %d\n", mCore);
+        }
+    }
+
+    void Stop()
+    {
+        mRunning.store(false, std::memory_order_release);
+        if(mThread.joinable()) mThread.join();
+    }
+
+    void Run()
+    {
+        while(mRunning.load(std::memory_order_acquire) || !mRing.Empty())
+        {
+            if(!SendReady()) CpuRelax();
+        }
+    }
+
+    size_t SendReady()
+    {
+        size_t ready = mRing.Size();
+        if(!ready) return 0;
+
+        size_t first = mRing.FrontIndex();
+        size_t count = std::min(std::min(ready, MAX_MD_SEND_BATCH), mRing.mMask + 1 - first);
+        for(size_t i = first; i < first + count; ++i)
+        {
+            for(int fd : mFeedFds)
+            {
+                io_uring_sqe* sqe = mUring.GetSqe();
+                sqe->fd = fd;
+                sqe->addr = reinterpret_cast<uint64_t>(mRing.mSlots[i].mData);
+                sqe->len = mRing.mSlots[i].mSize;
+                if(mFixed)
+                {
+                    // A connected datagram socket sends one datagram per write
+                    sqe->opcode = IORING_OP_WRITE_FIXED;
+                    sqe->buf_index = 0;
+                }
+                else
+                {
+                    sqe->opcode = IORING_OP_SEND;
+                }
+            }
+        }
+
+        // Completions still to come, of sends in flight or still queued
+        unsigned pending = 2*count;
+        int ret = mUring.Submit(pending);
+        while(pending)
+        {
+            pending -= mUring.Reap([&](const io_uring_cqe& cqe)
+            {
+                // Dropped on this feed only, consumers recover it from the other
+                if(cqe.res < 0) ++mSendErrors;
+            }, pending);
+            if(!pending) break;
+            if(ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY)
+            {
+                // Sends never taken are dropped, those in flight still read
+                // the packets so are waited for
+                unsigned dropped = mUring.Unqueue();
+                mSendErrors += dropped;
+                pending -= dropped;
+                if(!pending) break;
+            }
+            ret = mUring.Submit(pending);
+        }
+        mRing.Pop(count);
+        mPackets += count;
+        ++mBatches;
+        return count;
+    }
+
+    MdPacketRing mRing;
+    int mCore;
+    int mFeedFds[2];
+    IoUring mUring;
+    bool mFixed = false;
+    std::atomic<bool> mRunning{false};
+    std::thread mThread;
+    uint64_t mPackets = 0;
+    uint64_t mBatches = 0;
+    uint64_t mSendErrors = 0;
+};
+
+}
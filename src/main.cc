@@ -9,23 +9,123 @@
 #include <unistd.h>         // for close()
 #include <fcntl.h>          // for fcntl()
 #include <errno.h>
+#include <signal.h>
 #include <sys/epoll.h>
 
 #include "../lib/engine.h"
+#include "../lib/idle.h"
+#include "../lib/pipeline.h"
+#include "../lib/publisher.h"
+#include "../lib/recovery.h"
+#include "../lib/snapshot.h"
+#include "../lib/udp_ingest.h"
+#include "../lib/uring.h"
 
-#define MAX_EVENTS 100
+using namespace redheads;
 
-#define BUFFSIZE 2042
+#define BUFFSIZE MAX_MSG_SIZE
+
+#define DEFAULT_RECV_BATCH 32
+#define DEFAULT_RECV_RING 1024
+#define DEFAULT_PUB_RING 4096
 
 #define LOG_ERROR(__X) \
     do {fprintf(stderr, __X); fprintf(stderr, "\n"); } while(0);
 
-unsigned char IN_BUF[BUFFSIZE];
+volatile sig_atomic_t STOP = 0;
+volatile sig_atomic_t SNAPSHOT = 0;
+volatile sig_atomic_t LATENCY = 0;
 
 void usage()
 {
-    printf("redheads -l LISTEN_PORT -a PUB_MULTICAST_ADDR_A:PORT -b PUB_MULTICAST_ADDR_B:PORT");
-    exit();
+    printf("redheads -l LISTEN_PORT -a PUB_MULTICAST_ADDR_A:PORT -b PUB_MULTICAST_ADDR_B:PORT "
+        "[-n RECV_BATCH] [-r RECV_RING_DEPTH] [-p DECODE_CORE,MATCH_CORE,PUBLISH_CORE] "
+        "[-j JOURNAL_DIR] [-f message|batch|async] [-S SNAPSHOT_DIR] [-s SNAPSHOT_SECONDS] "
+        "[-L LATENCY_DUMP_SECONDS] [-i spin|yield|block] [-B BUSY_POLL_USECS] [-c MATCH_CORE] "
+        "[-R RT_PRIORITY] [-u] [-D] [-e RECOVERY_SOCKET]\n"
+        "  -i what the matching loop does when idle, block waits in epoll\n"
+        "  -c pins the single threaded matching loop, -p pins pipeline stages\n"
+        "  -R runs the matching thread SCHED_FIFO at RT_PRIORITY\n"
+        "  -u receives and publishes through io_uring, falling back to epoll without it\n"
+        "  -D publishes conflated depth in place of per order insert, delete and amend updates\n"
+        "  -e serves book images to late joiners on the unix socket RECOVERY_SOCKET\n");
+    exit(1);
+}
+
+void stop(int)
+{
+    STOP = 1;
+}
+
+void snapshot(int)
+{
+    SNAPSHOT = 1;
+}
+
+void latency(int)
+{
+    LATENCY = 1;
+}
+
+/* Latest snapshot first, then the journal written after it */
+void restore(Engine& engine, Journal& journal, const JournalConfig& journalConfig, const Snapshotter& snapshotter)
+{
+    JournalPosition position;
+    if(!snapshotter.mDir.empty() && snapshotter.LoadLatest(engine, position))
+    {
+        printf("restored %zu books from snapshot\n", engine.mBooks.size());
+    }
+    if(!journalConfig.mDir.empty())
+    {
+        printf("recovered %zu operations\n", engine.Recover(journal, position));
+    }
+}
+
+bool snapshot_due(time_t& next, int interval)
+{
+    time_t now = time(nullptr);
+    if(!SNAPSHOT && (interval <= 0 || now < next)) return false;
+    SNAPSHOT = 0;
+    next = now + interval;
+    return true;
+}
+
+bool latency_due(time_t& next, int interval)
+{
+    time_t now = time(nullptr);
+    if(!LATENCY && (interval <= 0 || now < next)) return false;
+    LATENCY = 0;
+    next = now + interval;
+    return true;
+}
+
+// Parses ADDR:PORT into host order address and port
+void parse_addr(const char* arg, int& addr, int& port)
+{
+    unsigned a, b, c, d;
+    if(sscanf(arg, "%u.%u.%u.%u:%d", &a, &b, &c, &d, &port) != 5) usage();
+    addr = (a << 24) | (b << 16) | (c << 8) | d;
+}
+
+/* Edge triggered epoll on fd for the blocking idle strategy */
+int make_epoll(int fd)
+{
+    int epollFd = epoll_create(1);
+    if(epollFd == -1)
+    {
+        LOG_ERROR("creating epoll failed");
+        exit(1);
+    }
+
+    struct epoll_event ev;
+    ev.data.fd = fd;
+    ev.events = EPOLLIN | EPOLLET;
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+        LOG_ERROR("epoll_ctl");
+        exit(1);
+    }
+    return epollFd;
 }
 
 void make_socket_non_blocking(int sockFd)
@@ -37,7 +137,7 @@ void make_socket_non_blocking(int sockFd)
     if(getFlag == -1)
     {
         LOG_ERROR("Cannot read socket settings");
-        exit();
+        exit(1);
     }
 
     /* Set the Flag as Non Blocking Socket */
@@ -48,56 +148,244 @@ void make_socket_non_blocking(int sockFd)
     if(setFlag == -1)
     {
         LOG_ERROR("Cannot set socket settings");
-        exit();
+        exit(1);
     }
 }
 
-int main()
+/* Single threaded matching loop, sends happen on the publisher thread.
+ * The ingest is a UdpIngest or UringIngest and the publisher an MdPublisher
+ * or UringPublisher, either way requests take the same engine path. The
+ * blocking idle strategy waits on waitFd.
+ */
+template<typename I, typename P>
+void run(I& ingest, P& publisher, int waitFd, const IdleConfig& idleConfig, Journal& journal,
+    const JournalConfig& journalConfig, Snapshotter& snapshotter, int snapshotInterval, int latencyInterval,
+    bool orderUpdates, const std::string& recoveryPath)
 {
-    int length;
+    time_t nextSnapshot = time(nullptr) + snapshotInterval;
+    RH_LATENCY(time_t nextLatency = time(nullptr) + latencyInterval;)
+
+    MdEncoder encoder(publisher.mRing);
+    encoder.mOrderUpdates = orderUpdates;
+    publisher.Start();
+
+    Engine engine(encoder);
+    engine.Init(1000, 100000, 500);
+    restore(engine, journal, journalConfig, snapshotter);
+
+    /* Started before pinning so serving images never competes with matching */
+    std::unique_ptr<RecoveryImages> images;
+    std::unique_ptr<RecoveryServer> recovery;
+    if(!recoveryPath.empty())
+    {
+        images.reset(new RecoveryImages());
+        recovery.reset(new RecoveryServer(*images, recoveryPath));
+        if(!recovery->Start())
+        {
+            LOG_ERROR("Failed to listen on the recovery socket");
+            recovery.reset();
+            images.reset();
+        }
+    }
+
+    /* Threads started from here on inherit the matching thread's pinning */
+    if(!PinThread(pthread_self(), idleConfig.mCore)) LOG_ERROR("Failed to pin matching thread");
+    if(!SetRealtime(pthread_self(), idleConfig.mRtPriority)) LOG_ERROR("Failed to make matching thread real time");
+    IdleStrategy idle(idleConfig, waitFd);
+
+    while(!STOP)
+    {
+        if(!snapshotter.mDir.empty() && snapshot_due(nextSnapshot, snapshotInterval))
+        {
+            snapshotter.Take(engine);
+        }
+        RH_LATENCY(if(latency_due(nextLatency, latencyInterval)) engine.mLatency.Dump(stdout));
+
+        /* Each datagram is handled in place in the ring */
+        int received = ingest.Poll([&](const char* buf, size_t length)
+        {
+            RH_LATENCY(engine.mLatency.Receive(ingest.mPollTsc));
+            engine.HandleMsg(buf, length);
+        });
+        if(received > 0)
+        {
+            engine.EndBatch();
+            encoder.EndBatch();
+            RH_LATENCY(engine.mLatency.Publish());
+            idle.Work(ingest);
+            continue;
+        }
+        if(received < 0)
+        {
+            LOG_ERROR("receive failed");
+            break;
+        }
+
+        /* Drained, reclaim memory and refresh recovery images before
+        * idling. Images are taken here so they match the last packet
+        * published. The wait fd is edge triggered so blocking is only safe
+        * once a poll came back empty.
+        */
+        if(engine.Idle()) continue;
+        if(images && images->Refresh(engine, encoder.mSequence)) continue;
+        idle.Idle();
+    }
+
+    publisher.Stop();
+    if(recovery)
+    {
+        recovery->Stop();
+        recovery->Dump(stdout);
+    }
+    ingest.mStats.Dump(stdout);
+    RH_LATENCY(engine.mLatency.Dump(stdout));
+    printf("published packets %lu batches %lu send errors %lu encoder stalls %lu\n",
+        publisher.mPackets, publisher.mBatches, publisher.mSendErrors, encoder.mStalls);
+    printf("reclaimed slots %lu immediate cleanups %lu malformed requests %lu\n", engine.mReclaimed,
+        engine.mImmediateCleanups, engine.mMalformed);
+    idle.Dump(stdout);
+    close(waitFd);
+}
 
+int main(int argc, char* argv[])
+{
+    int c;
     int sockFdRecv, sockFdBrdA, sockFdBrdB;
     int optval = 1; 
 
     struct sockaddr_in recvAddr, brdAddrA, brdAddrB;
 
-    int epollFd;      
-    struct epoll_event ev;                  
-    struct epoll_event events[MAX_EVENTS];               
-
     int listenPort = 0;
     int publishAddrA = 0;
     int publishAddrB = 0;
     int publishPortA = 0;
     int publishPortB = 0;
+    size_t recvBatch = DEFAULT_RECV_BATCH;
+    size_t recvRing = DEFAULT_RECV_RING;
+    bool pipelined = false;
+    PipelineConfig pipelineConfig;
+    IdleConfig idleConfig;
+    JournalConfig journalConfig;
+    std::string snapshotDir;
+    int snapshotInterval = 0;
+    int latencyInterval = 0;
+    bool uring = false;
+    bool orderUpdates = true;
+    std::string recoveryPath;
 
     opterr = 0;
 
-    while ((c = getopt (argc, argv, "l:a:b:")) != -1)
+    while ((c = getopt (argc, argv, "l:a:b:n:r:p:j:f:S:s:L:i:B:c:R:uDe:")) != -1)
     {
         switch (c)
         {
             case 'l':
             {
-                int a,b,c,d,port;
-                sscanf(optarg, "%d.%d.%d.%d:%d", a,b,c,d,port);
                 listenPort = atoi(optarg);
             }
             break;
             case 'a':
             {
-                publishPortA = atoi(optarg);
+                parse_addr(optarg, publishAddrA, publishPortA);
             }
             break;
             case 'b':
             {
-                publishPortB = atoi(optarg);
+                parse_addr(optarg, publishAddrB, publishPortB);
+            }
+            break;
+            case 'n':
+            {
+                recvBatch = atoi(optarg);
+            }
+            break;
+            case 'r':
+            {
+                recvRing = atoi(optarg);
+            }
+            break;
+            case 'p':
+            {
+                if(sscanf(optarg, "%d,%d,%d", &pipelineConfig.mDecodeCore, 
+                    &pipelineConfig.mMatchCore, &pipelineConfig.mPublishCore) != 3) usage();
+                pipelined = true;
+            }
+            break;
+            case 'j':
+            {
+                journalConfig.mDir = optarg;
+            }
+            break;
+            case 'f':
+            {
+                if(strcmp(optarg, "message") == 0) journalConfig.mFlush = JournalFlush::PER_MESSAGE;
+                else if(strcmp(optarg, "batch") == 0) journalConfig.mFlush = JournalFlush::PER_BATCH;
+                else if(strcmp(optarg, "async") == 0) journalConfig.mFlush = JournalFlush::ASYNC;
+                else usage();
+            }
+            break;
+            case 'S':
+            {
+                snapshotDir = optarg;
+            }
+            break;
+            case 's':
+            {
+                snapshotInterval = atoi(optarg);
+            }
+            break;
+            case 'i':
+            {
+                if(strcmp(optarg, "spin") == 0) idleConfig.mMode = IdleMode::SPIN;
+                else if(strcmp(optarg, "yield") == 0) idleConfig.mMode = IdleMode::SPIN_YIELD;
+                else if(strcmp(optarg, "block") == 0) idleConfig.mMode = IdleMode::BLOCK;
+                else usage();
+            }
+            break;
+            case 'B':
+            {
+                idleConfig.mBusyPollUs = atoi(optarg);
+            }
+            break;
+            case 'c':
+            {
+                idleConfig.mCore = atoi(optarg);
+            }
+            break;
+            case 'R':
+            {
+                idleConfig.mRtPriority = atoi(optarg);
+                pipelineConfig.mMatchRtPriority = idleConfig.mRtPriority;
+            }
+            break;
+            case 'u':
+            {
+                uring = true;
+            }
+            break;
+            case 'D':
+            {
+                orderUpdates = false;
             }
             break;
+            case 'e':
+            {
+                recoveryPath = optarg;
+            }
+            break;
+#ifdef REDHEADS_LATENCY
+            case 'L':
+            {
+                latencyInterval = atoi(optarg);
+            }
+            break;
+#endif
             default: usage();
         }
     }
 
+    if(recvBatch == 0 || recvRing < recvBatch) usage();
+
     sockFdRecv = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     sockFdBrdA = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     sockFdBrdB = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
@@ -106,19 +394,19 @@ int main()
     if (sockFdRecv == -1 || sockFdBrdA == -1 || sockFdBrdB == -1)
     {
         LOG_ERROR(" Creating sockets failed");
-        exit();
+        exit(1);
     }
 
-    make_socket_non_blocking(sockRecv);
-    make_socket_non_blocking(sockBrdA);
-    make_socket_non_blocking(sockBrdB);
+    make_socket_non_blocking(sockFdRecv);
+    make_socket_non_blocking(sockFdBrdA);
+    make_socket_non_blocking(sockFdBrdB);
 
-    if(setsockopt(sockBrdA, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval))== -1)
+    if(setsockopt(sockFdBrdA, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval))== -1)
     {
         LOG_ERROR("setsockopt failed");
         return -1;
     }
-    if(setsockopt(sockBrdB, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval))== -1)
+    if(setsockopt(sockFdBrdB, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval))== -1)
     {
         LOG_ERROR("setsockopt failed");
         return -1;
@@ -139,102 +427,91 @@ int main()
     brdAddrB.sin_addr.s_addr = htonl(publishAddrB);
     brdAddrB.sin_port = htons(publishPortB);
 
-    if(bind(sockRecv, (struct sockaddr*) &recvAddr, sizeof(recvAddr)) < 0)
+    if(bind(sockFdRecv, (struct sockaddr*) &recvAddr, sizeof(recvAddr)) < 0)
     {
         LOG_ERROR("binding to listen addr failed");
-        exit();
+        exit(1);
     }
 
-    epollFd = epoll_create(3);
-    if(epollFd == -1)
+    if(!SetBusyPoll(sockFdRecv, idleConfig.mBusyPollUs))
     {
-        LOG_ERROR("creating epoll failed");
-        exit();
+        LOG_ERROR("SO_BUSY_POLL failed, continuing without it");
     }
 
-    ev.data.fd = sockFdRecv;
-    ev.events = EPOLLIN | EPOLLET;
-    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, sockFdRecv, &ev) == -1)
+    if(connect(sockFdBrdA, (struct sockaddr*) &brdAddrA, sizeof(brdAddrA)) < 0 ||
+       connect(sockFdBrdB, (struct sockaddr*) &brdAddrB, sizeof(brdAddrB)) < 0)
     {
-        LOG_ERROR("epoll_ctl");
-        exit();
+        LOG_ERROR("connecting publish sockets failed");
+        exit(1);
     }
 
-    ev.data.fd = sockFdBrdA;
-    ev.events = EPOLLOUT | EPOLLET;
-    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, sockFdBrdA, &ev) == -1)
-    {
-        LOG_ERROR("epoll_ctl");
-        exit();
-    }
+    UdpIngest ingest(sockFdRecv, recvBatch, recvRing, BUFFSIZE);
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    Journal journal(journalConfig);
+    Snapshotter snapshotter(snapshotDir);
+    if(!snapshotDir.empty()) signal(SIGUSR1, snapshot);
+    RH_LATENCY(signal(SIGUSR2, latency));
 
-    ev.data.fd = sockFdBrdB;
-    ev.events = EPOLLOUT | EPOLLET;
-    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, sockFdBrdB, &ev) == -1)
+    if(pipelined)
     {
-        LOG_ERROR("epoll_ctl");
-        exit();
+        if(uring) LOG_ERROR("io_uring backend is single threaded only, the pipeline uses recvmmsg");
+        if(!recoveryPath.empty()) LOG_ERROR("Recovery is single threaded only, not served by the pipeline");
+        time_t nextSnapshot = time(nullptr) + snapshotInterval;
+        RH_LATENCY(time_t nextLatency = time(nullptr) + latencyInterval;)
+
+        /* Decode, match and publish run on their own threads */
+        Pipeline pipeline(ingest, sockFdBrdA, sockFdBrdB, pipelineConfig, 
+            snapshotDir.empty() ? nullptr : &snapshotter);
+        pipeline.Init(1000, 100000, 500);
+        pipeline.mEncoder.mOrderUpdates = orderUpdates;
+        restore(pipeline.mEngine, journal, journalConfig, snapshotter);
+        pipeline.Start();
+        while(!STOP)
+        {
+            sleep(1);
+            if(snapshot_due(nextSnapshot, snapshotInterval)) pipeline.RequestSnapshot();
+            RH_LATENCY(if(latency_due(nextLatency, latencyInterval)) pipeline.RequestLatencyDump());
+        }
+        pipeline.Stop();
+
+        ingest.mStats.Dump(stdout);
+        printf("published packets %lu batches %lu send errors %lu decode stalls %lu match stalls %lu\n",
+            pipeline.mPublisher.mPackets, pipeline.mPublisher.mBatches, pipeline.mPublisher.mSendErrors, 
+            pipeline.mDecodeStalls, pipeline.mWriter.mStalls);
+        printf("reclaimed slots %lu immediate cleanups %lu malformed requests %lu\n", pipeline.mEngine.mReclaimed,
+            pipeline.mEngine.mImmediateCleanups, pipeline.mEngine.mMalformed);
+        return 0;
     }
 
-    Engine engine;
-    engine.Init(1000, 100000, 500);
-
-    while(true)
+    if(uring)
     {
-        int numEvents = epoll_wait(epollFd, events, MAX_EVENTS, 0);
-        for (int i = 0; i < numEvents; i++)
+        UringPublisher uringPublisher(sockFdBrdA, sockFdBrdB, DEFAULT_PUB_RING);
+        UringIngest uringIngest(sockFdRecv, recvBatch, recvRing, BUFFSIZE);
+        if(uringPublisher.Init() && uringIngest.Init())
         {
-            if ((events[i].events & EPOLLERR) ||
-               (events[i].events & EPOLLHUP) ||
-               (!(events[i].events & EPOLLIN)))
-            {
-               /* An error has occured on this fd, or  the socket is not
-                * ready for reading (why were we notified then?)
-                */
-               LOG_ERROR("epoll error");
-               close(events[i].data.fd);
-               continue;
-            }
-            /* We have data on the fd waiting to be read. Read and
-            * display it. We must read whatever data is available
-            * completely, as we are running in edge-triggered mode
-            * and won't get a notification again for the same data.
-            */
-            else if ((events[i].events & EPOLLIN) && (sockFdRecv == events[i].data.fd))
-            {
-                while (1)
-                {
-                    /* Recieve the Data from Other system */
-                    if ((length = recvfrom(sockFdRecv, IN_BUF, BUFFSIZE, 0, NULL, NULL)) < 0)
-                    {
-                       LOG_ERROR("recvfrom");
-                       return -1;
-                    }
-                    else if(length == 0)
-                    {
-                       break;
-                    }
-                    else
-                    {
-                        // epoll udp
-                        //engine.HandleMsg();
-                        //if(periodicIdleJob)
-                        //{
-                        //    engine.ImmediateCleanup();
-                        //}
-                        /* Print The data */
-                        //printf("Recvd Byte length : %d",  length);
-                        //dumpData(IN_BUF, length);
-                    }
-                }
-            }
+            printf("io_uring backend%s\n", uringPublisher.mFixed ? "" : ", publish ring not registered");
+            run(uringIngest, uringPublisher, make_epoll(uringIngest.WaitFd()), idleConfig, journal,
+                journalConfig, snapshotter, snapshotInterval, latencyInterval,
+                orderUpdates, recoveryPath);
+            close(sockFdRecv);
+            close(sockFdBrdA);
+            close(sockFdBrdB);
+            return 0;
         }
+        LOG_ERROR("io_uring unavailable, falling back to epoll");
     }
 
+    if(!ingest.EnableRxTimestamps()) LOG_ERROR("SO_TIMESTAMPNS failed, no wakeup latency");
+    MdPublisher publisher(sockFdBrdA, sockFdBrdB, DEFAULT_PUB_RING);
+    run(ingest, publisher, make_epoll(sockFdRecv), idleConfig, journal, journalConfig, snapshotter,
+        snapshotInterval, latencyInterval, orderUpdates, recoveryPath);
+
     close(sockFdRecv);
     close(sockFdBrdA);
     close(sockFdBrdB);
 
     return 0;
 }
-
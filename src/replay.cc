@@ -0,0 +1,233 @@
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../lib/engine.h"
+#include "../lib/journal.h"
+
+using namespace redheads;
+
+#define MAX_MSG_IDS 256
+
+typedef std::chrono::steady_clock Clock;
+
+void usage()
+{
+    printf("rh_replay [-r REPEATS] [-L LEVELS] [-O ORDERS] [-C CLIENTS] CAPTURE\n"
+        "  CAPTURE is a journal directory or a file of journal records, such as\n"
+        "  a single journal segment\n");
+    exit(1);
+}
+
+// Folds every indication into a checksum so two builds can be compared
+struct ChecksumClient : IEngineClient
+{
+    void Handle(const BookClearInd&& ind)  { Add(EngMsgId::PART_BOOK_CLEAR_IND, ind); }
+    void Handle(const BookInsertInd&& ind) { Add(EngMsgId::PART_BOOK_INSERT_IND, ind); }
+    void Handle(const BookDeleteInd&& ind) { Add(EngMsgId::PART_BOOK_DELETE_IND, ind); }
+    void Handle(const BookAmendInd&& ind)  { Add(EngMsgId::PART_BOOK_AMEND_IND, ind); }
+    void Handle(const BookTradeInd&& ind)  { Add(EngMsgId::PART_BOOK_TRADE_IND, ind); }
+    void Handle(const BookSweepInd&& ind)  { Add(EngMsgId::PART_BOOK_SWEEP_IND, ind); }
+    void Handle(const BookFillInd&& ind)   { Add(EngMsgId::PART_BOOK_FILL_IND, ind); }
+    void Handle(const BookDepthInd&& ind)  { Add(EngMsgId::PART_BOOK_DEPTH_IND, ind); }
+    void Handle(const BookErrorInd&& ind)  { Add(ERROR_TAG, ind); }
+    void Handle(const EngAvailableBooksInd&& ind) { Add(EngMsgId::PART_BOOK_AVAIL_IND, ind); }
+    void Handle(const EngOperationCnf&& cnf) { Add(EngMsgId::PART_OP_CNF, cnf); }
+    void Handle(const EngOperationRangeCnf&& cnf) { Add(EngMsgId::PART_OP_RANGE_CNF, cnf); }
+    void Handle(const EngOperationRej&& rej) { Add(EngMsgId::PART_OP_REJ, rej); }
+
+    // Errors have no message id of their own
+    static constexpr uint64_t ERROR_TAG = 0xFF;
+
+    template<typename T>
+    inline void Add(EngMsgId msgId, const T& ind)
+    {
+        Add((uint64_t)msgId, ind);
+    }
+
+    template<typename T>
+    inline void Add(uint64_t tag, const T& ind)
+    {
+        mChecksum = JournalChecksum(reinterpret_cast<const char*>(&ind), sizeof(T), mChecksum ^ tag);
+        ++mIndications;
+    }
+
+    uint64_t mChecksum = 0;
+    uint64_t mIndications = 0;
+};
+
+struct Capture
+{
+    std::vector<char> mData;
+    std::vector<std::pair<size_t, size_t>> mMsgs; // offset and size into mData
+};
+
+bool read_file(const std::string& path, std::vector<char>& out)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    out.resize(st.st_size);
+    size_t done = 0;
+    while(done < out.size())
+    {
+        ssize_t got = read(fd, out.data() + done, out.size() - done);
+        if(got <= 0) break;
+        done += got;
+    }
+    close(fd);
+    out.resize(done);
+    return true;
+}
+
+// Appends the intact records of one file, returns false at the first empty
+// or torn record so nothing after a gap is replayed
+bool load_records(const std::string& path, Capture& capture)
+{
+    std::vector<char> file;
+    if(!read_file(path, file)) return false;
+
+    size_t offset = 0;
+    while(offset + sizeof(JournalRecordHeader) <= file.size())
+    {
+        JournalRecordHeader header;
+        memcpy(&header, file.data() + offset, sizeof(header));
+        if(header.mLength == END_OF_SEGMENT) return true;
+        if(header.mLength == 0) return false;
+
+        const char* body = file.data() + offset + sizeof(header);
+        if(offset + sizeof(header) + header.mLength > file.size() ||
+           JournalChecksum(body, header.mLength) != header.mChecksum)
+        {
+            fprintf(stderr, "%s truncated at %zu\n", path.c_str(), offset);
+            return false;
+        }
+
+        capture.mMsgs.emplace_back(capture.mData.size(), header.mLength);
+        capture.mData.insert(capture.mData.end(), body, body + header.mLength);
+        offset += sizeof(header) + header.mLength;
+    }
+    return false;
+}
+
+bool load_capture(const char* path, Capture& capture)
+{
+    struct stat st;
+    if(stat(path, &st) != 0) return false;
+    if(!S_ISDIR(st.st_mode))
+    {
+        load_records(path, capture);
+        return true;
+    }
+
+    JournalConfig config;
+    config.mDir = path;
+    Journal journal(config);
+    for(size_t i = 0, segments = journal.CountSegments(); i < segments; ++i)
+    {
+        if(!load_records(journal.SegmentPath(i), capture)) break;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    int c;
+    int repeats = 5;
+    size_t levels = 1000;
+    size_t orders = 100000;
+    size_t clients = 500;
+
+    while ((c = getopt (argc, argv, "r:L:O:C:")) != -1)
+    {
+        switch (c)
+        {
+            case 'r': repeats = atoi(optarg); break;
+            case 'L': levels = atol(optarg); break;
+            case 'O': orders = atol(optarg); break;
+            case 'C': clients = atol(optarg); break;
+            default: usage();
+        }
+    }
+    if(optind != argc - 1 || repeats < 1) usage();
+
+    Capture capture;
+    if(!load_capture(argv[optind], capture))
+    {
+        fprintf(stderr, "Cannot read %s\n", argv[optind]);
+        return 1;
+    }
+    if(capture.mMsgs.empty())
+    {
+        fprintf(stderr, "No messages in %s\n", argv[optind]);
+        return 1;
+    }
+    printf("replaying %zu messages, %zu bytes\n", capture.mMsgs.size(), capture.mData.size());
+
+    // Untimed per message, every repeat starts from an empty engine and
+    // must produce the same indications
+    uint64_t checksum = 0;
+    double best = 0;
+    for(int r = 0; r < repeats; ++r)
+    {
+        ChecksumClient client;
+        Engine engine(client);
+        engine.Init(levels, orders, clients);
+
+        auto start = Clock::now();
+        for(const auto& msg : capture.mMsgs) engine.HandleMsg(capture.mData.data() + msg.first, msg.second);
+        double secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+        double rate = capture.mMsgs.size() / secs;
+        printf("run %d: %.0f msgs/sec, %lu indications, checksum %016lx\n",
+            r, rate, client.mIndications, client.mChecksum);
+        if(r && client.mChecksum != checksum)
+        {
+            fprintf(stderr, "Replay is not deterministic\n");
+            return 1;
+        }
+        checksum = client.mChecksum;
+        best = std::max(best, rate);
+    }
+    printf("best %.0f msgs/sec\n", best);
+
+    // One more run timing each message, attributed to its request type
+    uint64_t nanos[MAX_MSG_IDS] = {};
+    uint64_t counts[MAX_MSG_IDS] = {};
+    {
+        ChecksumClient client;
+        Engine engine(client);
+        engine.Init(levels, orders, clients);
+        for(const auto& msg : capture.mMsgs)
+        {
+            const char* buf = capture.mData.data() + msg.first;
+            auto start = Clock::now();
+            engine.HandleMsg(buf, msg.second);
+            auto elapsed = Clock::now() - start;
+
+            if(msg.second < sizeof(EngOperationReq)) continue;
+            uint8_t msgId = (uint8_t)reinterpret_cast<const EngOperationReq*>(buf)->mMsgId;
+            nanos[msgId] += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+            ++counts[msgId];
+        }
+    }
+
+    printf("%8s %12s %10s\n", "msg id", "count", "ns/msg");
+    for(size_t i = 0; i < MAX_MSG_IDS; ++i)
+    {
+        if(counts[i]) printf("%8zu %12lu %10.1f\n", i, counts[i], (double)nanos[i] / counts[i]);
+    }
+    return 0;
+}